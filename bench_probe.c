@@ -0,0 +1,214 @@
+// The benchmark driver. It starts bench_target, records its loop lateness
+// for a while without probes as a baseline, then runs getenv against it a
+// number of times, and reports the probe rate, the wall time of each probe
+// and the lateness the target saw while it was being probed.
+//
+// Arguments after -- are passed on to getenv, e.g. -- --no-stop.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// the nearest rank percentile of the n sorted values
+static uint64_t percentile(const uint64_t *sorted, size_t n, int p) {
+  size_t rank = (n * p + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+// Ask the target for its histograms, and print them with label in front.
+// This also resets them.
+static int print_histograms(pid_t pid, FILE *from, const char *label) {
+  if (kill(pid, SIGUSR1)) {
+    perror("kill");
+    return -1;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), from) != NULL) {
+    if (strcmp(line, "end\n") == 0) {
+      return 0;
+    }
+    printf("%s %s", label, line);
+  }
+  fprintf(stderr, "bench_target went away\n");
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  long probes = 1000, idle_ms = 1000;
+  const char *getenv_path = "./getenv", *target_path = "./bench_target";
+  const char *var = "BENCH_0";
+  char *target_args[16] = {NULL};
+  int ntarget_args = 1;
+  int c;
+  while ((c = getopt(argc, argv, "p:w:g:b:e:n:s:t:i:")) != -1) {
+    switch (c) {
+    case 'p':
+      probes = strtol(optarg, NULL, 10);
+      break;
+    case 'w':
+      idle_ms = strtol(optarg, NULL, 10);
+      break;
+    case 'g':
+      getenv_path = optarg;
+      break;
+    case 'b':
+      target_path = optarg;
+      break;
+    case 'e':
+      var = optarg;
+      break;
+    case 'n':
+    case 's':
+    case 't':
+    case 'i':
+      if (ntarget_args + 2 >= (int)(sizeof(target_args) / sizeof(char *))) {
+        fprintf(stderr, "too many target arguments\n");
+        return 1;
+      }
+      target_args[ntarget_args++] = c == 'n'   ? "-n"
+                                    : c == 's' ? "-s"
+                                    : c == 't' ? "-t"
+                                               : "-i";
+      target_args[ntarget_args++] = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-p <probes>] [-w <idle ms>] [-e <var>] "
+              "[-g <getenv>] [-b <bench_target>]\n"
+              "       [-n <vars>] [-s <value size>] [-t <worker threads>] "
+              "[-i <loop interval in us>] [-- <getenv args>]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (probes <= 0 || idle_ms < 0) {
+    fprintf(stderr, "invalid arguments\n");
+    return 1;
+  }
+  target_args[0] = (char *)target_path;
+
+  // start the target with its stdout on a pipe, and wait until it is ready
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    return 1;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  pid_t target;
+  int err = posix_spawn(&target, target_path, &actions, NULL, target_args,
+                        environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", target_path, strerror(err));
+    return 1;
+  }
+  FILE *from = fdopen(fds[0], "r");
+  char line[64];
+  int ready;
+  if (from == NULL || fgets(line, sizeof(line), from) == NULL ||
+      sscanf(line, "ready %d", &ready) != 1 || ready != target) {
+    fprintf(stderr, "bench_target did not start\n");
+    return 1;
+  }
+
+  // the command line of a probe: getenv -p <pid> -e <var> [args...]
+  char pid_arg[16];
+  snprintf(pid_arg, sizeof(pid_arg), "%d", target);
+  int nextra = argc - optind;
+  char **probe_args = calloc(nextra + 6, sizeof(char *));
+  uint64_t *walls = calloc(probes, sizeof(uint64_t));
+  if (probe_args == NULL || walls == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  probe_args[0] = (char *)getenv_path;
+  probe_args[1] = "-p";
+  probe_args[2] = pid_arg;
+  probe_args[3] = "-e";
+  probe_args[4] = (char *)var;
+  memmove(probe_args + 5, argv + optind, nextra * sizeof(char *));
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+
+  int ret = 0;
+  struct timespec idle = {
+    .tv_sec = idle_ms / 1000, .tv_nsec = idle_ms % 1000 * 1000000,
+  };
+  if (print_histograms(target, from, "warmup") ||
+      nanosleep(&idle, NULL) ||
+      print_histograms(target, from, "idle")) {
+    ret = 1;
+    goto out;
+  }
+
+  long failed = 0;
+  uint64_t start = now_ns();
+  for (long i = 0; i < probes; i++) {
+    uint64_t before = now_ns();
+    pid_t probe;
+    int status;
+    err = posix_spawn(&probe, getenv_path, &actions, NULL, probe_args,
+                      environ);
+    if (err) {
+      fprintf(stderr, "%s: %s\n", getenv_path, strerror(err));
+      ret = 1;
+      goto out;
+    }
+    if (waitpid(probe, &status, 0) != probe) {
+      perror("waitpid");
+      ret = 1;
+      goto out;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+    walls[i] = now_ns() - before;
+  }
+  uint64_t elapsed = now_ns() - start;
+  if (print_histograms(target, from, "probed")) {
+    ret = 1;
+    goto out;
+  }
+
+  qsort(walls, probes, sizeof(uint64_t), compare_u64);
+  printf("probes=%ld failed=%ld seconds=%.3f probes_per_sec=%.1f\n", probes,
+         failed, elapsed / 1e9, probes / (elapsed / 1e9));
+  printf("probe_wall_p50_us=%.1f probe_wall_p99_us=%.1f "
+         "probe_wall_max_us=%.1f\n",
+         percentile(walls, probes, 50) / 1e3,
+         percentile(walls, probes, 99) / 1e3, walls[probes - 1] / 1e3);
+  ret = failed != 0;
+
+out:
+  posix_spawn_file_actions_destroy(&actions);
+  kill(target, SIGKILL);
+  waitpid(target, NULL, 0);
+  return ret;
+}
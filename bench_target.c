@@ -0,0 +1,203 @@
+// A tracee for benchmarking getenv. It sets up an environment of a
+// configurable size, and then runs a timed loop on the main thread and on a
+// number of worker threads. Every loop sleeps until its next deadline and
+// records how late it woke up, so a probe that stops a thread shows up as a
+// latency spike. SIGUSR1 prints the lateness histograms to stdout and resets
+// them, SIGTERM prints them and exits.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// buckets of lateness: bucket i counts wakeups less than 2^i us late
+#define BUCKETS 24
+
+struct histogram {
+  uint64_t counts[BUCKETS];
+  uint64_t max_ns;
+};
+
+struct loop {
+  struct histogram hist;
+  long interval_ns;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct histogram *hist, uint64_t late_ns) {
+  int bucket = 0;
+  for (uint64_t us = late_ns / 1000; us > 0 && bucket < BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+  __atomic_fetch_add(&hist->counts[bucket], 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+  while (late_ns > max &&
+         !__atomic_compare_exchange_n(&hist->max_ns, &max, late_ns, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void *run_loop(void *arg) {
+  struct loop *loop = arg;
+  uint64_t deadline = now_ns();
+  for (;;) {
+    deadline += loop->interval_ns;
+    struct timespec ts = {
+      .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+    uint64_t now = now_ns();
+    record(&loop->hist, now - deadline);
+    // after a long stall, start over instead of catching up
+    if (now - deadline > (uint64_t)loop->interval_ns) {
+      deadline = now;
+    }
+  }
+  return NULL;
+}
+
+// Print a histogram as one line: its name, the number of wakeups, the
+// maximum lateness, and then "<bound_us>:<count>" for every bucket in use.
+static void print_histogram(const char *name, struct histogram *hist) {
+  uint64_t total = 0;
+  printf("%s", name);
+  for (int i = 0; i < BUCKETS; i++) {
+    total += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+  }
+  printf(" wakeups=%" PRIu64 " max_ns=%" PRIu64, total,
+         __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED));
+  for (int i = 0; i < BUCKETS; i++) {
+    uint64_t count = __atomic_exchange_n(&hist->counts[i], 0, __ATOMIC_RELAXED);
+    if (count) {
+      printf(" %llu:%" PRIu64, 1ULL << i, count);
+    }
+  }
+  __atomic_store_n(&hist->max_ns, 0, __ATOMIC_RELAXED);
+  printf("\n");
+}
+
+// reports the histograms when it gets a signal, so the loops never do
+static void *report(void *arg) {
+  struct loop *loops = arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGTERM);
+  for (;;) {
+    int sig;
+    if (sigwait(&set, &sig)) {
+      continue;
+    }
+    struct histogram workers = {0};
+    for (struct loop *loop = loops + 1; loop->interval_ns; loop++) {
+      for (int i = 0; i < BUCKETS; i++) {
+        workers.counts[i] +=
+            __atomic_exchange_n(&loop->hist.counts[i], 0, __ATOMIC_RELAXED);
+      }
+      uint64_t max = __atomic_exchange_n(&loop->hist.max_ns, 0,
+                                         __ATOMIC_RELAXED);
+      if (max > workers.max_ns) {
+        workers.max_ns = max;
+      }
+    }
+    print_histogram("main", &loops[0].hist);
+    print_histogram("workers", &workers);
+    printf("end\n");
+    fflush(stdout);
+    if (sig == SIGTERM) {
+      exit(0);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  long vars = 100, size = 64, threads = 4, interval_us = 1000;
+  int c;
+  while ((c = getopt(argc, argv, "n:s:t:i:")) != -1) {
+    switch (c) {
+    case 'n':
+      vars = strtol(optarg, NULL, 10);
+      break;
+    case 's':
+      size = strtol(optarg, NULL, 10);
+      break;
+    case 't':
+      threads = strtol(optarg, NULL, 10);
+      break;
+    case 'i':
+      interval_us = strtol(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <vars>] [-s <value size>] "
+              "[-t <worker threads>] [-i <loop interval in us>]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (vars < 0 || size < 0 || threads < 0 || interval_us <= 0) {
+    fprintf(stderr, "invalid arguments\n");
+    return 1;
+  }
+
+  // BENCH_0 ... BENCH_<n-1>, each with a value of size bytes
+  char *value = malloc(size + 1);
+  if (value == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  memset(value, 'x', size);
+  value[size] = '\0';
+  for (long i = 0; i < vars; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "BENCH_%ld", i);
+    if (setenv(name, value, 1)) {
+      perror("setenv");
+      return 1;
+    }
+  }
+  free(value);
+
+  // the loops are terminated by one with an interval of 0
+  struct loop *loops = calloc(threads + 2, sizeof(struct loop));
+  if (loops == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  for (long i = 0; i <= threads; i++) {
+    loops[i].interval_ns = interval_us * 1000;
+  }
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, report, loops);
+  for (long i = 1; err == 0 && i <= threads; i++) {
+    err = pthread_create(&thread, NULL, run_loop, &loops[i]);
+  }
+  if (err) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    return 1;
+  }
+
+  printf("ready %d\n", getpid());
+  fflush(stdout);
+  run_loop(&loops[0]);
+  return 0;
+}
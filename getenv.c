@@ -1,456 +1,1024 @@
-#include <assert.h>
+#define _GNU_SOURCE
+
 #include <ctype.h>
-#include <dlfcn.h>
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdbool.h>
 #include <string.h>
-#include <sys/ptrace.h>
-#include <sys/mman.h>
 #include <sys/types.h>
-#include <sys/user.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-/* #define DEBUG */
-
-// number of bytes in a JMP/CALL rel32 instruction
-#define REL32_SZ 5
+#include "libgetenv.h"
 
-// text seen in /proc/<pid>/maps for text areas
-static const char *text_area = " r-xp ";
+// add a variable name to the list of queries, growing it as needed
+int add_query(const char ***names, size_t *n, const char *name) {
+  const char **grown = realloc(*names, (*n + 1) * sizeof(char *));
+  if (grown == NULL) {
+    perror("realloc");
+    return -1;
+  }
+  grown[*n] = name;
+  *names = grown;
+  (*n)++;
+  return 0;
+}
 
-// this should be a string that will uniquely identify libc in /proc/<pid>/maps
-static const char *libc_string = "/libc";
+// add an update to the list, growing it as needed; the name of a
+// "VAR=value" argument of -s is split off in place
+int add_update(struct remote_update **updates, size_t *n, char *arg,
+               bool set) {
+  char *value = NULL;
+  if (set) {
+    value = strchr(arg, '=');
+    if (value == NULL) {
+      fprintf(stderr, "-s needs a VAR=value argument\n");
+      return -1;
+    }
+    *value++ = '\0';
+  }
+  struct remote_update *grown =
+      realloc(*updates, (*n + 1) * sizeof(struct remote_update));
+  if (grown == NULL) {
+    perror("realloc");
+    return -1;
+  }
+  grown[*n] = (struct remote_update){.name = arg, .value = value};
+  *updates = grown;
+  (*n)++;
+  return 0;
+}
 
-// find the location of a shared library in memory
-void *find_library(pid_t pid, const char *libname) {
-  char filename[32];
-  snprintf(filename, sizeof(filename), "/proc/%d/maps", pid);
-  FILE *f = fopen(filename, "r");
+// read variable names from filename, one per line, skipping empty lines
+int add_queries_from_file(const char ***names, size_t *n,
+                          const char *filename) {
+  FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
   char *line = NULL;
   size_t line_size = 0;
-
-  while (getline(&line, &line_size, f) >= 0) {
-    char *pos = strstr(line, libname);
-    if (pos != NULL && strstr(line, text_area) && (pos[strlen(libc_string)] < 'a' || pos[strlen(libc_string)] > 'z')) {
-      long val = strtol(line, NULL, 16);
-      free(line);
-      fclose(f);
-      return (void *)val;
+  ssize_t len;
+  int ret = 0;
+  while ((len = getline(&line, &line_size, f)) >= 0) {
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    char *name = strdup(line);
+    if (name == NULL || add_query(names, n, name)) {
+      free(name);
+      ret = -1;
+      break;
     }
   }
   free(line);
-  fclose(f);
-  return NULL;
+  if (f != stdin) {
+    fclose(f);
+  }
+  return ret;
 }
 
-// Update the text area of pid at the area starting at where. The data copied
-// should be in the new_text buffer whose size is given by len. If old_text is
-// not null, the original text data will be copied into it. Therefore old_text
-// must have the same size as new_text.
-int poke_text(pid_t pid, void *where, void *new_text, void *old_text,
-              size_t len) {
-  if (len % sizeof(void *) != 0) {
-    fprintf(stderr, "invalid len, not a multiple of %zd\n", sizeof(void *));
+// add a pid to the list of processes to query, growing it as needed
+int add_pid(pid_t **pids, size_t *npids, long pid) {
+  if (pid <= 0 || pid > INT_MAX) {
+    fprintf(stderr, "invalid pid %ld\n", pid);
     return -1;
   }
+  pid_t *grown = realloc(*pids, (*npids + 1) * sizeof(pid_t));
+  if (grown == NULL) {
+    perror("realloc");
+    return -1;
+  }
+  grown[*npids] = (pid_t)pid;
+  *pids = grown;
+  (*npids)++;
+  return 0;
+}
 
-  long poke_data;
-  for (size_t copied = 0; copied < len; copied += sizeof(poke_data)) {
-    memmove(&poke_data, new_text + copied, sizeof(poke_data));
-    if (old_text != NULL) {
-      errno = 0;
-      long peek_data = ptrace(PTRACE_PEEKTEXT, pid, where + copied, NULL);
-      if (peek_data == -1 && errno) {
-        perror("PTRACE_PEEKTEXT");
-        return -1;
-      }
-      memmove(old_text + copied, &peek_data, sizeof(peek_data));
+// add all processes whose name matches the extended regular expression
+// pattern, like pgrep(1) does
+int add_pids_from_pattern(pid_t **pids, size_t *npids, const char *pattern) {
+  regex_t re;
+  int err = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB);
+  if (err) {
+    char msg[256];
+    regerror(err, &re, msg, sizeof(msg));
+    fprintf(stderr, "invalid pattern %s: %s\n", pattern, msg);
+    return -1;
+  }
+  DIR *dir = opendir("/proc");
+  if (dir == NULL) {
+    perror("/proc");
+    regfree(&re);
+    return -1;
+  }
+  int ret = 0;
+  struct dirent *entry;
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char *end;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0 || pid == getpid()) {
+      continue;
     }
-    if (ptrace(PTRACE_POKETEXT, pid, where + copied, (void *)poke_data) < 0) {
-      perror("PTRACE_POKETEXT");
-      return -1;
+    char filename[64], comm[32];
+    snprintf(filename, sizeof(filename), "/proc/%ld/comm", pid);
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+      continue;
     }
+    if (fgets(comm, sizeof(comm), f) != NULL) {
+      comm[strcspn(comm, "\n")] = '\0';
+      if (regexec(&re, comm, 0, NULL, 0) == 0) {
+        ret = add_pid(pids, npids, pid);
+      }
+    }
+    fclose(f);
   }
-  return 0;
+  closedir(dir);
+  regfree(&re);
+  return ret;
 }
 
-int do_wait(const char *name) {
-  int status;
-  if (wait(&status) == -1) {
-    perror("wait");
+// add all processes in a cgroup, given as a path to its directory either in
+// the cgroup filesystem or relative to /sys/fs/cgroup
+int add_pids_from_cgroup(pid_t **pids, size_t *npids, const char *cgroup) {
+  char filename[PATH_MAX];
+  if (strncmp(cgroup, "/sys/fs/cgroup", strlen("/sys/fs/cgroup")) == 0) {
+    snprintf(filename, sizeof(filename), "%s/cgroup.procs", cgroup);
+  } else {
+    snprintf(filename, sizeof(filename), "/sys/fs/cgroup/%s/cgroup.procs",
+             cgroup);
+  }
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
     return -1;
   }
-  if (WIFSTOPPED(status)) {
-    if (WSTOPSIG(status) == SIGTRAP) {
-      return 0;
+  long pid;
+  int ret = 0;
+  while (ret == 0 && fscanf(f, "%ld", &pid) == 1) {
+    if (pid != getpid()) {
+      ret = add_pid(pids, npids, pid);
     }
-    fprintf(stderr, "%s unexpectedly got status %s\n", name, strsignal(status));
-    return -1;
   }
-  fprintf(stderr, "%s got unexpected status %d\n", name, status);
-  return -1;
+  fclose(f);
+  return ret;
+}
+
+enum format {
+  FORMAT_TEXT, // one line per value
+  FORMAT_NUL,  // the same, but terminated with NULs instead
+  FORMAT_JSON, // one JSON object per line and variable
+};
+
+// what to do for each process
+struct options {
+  const char *const *names;
+  size_t n;
+  const struct remote_update *updates; // if set, one for each of the names
+  bool dump;
+  bool prefix; // prefix each line of output with the pid
+  bool agent;  // go through the resident agent
+  bool unload; // stop the resident agent
+  bool mirror;  // answer from the mirror kept by uprobes
+  bool unmirror; // remove the mirror
+  bool consistent; // freeze all threads of the process, not just one
+  bool no_stop; // try to read without stopping the process first
+  bool stats;   // print how long each phase took
+  enum format format;
+};
 
+// print the --stats line of a query to stderr
+static void print_stats(pid_t pid, const struct remote_stats *s, int ret) {
+  char line[512];
+  int len = snprintf(line, sizeof(line), "stats pid=%d ok=%d", pid, ret == 0);
+  for (int i = 0; i < REMOTE_NPHASES; i++) {
+    len += snprintf(line + len, sizeof(line) - len, " %s_ns=%" PRIu64,
+                    remote_phase_names[i], s->ns[i]);
+  }
+  fprintf(stderr, "%s pause_ns=%" PRIu64 "\n", line, s->pause);
 }
 
-int singlestep(pid_t pid) {
-  if (ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL)) {
-    perror("PTRACE_SINGLESTEP");
-    return -1;
+// The output of a query, gathered so it can be written with a single
+// writev(2) once the query is done, and never interleaves with that of
+// another process. Short pieces, like separators and escaped strings, are
+// copied into buf; long ones, like the values, are referenced where they are
+// in the arena, which is not reused before the output is written.
+struct output {
+  struct piece {
+    const char *data; // or NULL if the piece is at off in buf
+    size_t off;
+    size_t len;
+  } *pieces;
+  size_t npieces, pieces_cap;
+  char *buf;
+  size_t len, size;
+  bool failed; // if it could not grow, and nothing is written
+};
+
+// pieces at least this long are referenced, not copied
+#define OUTPUT_REF_MIN 64
+
+static struct piece *out_piece(struct output *o) {
+  if (o->npieces == o->pieces_cap) {
+    size_t cap = o->pieces_cap ? o->pieces_cap * 2 : 64;
+    struct piece *grown = realloc(o->pieces, cap * sizeof(struct piece));
+    if (grown == NULL) {
+      perror("realloc");
+      o->failed = true;
+      return NULL;
+    }
+    o->pieces = grown;
+    o->pieces_cap = cap;
   }
-  return do_wait("PTRACE_SINGLESTEP");
+  return &o->pieces[o->npieces++];
 }
 
-void check_yama(void) {
-  FILE *yama_file = fopen("/proc/sys/kernel/yama/ptrace_scope", "r");
-  if (yama_file == NULL) {
+// Add len bytes at data to the output. If ref is set, data stays valid until
+// the output is written, and need not be copied.
+static void out_bytes(struct output *o, const char *data, size_t len,
+                      bool ref) {
+  if (o->failed || len == 0) {
     return;
   }
-  char yama_buf[8];
-  memset(yama_buf, 0, sizeof(yama_buf));
-  if (fread(yama_buf, 1, sizeof(yama_buf), yama_file) == 0) {
-      fprintf(stderr, "Could not read yama file\n");
+  if (ref && len >= OUTPUT_REF_MIN) {
+    struct piece *p = out_piece(o);
+    if (p != NULL) {
+      *p = (struct piece){.data = data, .len = len};
+    }
+    return;
+  }
+  if (o->len + len > o->size) {
+    size_t size = o->size ? o->size : 4096;
+    while (size < o->len + len) {
+      size *= 2;
+    }
+    char *grown = realloc(o->buf, size);
+    if (grown == NULL) {
+      perror("realloc");
+      o->failed = true;
+      return;
+    }
+    o->buf = grown;
+    o->size = size;
   }
-  if (strcmp(yama_buf, "0\n") != 0) {
-    fprintf(stderr, "\nThe likely cause of this failure is that your system has "
-           "kernel.yama.ptrace_scope = %s",
-           yama_buf);
-    fprintf(stderr, "If you would like to disable Yama, you can run: "
-           "sudo sysctl kernel.yama.ptrace_scope=0\n");
+  memcpy(o->buf + o->len, data, len);
+  struct piece *last = o->npieces ? &o->pieces[o->npieces - 1] : NULL;
+  if (last != NULL && last->data == NULL && last->off + last->len == o->len) {
+    last->len += len;
+  } else if ((last = out_piece(o)) != NULL) {
+    *last = (struct piece){.off = o->len, .len = len};
   }
-  fclose(yama_file);
+  o->len += len;
 }
 
-int32_t compute_jmp(void *from, void *to) {
-  int64_t delta = (int64_t)to - (int64_t)from - REL32_SZ;
-  if (delta < INT_MIN || delta > INT_MAX) {
-    fprintf(stderr, "cannot do relative jump of size %li; did you compile with -fPIC?\n",
-           delta);
-    exit(1);
+static void out_str(struct output *o, const char *s) {
+  out_bytes(o, s, strlen(s), false);
+}
+
+static void out_char(struct output *o, char c) {
+  out_bytes(o, &c, 1, false);
+}
+
+// Write the output to fd, and empty it. A lock keeps the output of the
+// threads from interleaving when a write is short.
+static int out_flush(struct output *o, int fd) {
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  struct iovec iov[IOV_MAX];
+  int ret = o->failed ? -1 : 0;
+  size_t i = 0, done = 0; // pieces[i] has done bytes written already
+  pthread_mutex_lock(&lock);
+  while (ret == 0 && i < o->npieces) {
+    int n = 0;
+    for (size_t j = i; j < o->npieces && n < IOV_MAX; j++, n++) {
+      const struct piece *p = &o->pieces[j];
+      const char *data = p->data != NULL ? p->data : o->buf + p->off;
+      size_t skip = j == i ? done : 0;
+      iov[n].iov_base = (char *)data + skip;
+      iov[n].iov_len = p->len - skip;
+    }
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno != EINTR) {
+        perror("writev");
+        ret = -1;
+      }
+      continue;
+    }
+    done += written;
+    while (i < o->npieces && done >= o->pieces[i].len) {
+      done -= o->pieces[i++].len;
+    }
   }
-  return (int32_t)delta;
+  pthread_mutex_unlock(&lock);
+  o->npieces = 0;
+  o->len = 0;
+  o->failed = false;
+  return ret;
 }
 
-int getenv_process(pid_t pid, char* env) {
-  // attach to the process
-  if (ptrace(PTRACE_ATTACH, pid, NULL, NULL)) {
-    perror("PTRACE_ATTACH");
-    check_yama();
-    return -1;
+// the length of the name of a "VAR=value" string
+static size_t var_name_len(const char *var) {
+  const char *eq = strchr(var, '=');
+  return eq != NULL ? (size_t)(eq - var) : strlen(var);
+}
+
+// write the len bytes at s to out as a JSON string
+static void json_string(struct output *out, const char *s, size_t len) {
+  out_char(out, '"');
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out_char(out, '\\');
+      out_char(out, c);
+    } else if (c == '\n') {
+      out_str(out, "\\n");
+    } else if (c == '\t') {
+      out_str(out, "\\t");
+    } else if (c < 0x20 || c == 0x7f) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out_str(out, escape);
+    } else {
+      out_char(out, c);
+    }
   }
+  out_char(out, '"');
+}
 
-  // wait for the process to actually stop
-  if (waitpid(pid, 0, WSTOPPED) == -1) {
-    perror("wait");
-    return -1;
+// the value of a "VAR=value" string as a JSON string, or null
+static void json_value(struct output *out, const char *var) {
+  if (var == NULL) {
+    out_str(out, "null");
+  } else {
+    const char *value = var + var_name_len(var) + 1;
+    json_string(out, value, strlen(value));
   }
+}
 
-  // save the register state of the remote process
-  struct user_regs_struct oldregs;
-  if (ptrace(PTRACE_GETREGS, pid, NULL, &oldregs)) {
-    perror("PTRACE_GETREGS");
-    ptrace(PTRACE_DETACH, pid, NULL, NULL);
-    return -1;
+// Add one value to the output of a query of pid: in the text formats, the
+// value alone if name is NULL, or name=value, and in JSON an object that
+// also tells whether the variable is set at all.
+static void out_value(struct output *o, const struct options *opts, pid_t pid,
+                      const char *name, size_t name_len,
+                      const struct remote_value *value) {
+  char number[32];
+  if (opts->format == FORMAT_JSON) {
+    snprintf(number, sizeof(number), "{\"pid\":%d,\"key\":", pid);
+    out_str(o, number);
+    json_string(o, name, name_len);
+    if (value->value == NULL) {
+      out_str(o, ",\"set\":false,\"value\":null}\n");
+    } else {
+      out_str(o, ",\"set\":true,\"value\":");
+      json_string(o, value->value, value->len);
+      out_str(o, "}\n");
+    }
+    return;
   }
-  void *rip = (void *)oldregs.rip;
-  #ifdef DEBUG
-  fprintf(stderr, "their %%rip           %p\n", rip);
-  #endif
-
-  // First, we are going to allocate some memory for ourselves so we don't
-  // need
-  // to stop on the remote process' memory. We will do this by directly
-  // invoking
-  // the mmap(2) system call and asking for a single page.
-  struct user_regs_struct newregs;
-  memmove(&newregs, &oldregs, sizeof(newregs));
-  newregs.rax = 9;                           // mmap
-  newregs.rdi = 0;                           // addr
-  newregs.rsi = PAGE_SIZE;                   // length
-  newregs.rdx = PROT_READ | PROT_EXEC;       // prot
-  newregs.r10 = MAP_PRIVATE | MAP_ANONYMOUS; // flags
-  newregs.r8 = -1;                           // fd
-  newregs.r9 = 0;                            //  offset
-
-  uint8_t old_word[8];
-  uint8_t new_word[8];
-  new_word[0] = 0x0f; // SYSCALL
-  new_word[1] = 0x05; // SYSCALL
-  new_word[2] = 0xff; // JMP %rax
-  new_word[3] = 0xe0; // JMP %rax
-
-  // insert the SYSCALL instruction into the process, and save the old word
-  if (poke_text(pid, rip, new_word, old_word, sizeof(new_word))) {
-    goto fail;
-  }
-
-  // set the new registers with our syscall arguments
-  if (ptrace(PTRACE_SETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_SETREGS");
-    goto fail;
-  }
-
-  // invoke mmap(2)
-  if (singlestep(pid)) {
-    goto fail;
-  }
-
-  // read the new register state, so we can see where the mmap went
-  if (ptrace(PTRACE_GETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_GETREGS");
+  if (opts->prefix) {
+    snprintf(number, sizeof(number), "%d: ", pid);
+    out_str(o, number);
+  }
+  if (name != NULL) {
+    out_bytes(o, name, name_len, false);
+    out_char(o, '=');
+  }
+  out_bytes(o, value->value, value->len, true);
+  out_char(o, opts->format == FORMAT_NUL ? '\0' : '\n');
+}
+
+// the most memory the results of a single query may take
+#define ARENA_MAX ((size_t)1 << 30)
+
+// Make the arena twice as large, after a query did not fit in it. Returns -1
+// if it cannot grow any more.
+static int grow_arena(struct remote_arena *arena) {
+  size_t size = arena->size ? arena->size * 2 : 64 * 1024;
+  char *base = size <= ARENA_MAX ? realloc(arena->base, size) : NULL;
+  if (base == NULL) {
+    fprintf(stderr, "the results do not fit in %zu bytes\n", arena->size);
     return -1;
   }
+  *arena = (struct remote_arena){.base = base, .size = size};
+  return 0;
+}
 
-  // this is the address of the memory we allocated
-  void *mmap_memory = (void *)newregs.rax;
-  if (mmap_memory == (void *)-1) {
-    fprintf(stderr, "failed to mmap\n");
-    goto fail;
+// The arena of the queries on this thread. It is reused for every process,
+// so once it is large enough a query allocates nothing for its results; if
+// one does not fit, the arena grows and the query is done again. The output
+// is reused the same way.
+static __thread struct remote_arena arena;
+static __thread struct output output;
+
+// Add the values of the variables of opts to the output. In the text
+// formats, a single variable is printed as is, several are printed as
+// VAR=value and unset ones are skipped.
+static void out_values(struct output *o, const struct options *opts,
+                       pid_t pid, const struct remote_value *values) {
+  for (size_t i = 0; i < opts->n; i++) {
+    if (values[i].value == NULL && opts->format != FORMAT_JSON) {
+      continue;
+    }
+    const char *name = opts->n == 1 && opts->format != FORMAT_JSON
+                           ? NULL : opts->names[i];
+    out_value(o, opts, pid, name, name ? strlen(name) : 0, &values[i]);
   }
-  #ifdef DEBUG
-  fprintf(stderr, "allocated memory at  %p\n", mmap_memory);
+}
 
-  fprintf(stderr, "executing jump to mmap region\n");
-  #endif
-  if (singlestep(pid)) {
-    goto fail;
+// Print the stats and the output o of the query of pid, which returned ret.
+static int finish_pid(pid_t pid, const struct options *opts, int ret,
+                      const struct remote_stats *s, uint64_t *pause,
+                      struct output *o) {
+  if (opts->stats) {
+    print_stats(pid, s, ret);
+    *pause = s->pause;
   }
+  if (out_flush(o, STDOUT_FILENO)) {
+    ret = -1;
+  }
+  return ret;
+}
 
-  if (ptrace(PTRACE_GETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_GETREGS");
-    goto fail;
+// Query a single process, and print all of its output at once, so the
+// output of different processes is never interleaved. With --stats, the
+// time the process was stopped for is stored in *pause.
+int query_pid(pid_t pid, const struct options *opts, uint64_t *pause) {
+  // start with some room, or the first query would stop the process only
+  // to find that its results do not fit
+  if (arena.size == 0 && grow_arena(&arena)) {
+    return -1;
   }
-  if (newregs.rip == (long)mmap_memory) {
-    #ifdef DEBUG
-    fprintf(stderr, "successfully jumped to mmap area\n");
-    #endif
-  } else {
-    fprintf(stderr, "unexpectedly jumped to %p\n", (void *)newregs.rip);
-    goto fail;
-  }
-
-  // Calculate the position of the getenv routine in the other process'
-  // address
-  // space. This is a little bit tricky because of ASLR on Linux. What we do
-  // is
-  // we find the offset in memory that libc has been loaded in their process,
-  // and then we find the offset in memory that libc has been loaded in our
-  // process. Then we take the delta betwen our getenv and our libc start,
-  // and
-  // assume that the same delta will apply to the other process.
-  //
-  // For this mechanism to work, this program must be compiled with -fPIC to
-  // ensure that our getenv has an address relative to the one in libc.
-  //
-  // Additionally, this could fail if libc has been updated since the remote
-  // process has been restarted. This is a pretty unlikely situation, but if
-  // the
-  // remote process has been running for a long time and you update libc, the
-  // offset of the symbols could have changed slightly.
-  void *their_libc = find_library(pid, libc_string);
-  void *our_libc = find_library(getpid(), libc_string);
-  void *their_getenv = their_libc + ((void *)getenv - our_libc);
-  /* FILE *their_stderr = their_libc + ((void *)stderr - our_libc); */
-  #ifdef DEBUG
-  fprintf(stderr, "their libc           %p\n", their_libc);
-  fprintf(stderr, "their getenv        %p\n", their_getenv);
-  /* fprintf(stderr, "their stderr         %p\n", their_stderr); */
-  #endif
-
-  // We want to make a call like:
-  //
-  //   getenv(stderr, "instruction pointer = %p\n", rip);
-  //
-  // To do this we're going to do the following:
-  //
-  //   * put a CALL instruction into the mmap area that calls getenv
-  //   * put a TRAP instruction right after the CALL
-  //   * put the format string right after the TRAP
-  //   * use the TRAP to restore the original text/program state
-
-  size_t memsize = strlen(env) + 6;
-  size_t blocksize = 32;
-  while (blocksize < memsize) blocksize <<= 1;
-
-  // memory we are going to copy into our mmap area
-  uint8_t *new_text = calloc(blocksize, sizeof(uint8_t));
-
-  // insert a CALL instruction
-  size_t offset = 0;
-  new_text[offset++] = 0xe8; // CALL rel32
-  int32_t getenv_delta = compute_jmp(mmap_memory, their_getenv);
-  memmove(new_text + offset, &getenv_delta, sizeof(getenv_delta));
-  offset += sizeof(getenv_delta);
-
-  // insert a TRAP instruction
-  new_text[offset++] = 0xcc;
-
-  // copy our getenv format string right after the TRAP instruction
-  memmove(new_text + offset, env, strlen(env));
-
-  // update the mmap area
-  #ifdef DEBUG
-  fprintf(stderr, "inserting code/data into the mmap area at %p\n", mmap_memory);
-  #endif
-  if (poke_text(pid, mmap_memory, new_text, NULL, blocksize)) {
-    goto fail;
-  }
-  free(new_text);
-
-  if (poke_text(pid, rip, new_word, NULL, sizeof(new_word))) {
-    goto fail;
-  }
-
-  // set up our registers with the args to getenv
-  // memmove(&newregs, &oldregs, sizeof(newregs));
-  newregs.rax = 0;                          // no vector registers are used
-  /* newregs.rdi = (long)their_stderr;         // pointer to stderr in the caller */
-  newregs.rdi = (long)mmap_memory + offset; // pointer to the format string
-  /* newregs.rdx = oldregs.rip;                // the integer we want to print */
-
-  #ifdef DEBUG
-  fprintf(stderr, "setting the registers of the remote process\n");
-  #endif
-  if (ptrace(PTRACE_SETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_SETREGS");
-    goto fail;
-  }
-
-  // continue the program, and wait for the trap
-  #ifdef DEBUG
-  fprintf(stderr, "continuing execution\n");
-  #endif
-  ptrace(PTRACE_CONT, pid, NULL, NULL);
-  if (do_wait("PTRACE_CONT")) {
-    goto fail;
-  }
-
-  if (ptrace(PTRACE_GETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_GETREGS");
-    goto fail;
-  }
-  char* offs = (char*) newregs.rax;
-  if (offs != NULL) {
-    while (true) {
-      uint32_t data = ptrace(PTRACE_PEEKDATA, pid, offs, NULL);
-      offs += 4;
-      if (data << 24 < 0x1000000 || data << 16 < 0x1000000 ||
-          data << 8 < 0x1000000 || data < 0x1000000) {
-        break;
+  struct remote_stats query_stats = {{0}};
+  remote_set_stats(opts->stats ? &query_stats : NULL);
+  int flags = (opts->no_stop ? REMOTE_NO_STOP : 0) |
+              (opts->agent ? REMOTE_AGENT : 0) |
+              (opts->mirror ? REMOTE_MIRROR : 0) |
+              (opts->consistent ? REMOTE_CONSISTENT : 0);
+  int ret;
+  if (opts->unload) {
+    ret = remote_unload(pid);
+  } else if (opts->unmirror) {
+    ret = remote_unmirror(pid);
+  } else if (opts->dump) {
+    struct remote_value *vars;
+    size_t count;
+    do {
+      arena.used = 0;
+      ret = remote_environ(pid, flags, &arena, &vars, &count);
+      if (ret == 0 && opts->n != 0) {
+        ret = remote_environ_filter(opts->names, opts->n, &arena, vars,
+                                    &count);
+      }
+    } while (ret && errno == ENOBUFS && grow_arena(&arena) == 0);
+    if (ret == 0) {
+      for (size_t i = 0; i < count; i++) {
+        if (opts->format == FORMAT_JSON) {
+          // split a "VAR=value" string, and take one without a '=' as set
+          // to an empty value
+          size_t name_len = var_name_len(vars[i].value);
+          size_t skip = name_len < vars[i].len ? name_len + 1 : name_len;
+          struct remote_value value = {
+            .value = vars[i].value + skip, .len = vars[i].len - skip,
+          };
+          out_value(&output, opts, pid, vars[i].value, name_len, &value);
+        } else {
+          out_value(&output, opts, pid, NULL, 0, &vars[i]);
+        }
       }
     }
-    size_t slen = (size_t)(offs - newregs.rax);
-    char *buf = malloc(sizeof(char) * (slen + 1));
-    offs = (char *)newregs.rax;
-    for (size_t i = 0; i < slen / 4; i++) {
-      uint32_t data = ptrace(PTRACE_PEEKDATA, pid, offs, NULL);
-      offs += 4;
-      ((uint32_t *)buf)[i] = data;
+  } else {
+    struct remote_value *values = calloc(opts->n, sizeof(struct remote_value));
+    if (values == NULL) {
+      perror("calloc");
+      return -1;
     }
-    printf("%s\n", buf);
-    free(buf);
-  }
-  newregs.rax = (long)rip;
-  if (ptrace(PTRACE_SETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_SETREGS");
-    goto fail;
+    do {
+      arena.used = 0;
+      ret = opts->updates != NULL
+                ? remote_update(pid, opts->updates, opts->n, &arena, values)
+                : remote_getenv(pid, opts->names, opts->n, flags, &arena,
+                                values);
+    } while (ret && errno == ENOBUFS && grow_arena(&arena) == 0);
+    if (ret == 0) {
+      out_values(&output, opts, pid, values);
+    }
+    free(values);
   }
 
-  new_word[0] = 0xff; // JMP %rax
-  new_word[1] = 0xe0; // JMP %rax
-  poke_text(pid, (void *)newregs.rip, new_word, NULL, sizeof(new_word));
+  remote_set_stats(NULL);
+  return finish_pid(pid, opts, ret, &query_stats, pause, &output);
+}
+
+// the most processes that a tracer thread keeps in flight at once
+#define BATCH_MAX 256
+
+// the arenas of the processes of a batch, reused like arena
+static __thread struct remote_arena batch_arenas[BATCH_MAX];
+
+// Whether the processes can be queried in batches: only queries that stop
+// them go through remote_getenv_batch() and remote_update_batch().
+static bool batched(const struct options *opts) {
+  return !opts->dump && !opts->unload && !opts->no_stop && !opts->agent &&
+         !opts->mirror && !opts->unmirror && !opts->consistent;
+}
+
+// A batch that is being queried, for batch_done(). The output is passed
+// along, as batch_done() may not run on the thread that owns it.
+struct batch_output {
+  const struct options *opts;
+  struct remote_batch *batch;
+  struct remote_stats *stats;
+  uint64_t *pauses;
+  bool *printed;
+  struct output *output;
+  int ret;
+};
 
-  #ifdef DEBUG
-  fprintf(stderr, "jumping back to original rip\n");
-  #endif
-  if (singlestep(pid)) {
-    goto fail;
+// Print the output of a process of a batch as soon as its query is done,
+// so a process that is slow to stop does not hold up the output of the
+// others. One whose results do not fit in its arena is left for later.
+static void batch_done(struct remote_batch *q) {
+  struct batch_output *b = q->data;
+  size_t i = q - b->batch;
+  if (q->ret && q->err == ENOBUFS) {
+    return;
   }
-  if (ptrace(PTRACE_GETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_GETREGS");
-    goto fail;
+  if (q->ret == 0) {
+    out_values(b->output, b->opts, q->pid, q->results);
   }
+  b->ret |= finish_pid(q->pid, b->opts, q->ret, &b->stats[i], &b->pauses[i],
+                       b->output);
+  b->printed[i] = true;
+}
 
-  if (newregs.rip == (long)rip) {
-    #ifdef DEBUG
-    fprintf(stderr, "successfully jumped back to original %%rip at %p\n", rip);
-    #endif
+// Query the n processes at pids in one batch, so their stops overlap, and
+// print the output of each like query_pid() does, as each one is done. A
+// process whose results do not fit in its arena is queried again on its
+// own, with query_pid().
+static int query_batch(const pid_t *pids, size_t n, const struct options *opts,
+                       uint64_t *pauses) {
+  struct remote_batch batch[BATCH_MAX];
+  struct remote_stats batch_stats[BATCH_MAX];
+  bool printed[BATCH_MAX];
+  struct remote_value *values = calloc(n * opts->n, sizeof(*values));
+  if (values == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  struct batch_output out = {
+    .opts = opts, .batch = batch, .stats = batch_stats, .pauses = pauses,
+    .printed = printed, .output = &output,
+  };
+  for (size_t i = 0; i < n; i++) {
+    if (batch_arenas[i].size == 0 && grow_arena(&batch_arenas[i])) {
+      free(values);
+      return -1;
+    }
+    batch_arenas[i].used = 0;
+    batch_stats[i] = (struct remote_stats){{0}};
+    printed[i] = false;
+    batch[i] = (struct remote_batch){
+      .pid = pids[i], .arena = &batch_arenas[i],
+      .results = values + i * opts->n,
+      .stats = opts->stats ? &batch_stats[i] : NULL,
+      .done = batch_done, .data = &out,
+    };
+  }
+  if (opts->updates != NULL) {
+    remote_update_batch(batch, n, opts->updates, opts->n);
   } else {
-    fprintf(stderr, "unexpectedly jumped to %p (expected to be at %p)\n",
-           (void *)newregs.rip, rip);
-    goto fail;
-  }
-
-  // unmap the memory we allocated
-  newregs.rax = 11;                // munmap
-  newregs.rdi = (long)mmap_memory; // addr
-  newregs.rsi = PAGE_SIZE;         // size
-  if (ptrace(PTRACE_SETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_SETREGS");
-    goto fail;
-  }
-
-  // make the system call
-  #ifdef DEBUG
-  fprintf(stderr, "making call to mmap\n");
-  #endif
-  if (singlestep(pid)) {
-    goto fail;
-  }
-  if (ptrace(PTRACE_GETREGS, pid, NULL, &newregs)) {
-    perror("PTRACE_GETREGS");
-    goto fail;
-  }
-  #ifdef DEBUG
-  fprintf(stderr, "munmap returned with status %llu\n", newregs.rax);
-
-  fprintf(stderr, "restoring old text at %p\n", rip);
-  #endif
-  poke_text(pid, rip, old_word, NULL, sizeof(old_word));
-
-  #ifdef DEBUG
-  fprintf(stderr, "restoring old registers\n");
-  #endif
-  if (ptrace(PTRACE_SETREGS, pid, NULL, &oldregs)) {
-    perror("PTRACE_SETREGS");
-    goto fail;
-  }
-
-  // detach the process
-  #ifdef DEBUG
-  fprintf(stderr, "detaching\n");
-  #endif
-  if (ptrace(PTRACE_DETACH, pid, NULL, NULL)) {
-    perror("PTRACE_DETACH");
-    goto fail;
+    remote_getenv_batch(batch, n, opts->names, opts->n);
   }
+  int ret = out.ret;
+  for (size_t i = 0; i < n; i++) {
+    if (printed[i]) {
+      continue;
+    }
+    if (batch[i].ret && batch[i].err == ENOBUFS) {
+      ret |= query_pid(pids[i], opts, &pauses[i]);
+      continue;
+    }
+    if (batch[i].ret == 0) {
+      out_values(&output, opts, pids[i], batch[i].results);
+    }
+    ret |= finish_pid(pids[i], opts, batch[i].ret, &batch_stats[i],
+                      &pauses[i], &output);
+  }
+  free(values);
+  return ret;
+}
+
+// The processes are handed out to a pool of tracer threads, chunk at a
+// time. ptrace works per thread, so each process is attached, injected and
+// detached by the thread that picked it; the processes of a chunk are
+// queried as one batch, when they can be.
+struct pool {
+  const pid_t *pids;
+  size_t npids;
+  size_t next;
+  size_t chunk;
+  int failed;
+  const struct options *opts;
+  uint64_t *pauses; // per process, for --stats
+};
+
+static void *pool_worker(void *arg) {
+  struct pool *pool = arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&pool->next, pool->chunk,
+                                 __ATOMIC_RELAXED)) < pool->npids) {
+    size_t n = pool->npids - i < pool->chunk ? pool->npids - i : pool->chunk;
+    int ret = n > 1 ? query_batch(pool->pids + i, n, pool->opts,
+                                  pool->pauses + i)
+                    : query_pid(pool->pids[i], pool->opts, &pool->pauses[i]);
+    if (ret) {
+      __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(arena.base);
+  arena = (struct remote_arena){0};
+  for (i = 0; i < BATCH_MAX; i++) {
+    free(batch_arenas[i].base);
+    batch_arenas[i] = (struct remote_arena){0};
+  }
+  free(output.pieces);
+  free(output.buf);
+  output = (struct output){0};
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// the nearest rank percentile of the n sorted values
+static uint64_t percentile(const uint64_t *sorted, size_t n, int p) {
+  size_t rank = (n * p + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+// print the --stats summary of the pause times of all processes
+static void print_summary(uint64_t *pauses, size_t n) {
+  qsort(pauses, n, sizeof(uint64_t), compare_u64);
+  fprintf(stderr, "stats summary processes=%zu pause_p50_ns=%" PRIu64
+          " pause_p99_ns=%" PRIu64 " pause_max_ns=%" PRIu64 "\n", n,
+          percentile(pauses, n, 50), percentile(pauses, n, 99), pauses[n - 1]);
+}
+
+// query all processes with up to jobs threads, returning 1 if any failed
+int query_pids(const pid_t *pids, size_t npids, const struct options *opts,
+               long jobs) {
+  struct pool pool = {
+    .pids = pids, .npids = npids, .next = 0, .failed = 0, .opts = opts,
+  };
+  pool.pauses = calloc(npids, sizeof(uint64_t));
+  if (pool.pauses == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  if (jobs > (long)npids) {
+    jobs = npids;
+  }
+  // spread the processes evenly over the threads, in batches as large as
+  // they can be
+  pool.chunk = 1;
+  if (batched(opts)) {
+    pool.chunk = (npids + jobs - 1) / jobs;
+    if (pool.chunk > BATCH_MAX) {
+      pool.chunk = BATCH_MAX;
+    }
+  }
+  if (jobs <= 1) {
+    pool_worker(&pool);
+    goto out;
+  }
+
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  if (threads == NULL) {
+    perror("calloc");
+    free(pool.pauses);
+    return 1;
+  }
+  long started = 0;
+  for (; started < jobs; started++) {
+    int err = pthread_create(&threads[started], NULL, pool_worker, &pool);
+    if (err) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      break;
+    }
+  }
+  if (started == 0) {
+    pool_worker(&pool);
+  }
+  for (long i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+out:
+  if (opts->stats && npids > 1) {
+    print_summary(pool.pauses, npids);
+  }
+  free(pool.pauses);
+  return pool.failed;
+}
+
+// --watch: the state of a process whose environment is sampled over and
+// over, as of its last sample
+struct watch {
+  pid_t pid;
+  bool sampled;     // whether vars holds a sample yet
+  uint64_t version; // of the environment, see remote_environ_version()
+  bool versioned;   // whether version is known
+  struct remote_value *vars; // the sample, sorted by name
+  size_t count;
+  // vars lives in one arena, and the next sample is taken into the other
+  struct remote_arena arenas[2];
+  int current;
+};
+
+static int compare_names(const char *a, const char *b) {
+  size_t alen = var_name_len(a), blen = var_name_len(b);
+  int cmp = memcmp(a, b, alen < blen ? alen : blen);
+  return cmp != 0 ? cmp : (alen > blen) - (alen < blen);
+}
+
+static int compare_vars(const void *a, const void *b) {
+  const struct remote_value *x = a, *y = b;
+  int cmp = compare_names(x->value, y->value);
+  // keep the environment order for duplicates, see sort_vars()
+  return cmp != 0 ? cmp : (x > y) - (x < y);
+}
+
+// Sort the count vars by name, in place, and drop all but the first
+// definition of each name, which is the one getenv(3) would find. Entries
+// without a '=' are dropped too. Returns the new count.
+static size_t sort_vars(struct remote_value *vars, size_t count) {
+  qsort(vars, count, sizeof(struct remote_value), compare_vars);
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (strchr(vars[i].value, '=') != NULL &&
+        (kept == 0 || compare_names(vars[kept - 1].value, vars[i].value))) {
+      vars[kept++] = vars[i];
+    }
+  }
+  return kept;
+}
+
+// Log every variable that differs between the sorted old and new samples
+// as one JSON line. A variable that was not set before, or is not set any
+// more, has a null old or new value.
+static void log_changes(struct output *out, pid_t pid, const struct timespec *now,
+                        const struct remote_value *old, size_t nold,
+                        const struct remote_value *new, size_t nnew) {
+  size_t i = 0, j = 0;
+  while (i < nold || j < nnew) {
+    int cmp = i == nold   ? 1
+              : j == nnew ? -1
+                          : compare_names(old[i].value, new[j].value);
+    const char *before = cmp <= 0 ? old[i].value : NULL;
+    const char *after = cmp >= 0 ? new[j].value : NULL;
+    const char *var = before != NULL ? before : after;
+    i += cmp <= 0;
+    j += cmp >= 0;
+    if (before != NULL && after != NULL && strcmp(before, after) == 0) {
+      continue;
+    }
+    char head[64];
+    snprintf(head, sizeof(head), "{\"ts\":%lld.%06ld,\"pid\":%d,\"key\":",
+             (long long)now->tv_sec, now->tv_nsec / 1000, pid);
+    out_str(out, head);
+    json_string(out, var, var_name_len(var));
+    out_str(out, ",\"old\":");
+    json_value(out, before);
+    out_str(out, ",\"new\":");
+    json_value(out, after);
+    out_str(out, "}\n");
+  }
+}
+
+// Take a sample of the environment of a watched process, the cheapest way
+// we can, and log what changed since the last one. The version is checked
+// first, without stopping the process, and only if it changed (or cannot
+// be told) are the strings read.
+static int watch_sample(struct watch *w, const struct options *opts,
+                        struct output *out) {
+  struct remote_arena *next = &w->arenas[!w->current];
+  uint64_t version;
+  int ret;
+  do {
+    next->used = 0;
+    ret = remote_environ_version(w->pid, next, &version);
+  } while (ret == -1 && errno == ENOBUFS && grow_arena(next) == 0);
+  if (ret == -1) {
+    return -1;
+  }
+  if (ret == 0 && w->sampled && w->versioned && version == w->version) {
+    return 0;
+  }
+  w->version = version;
+  w->versioned = ret == 0;
+
+  int flags = REMOTE_NO_STOP | (opts->agent ? REMOTE_AGENT : 0) |
+              (opts->mirror ? REMOTE_MIRROR : 0) |
+              (opts->consistent ? REMOTE_CONSISTENT : 0);
+  struct remote_value *vars;
+  size_t count;
+  do {
+    next->used = 0;
+    ret = remote_environ(w->pid, flags, next, &vars, &count);
+    // only the variables that were asked for, if any
+    if (ret == 0 && opts->n != 0) {
+      ret = remote_environ_filter(opts->names, opts->n, next, vars, &count);
+    }
+  } while (ret && errno == ENOBUFS && grow_arena(next) == 0);
+  if (ret) {
+    return -1;
+  }
+  count = sort_vars(vars, count);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  log_changes(out, w->pid, &now, w->vars, w->sampled ? w->count : 0,
+              vars, count);
+  w->vars = vars;
+  w->count = count;
+  w->current = !w->current;
+  w->sampled = true;
   return 0;
+}
 
-fail:
-  poke_text(pid, rip, old_word, NULL, sizeof(old_word));
-  if (ptrace(PTRACE_DETACH, pid, NULL, NULL)) {
-    perror("PTRACE_DETACH");
+// Sample all processes every interval_ms until none of them is left, and log
+// the changes to stdout. The first sample of each process logs the values
+// it starts with, as changes from unset. A process that cannot be sampled
+// any more, e.g. because it exited, is dropped.
+int watch_pids(const pid_t *pids, size_t npids, const struct options *opts,
+               long interval_ms) {
+  struct watch *watches = calloc(npids, sizeof(struct watch));
+  if (watches == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  size_t nwatches = npids;
+  int ret = 0;
+  for (size_t i = 0; i < npids; i++) {
+    watches[i].pid = pids[i];
   }
-  return 1;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (nwatches > 0) {
+    for (size_t i = 0; i < nwatches;) {
+      if (watch_sample(&watches[i], opts, &output) == 0) {
+        i++;
+        continue;
+      }
+      fprintf(stderr, "no longer watching process %d\n", watches[i].pid);
+      ret = 1;
+      free(watches[i].arenas[0].base);
+      free(watches[i].arenas[1].base);
+      watches[i] = watches[--nwatches];
+    }
+    if (out_flush(&output, STDOUT_FILENO)) {
+      ret = 1;
+    }
+    next.tv_sec += interval_ms / 1000;
+    next.tv_nsec += interval_ms % 1000 * 1000000;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+    while (nwatches > 0 &&
+           clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+               EINTR)
+      ;
+  }
+  free(watches);
+  free(output.pieces);
+  free(output.buf);
+  return ret;
 }
 
+// options that only have a long form
+enum {
+  OPT_PGREP = 256,
+  OPT_CGROUP,
+  OPT_AGENT,
+  OPT_UNLOAD,
+  OPT_MIRROR,
+  OPT_UNMIRROR,
+  OPT_CONSISTENT,
+  OPT_NO_STOP,
+  OPT_STATS,
+  OPT_TRACE,
+  OPT_TIMEOUT,
+  OPT_WATCH,
+  OPT_JSON,
+};
+
+static const struct option long_options[] = {
+  {"help", no_argument, NULL, 'h'},
+  {"all", no_argument, NULL, 'a'},
+  {"pid", required_argument, NULL, 'p'},
+  {"env", required_argument, NULL, 'e'},
+  {"file", required_argument, NULL, 'f'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"pgrep", required_argument, NULL, OPT_PGREP},
+  {"cgroup", required_argument, NULL, OPT_CGROUP},
+  {"agent", no_argument, NULL, OPT_AGENT},
+  {"unload", no_argument, NULL, OPT_UNLOAD},
+  {"mirror", no_argument, NULL, OPT_MIRROR},
+  {"unmirror", no_argument, NULL, OPT_UNMIRROR},
+  {"consistent", no_argument, NULL, OPT_CONSISTENT},
+  {"no-stop", no_argument, NULL, OPT_NO_STOP},
+  {"stats", no_argument, NULL, OPT_STATS},
+  {"trace", no_argument, NULL, OPT_TRACE},
+  {"timeout", required_argument, NULL, OPT_TIMEOUT},
+  {"watch", required_argument, NULL, OPT_WATCH},
+  {"set", required_argument, NULL, 's'},
+  {"unset", required_argument, NULL, 'u'},
+  {"null", no_argument, NULL, '0'},
+  {"json", no_argument, NULL, OPT_JSON},
+  {NULL, 0, NULL, 0},
+};
+
 int main(int argc, char **argv) {
-  long pid = -1;
-  char* env = NULL;
+  pid_t *pids = NULL;
+  size_t npids = 0;
+  const char **names = NULL;
+  size_t n = 0;
+  struct remote_update *updates = NULL;
+  size_t nupdates = 0;
+  bool dump = false, agent = false, unload = false, no_stop = false;
+  bool mirror = false, unmirror = false, consistent = false;
+  bool want_stats = false, trace = false;
+  enum format format = FORMAT_TEXT;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  long watch_ms = 0, timeout_ms = 0;
+  long pid;
   int c;
   opterr = 0;
-  while ((c = getopt(argc, argv, "hp:e:")) != -1) {
+  while ((c = getopt_long(argc, argv, "hap:e:f:j:0s:u:", long_options, NULL)) !=
+         -1) {
     switch (c) {
     case 'h':
-      fprintf(stderr, "Usage: %s -p <pid>\n", argv[0]);
+      fprintf(stderr, "Usage: %s -p <pid> -e <envvar> [-e <envvar>...] "
+              "[-f <file>]\n", argv[0]);
+      fprintf(stderr, "       %s -p <pid> -a [-e <envvar>...]\n", argv[0]);
+      fprintf(stderr, "       %s -p <pid> -s <envvar>=<value> "
+              "[-u <envvar>...]\n", argv[0]);
+      fprintf(stderr, "       %s -p <pid> --unload\n", argv[0]);
+      fprintf(stderr, "       %s -p <pid> --unmirror\n", argv[0]);
+      fprintf(stderr, "\n-p can be repeated, and --pgrep <pattern> or "
+              "--cgroup <path> select\nprocesses by name or cgroup; "
+              "-j <n> queries up to n processes at once.\n");
+      fprintf(stderr, "--agent answers queries from an agent thread that "
+              "is started in the\nprocess the first time, until --unload "
+              "stops it.\n");
+      fprintf(stderr, "--mirror answers queries from a copy of the "
+              "environment that uprobes on\nsetenv and friends keep up to "
+              "date, until --unmirror removes them.\n");
+      fprintf(stderr, "--consistent freezes every thread of the process "
+              "while the environment\nis copied, and looks the variables "
+              "up in that copy.\n");
+      fprintf(stderr, "--timeout <ms> bounds how long a process is kept "
+              "stopped.\n");
+      fprintf(stderr, "--stats prints how long each phase took, and how "
+              "long the process\nwas stopped for, to stderr.\n");
+      fprintf(stderr, "--trace logs every ptrace request and wait, with "
+              "how long it took, to\nstderr.\n");
+      fprintf(stderr, "--no-stop reads the environment without stopping the "
+              "process, and only\nfalls back to the other ways if it keeps "
+              "changing under us.\n");
+      fprintf(stderr, "-0 terminates every value with a NUL instead of a "
+              "newline, and --json\nprints one JSON object per variable, "
+              "including unset ones.\n");
+      fprintf(stderr, "-a with -e or -f prints every definition of just "
+              "these variables.\n");
+      fprintf(stderr, "--watch <ms> samples the environment every ms "
+              "milliseconds, and logs\nthe changes of the variables (or "
+              "of all with -a) as JSON lines.\n");
       return 0;
       break;
+    case 'a':
+      dump = true;
+      break;
     case 'p':
+      errno = 0;
       pid = strtol(optarg, NULL, 10);
       if ((errno == ERANGE && (pid == LONG_MAX || pid == LONG_MIN)) ||
           (errno != 0 && pid == 0)) {
@@ -461,15 +1029,113 @@ int main(int argc, char **argv) {
         fprintf(stderr, "cannot accept negative pids\n");
         return 1;
       }
+      if (add_pid(&pids, &npids, pid)) {
+        return 1;
+      }
       break;
     case 'e':
-      env = optarg;
+      if (add_query(&names, &n, optarg)) {
+        return 1;
+      }
+      break;
+    case 's':
+    case 'u':
+      if (add_update(&updates, &nupdates, optarg, c == 's') ||
+          add_query(&names, &n, optarg)) {
+        return 1;
+      }
+      break;
+    case 'f':
+      if (add_queries_from_file(&names, &n, optarg)) {
+        return 1;
+      }
+      break;
+    case 'j':
+      jobs = strtol(optarg, NULL, 10);
+      if (jobs < 1) {
+        fprintf(stderr, "-j needs a positive number\n");
+        return 1;
+      }
+      break;
+    case OPT_PGREP:
+      if (add_pids_from_pattern(&pids, &npids, optarg)) {
+        return 1;
+      }
+      break;
+    case OPT_CGROUP:
+      if (add_pids_from_cgroup(&pids, &npids, optarg)) {
+        return 1;
+      }
+      break;
+    case OPT_AGENT:
+      agent = true;
+      break;
+    case OPT_UNLOAD:
+      unload = true;
+      break;
+    case OPT_MIRROR:
+      mirror = true;
+      break;
+    case OPT_UNMIRROR:
+      unmirror = true;
+      break;
+    case OPT_CONSISTENT:
+      consistent = true;
+      break;
+    case OPT_NO_STOP:
+      no_stop = true;
+      break;
+    case OPT_STATS:
+      want_stats = true;
+      break;
+    case OPT_TRACE:
+      trace = true;
+      break;
+    case OPT_TIMEOUT:
+      timeout_ms = strtol(optarg, NULL, 10);
+      if (timeout_ms < 1) {
+        fprintf(stderr, "--timeout needs a positive number of ms\n");
+        return 1;
+      }
+      break;
+    case '0':
+    case OPT_JSON:
+      if (format != FORMAT_TEXT) {
+        fprintf(stderr, "-0 and --json cannot be combined\n");
+        return 1;
+      }
+      format = c == '0' ? FORMAT_NUL : FORMAT_JSON;
+      break;
+    case OPT_WATCH:
+      watch_ms = strtol(optarg, NULL, 10);
+      if (watch_ms < 1) {
+        fprintf(stderr, "--watch needs a positive number of ms\n");
+        return 1;
+      }
       break;
     case '?':
       if (optopt == 'p') {
         fprintf(stderr, "Option -p requires an argument.\n");
       } else if (optopt == 'e') {
         fprintf(stderr, "Option -e requires an argument.\n");
+      } else if (optopt == 'f') {
+        fprintf(stderr, "Option -f requires an argument.\n");
+      } else if (optopt == 's') {
+        fprintf(stderr, "Option -s requires an argument.\n");
+      } else if (optopt == 'u') {
+        fprintf(stderr, "Option -u requires an argument.\n");
+      } else if (optopt == 'j') {
+        fprintf(stderr, "Option -j requires an argument.\n");
+      } else if (optopt == OPT_PGREP) {
+        fprintf(stderr, "Option --pgrep requires an argument.\n");
+      } else if (optopt == OPT_CGROUP) {
+        fprintf(stderr, "Option --cgroup requires an argument.\n");
+      } else if (optopt == OPT_TIMEOUT) {
+        fprintf(stderr, "Option --timeout requires an argument.\n");
+      } else if (optopt == OPT_WATCH) {
+        fprintf(stderr, "Option --watch requires an argument.\n");
+      } else if (optopt == 0) {
+        fprintf(stderr, "Unknown option `%s`.\n", argv[optind - 1]);
       } else if (isprint(optopt)) {
         fprintf(stderr, "Unknown option `-%c`.\n", optopt);
       } else {
@@ -481,13 +1147,61 @@ int main(int argc, char **argv) {
       abort();
     }
   }
-  if (pid == -1) {
-    fprintf(stderr, "must specify a remote process with -p\n");
+  if (npids == 0) {
+    fprintf(stderr, "must specify a remote process with -p, --pgrep or "
+            "--cgroup\n");
+    return 1;
+  }
+  if (unload && (dump || agent || no_stop || mirror || unmirror ||
+                 consistent || n != 0)) {
+    fprintf(stderr, "--unload cannot be combined with queries\n");
     return 1;
   }
-  if (env == NULL) {
-    fprintf(stderr, "must specify an env var with -e\n");
+  if (unmirror && (dump || agent || no_stop || mirror || consistent ||
+                   n != 0)) {
+    fprintf(stderr, "--unmirror cannot be combined with queries\n");
     return 1;
   }
-  return getenv_process((pid_t)pid, env);
+  if ((unload || unmirror) && watch_ms) {
+    fprintf(stderr, "--unload and --unmirror cannot be combined with "
+            "--watch\n");
+    return 1;
+  }
+  if (format == FORMAT_NUL && watch_ms) {
+    fprintf(stderr, "-0 cannot be combined with --watch\n");
+    return 1;
+  }
+  if (nupdates != 0 && (n != nupdates || dump || agent || no_stop || unload ||
+                        mirror || unmirror || consistent || watch_ms)) {
+    fprintf(stderr, "-s and -u cannot be combined with queries, --agent, "
+            "--no-stop,\n--mirror, --consistent, --unload, --unmirror or "
+            "--watch\n");
+    return 1;
+  }
+  if (consistent && agent) {
+    fprintf(stderr, "--consistent cannot be combined with --agent\n");
+    return 1;
+  }
+  if (!dump && !unload && !unmirror && n == 0) {
+    fprintf(stderr, "must specify an env var with -e, -f, -a, -s or -u\n");
+    return 1;
+  }
+
+  if (remote_set_timeout(timeout_ms)) {
+    return 1;
+  }
+  remote_set_trace(trace);
+
+  struct options opts = {
+    .names = names, .n = n, .updates = updates, .dump = dump, .prefix = npids > 1,
+    .agent = agent, .unload = unload, .mirror = mirror, .unmirror = unmirror,
+    .consistent = consistent, .no_stop = no_stop,
+    .stats = want_stats, .format = format,
+  };
+  int ret = watch_ms ? watch_pids(pids, npids, &opts, watch_ms)
+                     : query_pids(pids, npids, &opts, jobs);
+  free(names);
+  free(updates);
+  free(pids);
+  return ret;
 }
@@ -0,0 +1,6220 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/bpf.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "libgetenv.h"
+
+/* #define DEBUG */
+
+// text seen in /proc/<pid>/maps for text areas
+static const char *text_area = " r-xp ";
+
+// this should be a string that will uniquely identify libc in /proc/<pid>/maps
+static const char *libc_string = "/libc";
+
+#ifndef PROCMAP_QUERY
+// the PROCMAP_QUERY ioctl on /proc/<pid>/maps was added in Linux 6.11
+#define PROCMAP_QUERY _IOWR('f', 17, struct procmap_query)
+#define PROCMAP_QUERY_VMA_EXECUTABLE 0x04
+#define PROCMAP_QUERY_COVERING_OR_NEXT_VMA 0x10
+#define PROCMAP_QUERY_FILE_BACKED_VMA 0x20
+struct procmap_query {
+  uint64_t size;
+  uint64_t query_flags;
+  uint64_t query_addr;
+  uint64_t vma_start;
+  uint64_t vma_end;
+  uint64_t vma_flags;
+  uint64_t vma_page_size;
+  uint64_t vma_offset;
+  uint64_t inode;
+  uint32_t dev_major;
+  uint32_t dev_minor;
+  uint32_t vma_name_size;
+  uint32_t build_id_size;
+  uint64_t vma_name_addr;
+  uint64_t build_id_addr;
+};
+#endif
+
+// Set when an allocation from an arena failed, so that the public functions
+// fail with ENOBUFS, and not with a message.
+static __thread bool arena_full = false;
+
+#define ARENA_ALIGN 16
+
+// allocate size bytes for a result from the bottom of the arena
+static void *arena_alloc(struct remote_arena *a, size_t size) {
+  uintptr_t start = ((uintptr_t)a->base + a->used + ARENA_ALIGN - 1) &
+                    ~(uintptr_t)(ARENA_ALIGN - 1);
+  uintptr_t top = (uintptr_t)a->base + a->size - a->scratch;
+  if (start > top || size > top - start) {
+    arena_full = true;
+    return NULL;
+  }
+  a->used = start + size - (uintptr_t)a->base;
+  return (void *)start;
+}
+
+// allocate size bytes of scratch space from the top of the arena; the
+// public functions give all of it back before they return
+static void *arena_scratch(struct remote_arena *a, size_t size) {
+  uintptr_t bottom = (uintptr_t)a->base + a->used;
+  uintptr_t top = (uintptr_t)a->base + a->size - a->scratch;
+  if (size > top - bottom ||
+      ((top - size) & ~(uintptr_t)(ARENA_ALIGN - 1)) < bottom) {
+    arena_full = true;
+    return NULL;
+  }
+  uintptr_t start = (top - size) & ~(uintptr_t)(ARENA_ALIGN - 1);
+  a->scratch = (uintptr_t)a->base + a->size - start;
+  return (void *)start;
+}
+
+// Grow the allocation at ptr of old bytes to size bytes, like realloc(3).
+// The last result grows in place; anything else is copied to a new
+// allocation of the same kind, and the old one stays unused until the
+// arena is reset.
+static void *arena_grow(struct remote_arena *a, void *ptr, size_t old,
+                        size_t size, bool scratch) {
+  if (!scratch && ptr != NULL && (char *)ptr + old == a->base + a->used &&
+      size - old <= a->size - a->scratch - a->used) {
+    a->used += size - old;
+    return ptr;
+  }
+  void *grown = scratch ? arena_scratch(a, size) : arena_alloc(a, size);
+  if (grown != NULL && ptr != NULL) {
+    memmove(grown, ptr, old);
+  }
+  return grown;
+}
+
+// Read the file open at fd into buf of size bytes, NUL terminated, and
+// close it. Returns its length, which is cut short if the file does not
+// fit, or -1.
+static ssize_t read_fd(int fd, char *buf, size_t size) {
+  size_t len = 0;
+  ssize_t got = 0;
+  while (len < size - 1 && (got = read(fd, buf + len, size - 1 - len)) > 0) {
+    len += got;
+  }
+  close(fd);
+  if (got < 0) {
+    return -1;
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+// read_fd() for the file at path, without the heap allocation of fopen(3)
+static ssize_t read_file(const char *path, char *buf, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  return read_fd(fd, buf, size);
+}
+
+// A directory that is read with getdents64(2) into a buffer of our own,
+// rather than with opendir(3), which allocates one on the heap.
+struct dir_reader {
+  int fd;
+  size_t pos, len;
+  char buf[4096] __attribute__((aligned(8)));
+};
+
+static int dir_open(struct dir_reader *d, const char *path) {
+  d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  d->pos = d->len = 0;
+  return d->fd < 0 ? -1 : 0;
+}
+
+// the name of the next entry of the directory, or NULL at the end
+static const char *dir_next(struct dir_reader *d) {
+  if (d->pos == d->len) {
+    ssize_t got = getdents64(d->fd, d->buf, sizeof(d->buf));
+    if (got <= 0) {
+      return NULL;
+    }
+    d->pos = 0;
+    d->len = got;
+  }
+  struct dirent64 *entry = (struct dirent64 *)(d->buf + d->pos);
+  d->pos += entry->d_reclen;
+  return entry->d_name;
+}
+
+static void dir_close(struct dir_reader *d) {
+  close(d->fd);
+}
+
+// a shared library as it is mapped into a process
+struct library {
+  uintptr_t base;     // where the start of the file is mapped
+  uintptr_t text;     // start of the executable mapping
+  uintptr_t text_end; // end of the executable mapping
+  uintptr_t text_offset; // and where in the file it starts
+  uintptr_t end;      // end of the last mapping of the file after the text
+  char path[PATH_MAX];
+  char build_id[128]; // hex GNU build-id if the kernel told us, or empty
+  dev_t dev;          // the file, or 0 if we could not tell
+  ino_t ino;
+};
+
+// check that the library name at pos is not the prefix of a longer name
+static bool library_name_ends(const char *pos, const char *libname) {
+  char next = pos[strlen(libname)];
+  return next < 'a' || next > 'z';
+}
+
+// Find the library with PROCMAP_QUERY, which lets the kernel walk only the
+// executable file mappings for us, and also gives us the build-id. Returns 1
+// if the ioctl is not supported.
+static int find_library_query(int fd, const char *libname,
+                              struct library *lib) {
+  unsigned char build_id[64];
+  struct procmap_query q;
+  uint64_t addr = 0;
+  while (true) {
+    memset(&q, 0, sizeof(q));
+    q.size = sizeof(q);
+    q.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA |
+                    PROCMAP_QUERY_VMA_EXECUTABLE |
+                    PROCMAP_QUERY_FILE_BACKED_VMA;
+    q.query_addr = addr;
+    q.vma_name_addr = (uintptr_t)lib->path;
+    q.vma_name_size = sizeof(lib->path);
+    q.build_id_addr = (uintptr_t)build_id;
+    q.build_id_size = sizeof(build_id);
+    if (ioctl(fd, PROCMAP_QUERY, &q)) {
+      return errno == ENOENT ? -1 : 1;
+    }
+    char *pos = strstr(lib->path, libname);
+    if (pos != NULL && library_name_ends(pos, libname)) {
+      break;
+    }
+    addr = q.vma_end;
+  }
+  lib->text = q.vma_start;
+  lib->text_end = q.vma_end;
+  lib->text_offset = q.vma_offset;
+  lib->build_id[0] = '\0';
+  for (size_t i = 0; i < q.build_id_size && 2 * i + 2 < sizeof(lib->build_id);
+       i++) {
+    snprintf(lib->build_id + 2 * i, 3, "%02x", build_id[i]);
+  }
+
+  // the start of the file is normally mapped as many bytes before the text
+  // as the text is into the file; check that, and let the maps parser deal
+  // with anything else
+  uint64_t inode = q.inode, offset = q.vma_offset;
+  uint32_t dev_major = q.dev_major, dev_minor = q.dev_minor;
+  if (offset > lib->text) {
+    return 1;
+  }
+  memset(&q, 0, sizeof(q));
+  q.size = sizeof(q);
+  q.query_flags = PROCMAP_QUERY_FILE_BACKED_VMA;
+  q.query_addr = lib->text - offset;
+  if (ioctl(fd, PROCMAP_QUERY, &q) || q.vma_start != lib->text - offset ||
+      q.vma_offset != 0 || q.inode != inode || q.dev_major != dev_major ||
+      q.dev_minor != dev_minor) {
+    return 1;
+  }
+  lib->base = q.vma_start;
+  lib->dev = makedev(dev_major, dev_minor);
+  lib->ino = inode;
+
+  // the rest of the file is mapped right after the text
+  lib->end = lib->text_end;
+  while (true) {
+    memset(&q, 0, sizeof(q));
+    q.size = sizeof(q);
+    q.query_flags = PROCMAP_QUERY_FILE_BACKED_VMA;
+    q.query_addr = lib->end;
+    if (ioctl(fd, PROCMAP_QUERY, &q) || q.vma_start != lib->end ||
+        q.inode != inode || q.dev_major != dev_major ||
+        q.dev_minor != dev_minor) {
+      break;
+    }
+    lib->end = q.vma_end;
+  }
+  return 0;
+}
+
+// Find the library by parsing the text of /proc/<pid>/maps. The file is read
+// in large chunks into a single buffer, and searched for libname as a whole
+// instead of line by line; only lines that mention it are parsed. We stop
+// after the first executable mapping, which comes after the one for the
+// start of the file, and the mappings of the file that directly follow it.
+static int find_library_maps(int fd, const char *libname,
+                             struct library *lib) {
+  char buf[65536];
+  size_t len = 0;
+  bool eof = false, found = false;
+  lib->base = 0;
+  lib->build_id[0] = '\0';
+  lib->dev = lib->ino = 0;
+  while (!eof || len > 0) {
+    if (!eof) {
+      ssize_t got = read(fd, buf + len, sizeof(buf) - 1 - len);
+      if (got < 0) {
+        perror("read");
+        return -1;
+      }
+      eof = got == 0;
+      len += got;
+    }
+    buf[len] = '\0';
+
+    // only look at complete lines, unless there are no more to come
+    char *end = memrchr(buf, '\n', len);
+    if (end == NULL) {
+      if (!eof && len < sizeof(buf) - 1) {
+        continue;
+      }
+      end = buf + len;
+    }
+    *end = '\0';
+
+    // after the text, every line is parsed, up to one of another mapping
+    char *pos = buf;
+    while (pos < end && (found || (pos = strstr(pos, libname)) != NULL)) {
+      char *line = pos;
+      while (!found && line > buf && line[-1] != '\n' && line[-1] != '\0') {
+        line--;
+      }
+      char *next = strchr(pos, '\n');
+      if (next != NULL) {
+        *next = '\0';
+      }
+      unsigned long start, stop, offset, inode;
+      unsigned major, minor;
+      bool parsed = sscanf(line, "%lx-%lx %*s %lx %x:%x %lu", &start, &stop,
+                           &offset, &major, &minor, &inode) == 6;
+      if (found) {
+        if (!parsed || start != lib->end || makedev(major, minor) != lib->dev ||
+            inode != lib->ino) {
+          return 0;
+        }
+        lib->end = stop;
+      } else if (library_name_ends(pos, libname) && parsed) {
+        if (offset == 0) {
+          lib->base = start;
+        }
+        if (strstr(line, text_area)) {
+          snprintf(lib->path, sizeof(lib->path), "%s", strchr(line, '/'));
+          lib->text = start;
+          lib->text_end = lib->end = stop;
+          lib->text_offset = offset;
+          lib->dev = makedev(major, minor);
+          lib->ino = inode;
+          if (lib->base == 0) {
+            return -1;
+          }
+          found = true;
+        }
+      }
+      if (next == NULL) {
+        break;
+      }
+      pos = next + 1;
+    }
+
+    size_t used = end - buf + (end < buf + len);
+    memmove(buf, buf + used, len - used);
+    len -= used;
+  }
+  return found ? 0 : -1;
+}
+
+// Find the location of a shared library in memory, preferring PROCMAP_QUERY
+// and falling back to parsing the maps file on older kernels.
+static int find_library(pid_t pid, const char *libname, struct library *lib) {
+  char filename[32];
+  snprintf(filename, sizeof(filename), "/proc/%d/maps", pid);
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(filename);
+    return -1;
+  }
+  int ret = find_library_query(fd, libname, lib);
+  if (ret > 0) {
+    ret = find_library_maps(fd, libname, lib);
+  }
+  close(fd);
+  if (ret) {
+    fprintf(stderr, "cannot find %s in process %d\n", libname, pid);
+  }
+  return ret;
+}
+
+// The addresses in the remote libc that we need, as offsets from the start
+// of the file while they are resolved, and as addresses in the remote
+// process once resolve_libc() is done.
+struct libc_symbols {
+  uintptr_t getenv;
+  uintptr_t setenv;
+  uintptr_t unsetenv;
+  uintptr_t putenv;
+  uintptr_t clearenv;
+  uintptr_t environ; // the GOT slot libc uses to reach __environ
+  uintptr_t syscall; // a "syscall; ret" instruction sequence
+  uintptr_t trap;    // an int3 instruction
+};
+
+// the names of the fields of struct libc_symbols, as used in the cache; the
+// first ones are also the symbol names in the dynamic symbol table
+static const struct {
+  const char *name;
+  size_t offset;
+} symbol_fields[] = {
+  {"getenv", offsetof(struct libc_symbols, getenv)},
+  {"setenv", offsetof(struct libc_symbols, setenv)},
+  {"unsetenv", offsetof(struct libc_symbols, unsetenv)},
+  {"putenv", offsetof(struct libc_symbols, putenv)},
+  {"clearenv", offsetof(struct libc_symbols, clearenv)},
+  {"__environ", offsetof(struct libc_symbols, environ)},
+  {"syscall", offsetof(struct libc_symbols, syscall)},
+  {"trap", offsetof(struct libc_symbols, trap)},
+};
+#define DYNSYM_FIELDS 5
+#define SYMBOL_FIELDS (sizeof(symbol_fields) / sizeof(symbol_fields[0]))
+
+#define SYMBOL_FIELD(syms, i) \
+  (*(uintptr_t *)((char *)(syms) + symbol_fields[i].offset))
+
+// Open the file of lib as the process sees it. Going through map_files finds
+// exactly the file that is mapped, even if it has been replaced or deleted
+// since, and going through the root of the process covers containers that
+// have their own libc.
+static int open_library(pid_t pid, const struct library *lib) {
+  char filename[PATH_MAX + 32];
+  snprintf(filename, sizeof(filename), "/proc/%d/map_files/%lx-%lx", pid,
+           (unsigned long)lib->text, (unsigned long)lib->text_end);
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    snprintf(filename, sizeof(filename), "/proc/%d/root%s", pid, lib->path);
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    perror(filename);
+  }
+  return fd;
+}
+
+// check that the size bytes at data hold an x86-64 ELF file, and that the
+// table of count entries of entsize bytes at offset is inside of it
+static bool elf_table(const uint8_t *data, size_t size, uint64_t offset,
+                      uint64_t count, uint64_t entsize) {
+  return offset <= size && entsize != 0 && count <= (size - offset) / entsize;
+}
+
+static const Elf64_Ehdr *elf_header(const uint8_t *data, size_t size) {
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+  if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64 ||
+      ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+      !elf_table(data, size, ehdr->e_phoff, ehdr->e_phnum, sizeof(Elf64_Phdr))) {
+    return NULL;
+  }
+  return ehdr;
+}
+
+// Store the GNU build-id of the ELF file at data as a hex string in out,
+// which has room for len bytes.
+static int elf_build_id(const uint8_t *data, size_t size, char *out,
+                        size_t len) {
+  const Elf64_Ehdr *ehdr = elf_header(data, size);
+  if (ehdr == NULL) {
+    return -1;
+  }
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(data + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_NOTE ||
+        !elf_table(data, size, phdrs[i].p_offset, phdrs[i].p_filesz, 1)) {
+      continue;
+    }
+    const uint8_t *note = data + phdrs[i].p_offset;
+    const uint8_t *end = note + phdrs[i].p_filesz;
+    while (note + sizeof(Elf64_Nhdr) <= end) {
+      const Elf64_Nhdr *nhdr = (const Elf64_Nhdr *)note;
+      const uint8_t *name = note + sizeof(*nhdr);
+      const uint8_t *desc = name + ((nhdr->n_namesz + 3) & ~3);
+      note = desc + ((nhdr->n_descsz + 3) & ~3);
+      if (note > end) {
+        break;
+      }
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz * 2 < len) {
+        for (size_t j = 0; j < nhdr->n_descsz; j++) {
+          snprintf(out + 2 * j, 3, "%02x", desc[j]);
+        }
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
+// Resolve the fields of syms from the dynamic symbol table, the relocations
+// and the text of the ELF file at data.
+static int elf_symbols(const uint8_t *data, size_t size,
+                       struct libc_symbols *syms) {
+  const Elf64_Ehdr *ehdr = elf_header(data, size);
+  if (ehdr == NULL || ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+      !elf_table(data, size, ehdr->e_shoff, ehdr->e_shnum, sizeof(Elf64_Shdr))) {
+    fprintf(stderr, "libc is not an x86-64 ELF file with section headers\n");
+    return -1;
+  }
+  memset(syms, 0, sizeof(*syms));
+
+  // everything is relative to the lowest PT_LOAD segment, which is mapped at
+  // the start of the file
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(data + ehdr->e_phoff);
+  uint64_t min_vaddr = UINT64_MAX;
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr < min_vaddr) {
+      min_vaddr = phdrs[i].p_vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+    }
+  }
+
+  const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(data + ehdr->e_shoff);
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    const Elf64_Shdr *shdr = &shdrs[i];
+    if ((shdr->sh_type != SHT_DYNSYM && shdr->sh_type != SHT_RELA) ||
+        shdr->sh_link >= ehdr->e_shnum) {
+      continue;
+    }
+    // for SHT_DYNSYM sh_link is the string table, for SHT_RELA it is the
+    // symbol table, whose sh_link is the string table
+    const Elf64_Shdr *symtab = shdr->sh_type == SHT_DYNSYM ? shdr
+                                                          : &shdrs[shdr->sh_link];
+    if (symtab->sh_link >= ehdr->e_shnum) {
+      continue;
+    }
+    const Elf64_Shdr *strtab = &shdrs[symtab->sh_link];
+    if (!elf_table(data, size, shdr->sh_offset, shdr->sh_size, 1) ||
+        !elf_table(data, size, symtab->sh_offset,
+                   symtab->sh_size / sizeof(Elf64_Sym), sizeof(Elf64_Sym)) ||
+        !elf_table(data, size, strtab->sh_offset, strtab->sh_size, 1)) {
+      continue;
+    }
+    const Elf64_Sym *sym = (const Elf64_Sym *)(data + symtab->sh_offset);
+    size_t nsyms = symtab->sh_size / sizeof(Elf64_Sym);
+    const char *strings = (const char *)(data + strtab->sh_offset);
+
+    if (shdr->sh_type == SHT_DYNSYM) {
+      for (size_t j = 0; j < nsyms; j++) {
+        if (sym[j].st_shndx == SHN_UNDEF || sym[j].st_name >= strtab->sh_size ||
+            ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC) {
+          continue;
+        }
+        const char *name = strings + sym[j].st_name;
+        for (size_t k = 0; k < DYNSYM_FIELDS; k++) {
+          if (strcmp(name, symbol_fields[k].name) == 0) {
+            SYMBOL_FIELD(syms, k) = sym[j].st_value - min_vaddr;
+          }
+        }
+      }
+    } else {
+      const Elf64_Rela *rela = (const Elf64_Rela *)(data + shdr->sh_offset);
+      for (size_t j = 0; j < shdr->sh_size / sizeof(Elf64_Rela); j++) {
+        size_t k = ELF64_R_SYM(rela[j].r_info);
+        if (ELF64_R_TYPE(rela[j].r_info) != R_X86_64_GLOB_DAT || k >= nsyms ||
+            sym[k].st_name >= strtab->sh_size) {
+          continue;
+        }
+        const char *name = strings + sym[k].st_name;
+        if (strcmp(name, "__environ") == 0 || strcmp(name, "environ") == 0) {
+          syms->environ = rela[j].r_offset - min_vaddr;
+        }
+      }
+    }
+  }
+
+  // look for the instructions we borrow in the executable segments
+  for (int i = 0; i < ehdr->e_phnum && (!syms->syscall || !syms->trap); i++) {
+    if (phdrs[i].p_type != PT_LOAD || !(phdrs[i].p_flags & PF_X) ||
+        !elf_table(data, size, phdrs[i].p_offset, phdrs[i].p_filesz, 1)) {
+      continue;
+    }
+    const uint8_t *text = data + phdrs[i].p_offset;
+    const uint8_t *syscall = memmem(text, phdrs[i].p_filesz, "\x0f\x05\xc3", 3);
+    const uint8_t *trap = memchr(text, 0xcc, phdrs[i].p_filesz);
+    if (syscall != NULL) {
+      syms->syscall = phdrs[i].p_vaddr + (syscall - text) - min_vaddr;
+    }
+    if (trap != NULL) {
+      syms->trap = phdrs[i].p_vaddr + (trap - text) - min_vaddr;
+    }
+  }
+
+  for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+    if (SYMBOL_FIELD(syms, k) == 0) {
+      fprintf(stderr, "cannot find %s in libc\n", symbol_fields[k].name);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Whether the cache file or directory of st can be trusted: what we load
+// from the cache ends up as code addresses in the remote process, so it
+// must be ours, and not writable by anyone else.
+static bool cache_trusted(const struct stat *st) {
+  return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Open the cache file at path with flags, if it is a regular file that
+// cache_trusted() accepts, without following a symbolic link to it.
+static int open_cache(const char *path, int flags, mode_t mode) {
+  int fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+  struct stat st;
+  if (fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+                  !cache_trusted(&st))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Store the path of the cache file name in buf, and create the cache
+// directory if create is set. The cache lives in $XDG_CACHE_HOME/getenv, or
+// ~/.cache/getenv, with a file for the libc of every build-id. A cache
+// directory that cache_trusted() rejects is not used at all.
+static int cache_path(const char *name, bool create, char *buf,
+                      size_t len) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int ret;
+  if (xdg != NULL && xdg[0] == '/') {
+    ret = snprintf(buf, len, "%s/getenv", xdg);
+  } else if (home != NULL && home[0] == '/') {
+    ret = snprintf(buf, len, "%s/.cache", home);
+    if (create && ret > 0 && (size_t)ret < len) {
+      mkdir(buf, 0700);
+    }
+    ret = snprintf(buf, len, "%s/.cache/getenv", home);
+  } else {
+    return -1;
+  }
+  if (ret < 0 || (size_t)ret >= len) {
+    return -1;
+  }
+  if (create && mkdir(buf, 0700) && errno != EEXIST) {
+    return -1;
+  }
+  struct stat st;
+  if (lstat(buf, &st) || !S_ISDIR(st.st_mode) || !cache_trusted(&st)) {
+    return -1;
+  }
+  size_t dir = strlen(buf);
+  ret = snprintf(buf + dir, len - dir, "/%s", name);
+  return ret < 0 || (size_t)ret >= len - dir ? -1 : 0;
+}
+
+// load the symbol offsets for the libc with build_id from the cache
+static int load_cached_symbols(const char *build_id,
+                               struct libc_symbols *syms) {
+  char path[PATH_MAX];
+  if (cache_path(build_id, false, path, sizeof(path))) {
+    return -1;
+  }
+  char buf[1024];
+  int fd = open_cache(path, O_RDONLY, 0);
+  if (fd < 0 || read_fd(fd, buf, sizeof(buf)) < 0) {
+    return -1;
+  }
+  memset(syms, 0, sizeof(*syms));
+  char name[32];
+  unsigned long value;
+  int used;
+  for (char *pos = buf;
+       sscanf(pos, "%31s %lx%n", name, &value, &used) == 2; pos += used) {
+    for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+      if (strcmp(name, symbol_fields[k].name) == 0) {
+        SYMBOL_FIELD(syms, k) = value;
+      }
+    }
+  }
+  for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+    if (SYMBOL_FIELD(syms, k) == 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Store the symbol offsets for the libc with build_id in the cache. This is
+// best effort; the file is written under a temporary name and renamed into
+// place, so concurrent runs never see half of it.
+static void store_cached_symbols(const char *build_id,
+                                 const struct libc_symbols *syms) {
+  char path[PATH_MAX], tmp[PATH_MAX + 16];
+  if (cache_path(build_id, true, path, sizeof(path))) {
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    return;
+  }
+  for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+    fprintf(f, "%s %lx\n", symbol_fields[k].name,
+            (unsigned long)SYMBOL_FIELD(syms, k));
+  }
+  if (fclose(f) || rename(tmp, path)) {
+    unlink(tmp);
+  }
+}
+
+// The layout cache: a file in the cache directory that every run keeps
+// mapped, holding the symbol offsets of the libc files seen lately, keyed
+// by the device, inode and mtime of the file. A query against a known libc
+// only has to stat it, without reading the other cache, or the file. The
+// entries are replaced round robin, under flock(2) of the file, and read
+// without a lock: each has a sequence number that is odd while it is being
+// written, like a seqlock. The file is only trusted as far as the cache
+// directory is: an entry is copied out once, and checked against the
+// mapping of the process by resolve_libc_library() like any other.
+#define LAYOUT_NAME "layouts"
+// "getenvl" and the number of fields, so older layouts are started over
+#define LAYOUT_MAGIC (0x676574656e766c00 | SYMBOL_FIELDS)
+#define LAYOUT_ENTRIES 64
+
+struct layout_entry {
+  uint64_t seq;
+  uint64_t dev, ino;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t offsets[SYMBOL_FIELDS];
+};
+
+struct layout_file {
+  uint64_t magic;
+  uint64_t next; // the entry that the next new libc replaces
+  struct layout_entry entries[LAYOUT_ENTRIES];
+};
+
+static pthread_mutex_t layouts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct layout_file *layouts = NULL;
+static int layouts_fd = -1;
+
+// Map the layout cache, creating it if create is set. It stays mapped, so
+// later lookups are only memory reads. Returns NULL if there is none.
+static struct layout_file *layout_map(bool create) {
+  pthread_mutex_lock(&layouts_lock);
+  struct layout_file *file = layouts;
+  char path[PATH_MAX];
+  if (file != NULL || cache_path(LAYOUT_NAME, create, path, sizeof(path))) {
+    goto out;
+  }
+  int fd = open_cache(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+  if (fd < 0) {
+    goto out;
+  }
+  struct stat st;
+  if (create && flock(fd, LOCK_EX) == 0) {
+    if (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(*file) &&
+        ftruncate(fd, sizeof(*file)) == 0) {
+      st.st_size = sizeof(*file);
+    }
+    flock(fd, LOCK_UN);
+  } else if (fstat(fd, &st)) {
+    st.st_size = 0;
+  }
+  if (st.st_size < (off_t)sizeof(*file)) {
+    close(fd);
+    goto out;
+  }
+  file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file == MAP_FAILED) {
+    file = NULL;
+    close(fd);
+    goto out;
+  }
+  layouts = file;
+  layouts_fd = fd;
+
+out:
+  pthread_mutex_unlock(&layouts_lock);
+  return file;
+}
+
+static bool layout_matches(const struct layout_entry *e,
+                           const struct stat *st) {
+  return __atomic_load_n(&e->ino, __ATOMIC_RELAXED) == st->st_ino &&
+         __atomic_load_n(&e->dev, __ATOMIC_RELAXED) == st->st_dev &&
+         __atomic_load_n(&e->mtime_sec, __ATOMIC_RELAXED) ==
+             st->st_mtim.tv_sec &&
+         __atomic_load_n(&e->mtime_nsec, __ATOMIC_RELAXED) ==
+             st->st_mtim.tv_nsec;
+}
+
+// look up the symbol offsets of the libc file with st in the layout cache
+static int layout_lookup(const struct stat *st, struct libc_symbols *syms) {
+  const struct layout_file *file = layout_map(false);
+  if (file == NULL ||
+      __atomic_load_n(&file->magic, __ATOMIC_RELAXED) != LAYOUT_MAGIC) {
+    return -1;
+  }
+  for (size_t i = 0; i < LAYOUT_ENTRIES; i++) {
+    const struct layout_entry *e = &file->entries[i];
+    uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0 || seq & 1 || !layout_matches(e, st)) {
+      continue;
+    }
+    for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+      SYMBOL_FIELD(syms, k) =
+          __atomic_load_n(&e->offsets[k], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Store the symbol offsets of the libc file with st in the layout cache.
+// This is best effort, like store_cached_symbols().
+static void layout_store(const struct stat *st,
+                         const struct libc_symbols *syms) {
+  struct layout_file *file = layout_map(true);
+  if (file == NULL || flock(layouts_fd, LOCK_EX)) {
+    return;
+  }
+  if (file->magic != LAYOUT_MAGIC) {
+    memset(file, 0, sizeof(*file));
+    file->magic = LAYOUT_MAGIC;
+  }
+  size_t i = 0;
+  while (i < LAYOUT_ENTRIES && !layout_matches(&file->entries[i], st)) {
+    i++;
+  }
+  if (i == LAYOUT_ENTRIES) {
+    i = file->next++ % LAYOUT_ENTRIES;
+  }
+  struct layout_entry *e = &file->entries[i];
+  __atomic_store_n(&e->seq, e->seq | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&e->dev, st->st_dev, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->ino, st->st_ino, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->mtime_sec, st->st_mtim.tv_sec, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->mtime_nsec, st->st_mtim.tv_nsec, __ATOMIC_RELAXED);
+  for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+    __atomic_store_n(&e->offsets[k], SYMBOL_FIELD(syms, k), __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&e->seq, (e->seq | 1) + 1, __ATOMIC_RELEASE);
+  flock(layouts_fd, LOCK_UN);
+}
+
+// stat the file of lib as the process sees it, like open_library()
+static int stat_library(pid_t pid, const struct library *lib,
+                        struct stat *st) {
+  char filename[PATH_MAX + 32];
+  snprintf(filename, sizeof(filename), "/proc/%d/map_files/%lx-%lx", pid,
+           (unsigned long)lib->text, (unsigned long)lib->text_end);
+  if (stat(filename, st) == 0) {
+    return 0;
+  }
+  snprintf(filename, sizeof(filename), "/proc/%d/root%s", pid, lib->path);
+  return stat(filename, st);
+}
+
+// Resolve the symbol offsets of the libc file of lib, through the cache if
+// its build-id is known there and use_cache is set.
+static int resolve_libc_file(pid_t pid, const struct library *lib,
+                             struct libc_symbols *syms, bool use_cache) {
+  int fd = open_library(pid, lib);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+  uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  char build_id[128];
+  bool have_build_id = elf_build_id(data, st.st_size, build_id,
+                                    sizeof(build_id)) == 0;
+  int ret = 0;
+  if (!have_build_id || !use_cache || load_cached_symbols(build_id, syms)) {
+    ret = elf_symbols(data, st.st_size, syms);
+    if (ret == 0 && have_build_id) {
+      store_cached_symbols(build_id, syms);
+    }
+  }
+  munmap(data, st.st_size);
+  return ret;
+}
+
+// The libc files that this process resolved so far, by the device and
+// inode of their mapping, which tell files apart across mount namespaces
+// as well. When many processes are queried, e.g. a fleet of containers,
+// the symbols are only resolved once per distinct libc: the other
+// processes only need find_library() for their base address.
+#define KNOWN_LIBCS 16
+
+static pthread_mutex_t known_libcs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  dev_t dev;
+  ino_t ino;
+  struct libc_symbols offsets;
+} known_libcs[KNOWN_LIBCS];
+static size_t nknown_libcs = 0; // ever added, the oldest get replaced
+
+static int known_libc(const struct library *lib, struct libc_symbols *syms) {
+  int ret = -1;
+  pthread_mutex_lock(&known_libcs_lock);
+  size_t n = nknown_libcs < KNOWN_LIBCS ? nknown_libcs : KNOWN_LIBCS;
+  for (size_t i = 0; i < n && ret; i++) {
+    if (known_libcs[i].dev == lib->dev && known_libcs[i].ino == lib->ino) {
+      *syms = known_libcs[i].offsets;
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&known_libcs_lock);
+  return ret;
+}
+
+static void add_known_libc(const struct library *lib,
+                           const struct libc_symbols *syms) {
+  pthread_mutex_lock(&known_libcs_lock);
+  size_t n = nknown_libcs < KNOWN_LIBCS ? nknown_libcs : KNOWN_LIBCS;
+  size_t i = 0;
+  while (i < n && (known_libcs[i].dev != lib->dev ||
+                   known_libcs[i].ino != lib->ino)) {
+    i++;
+  }
+  if (i == n) {
+    i = nknown_libcs++ % KNOWN_LIBCS;
+  }
+  known_libcs[i].dev = lib->dev;
+  known_libcs[i].ino = lib->ino;
+  known_libcs[i].offsets = *syms;
+  pthread_mutex_unlock(&known_libcs_lock);
+}
+
+// Check the symbol offsets in syms against the mapping of lib: the code
+// must be in its text, with the gadgets that we are going to jump to, and
+// the slot of __environ in the rest of the file. What the caches hold may be
+// stale, or planted. The gadgets are read with a single process_vm_readv,
+// or from /proc/<pid>/mem if that is not available; neither needs the
+// process to be attached. Returns -1 if they do not match.
+static int check_symbols(pid_t pid, const struct library *lib,
+                         const struct libc_symbols *syms) {
+  static const uint8_t gadgets[] = {0x0f, 0x05, 0xc3, 0xcc};
+  for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+    uintptr_t offset = SYMBOL_FIELD(syms, k);
+    bool code = symbol_fields[k].offset !=
+                offsetof(struct libc_symbols, environ);
+    uintptr_t start = code ? lib->text : lib->base;
+    uintptr_t end = code ? lib->text_end : lib->end;
+    size_t size = code ? 1 : sizeof(uintptr_t);
+    if (symbol_fields[k].offset == offsetof(struct libc_symbols, syscall)) {
+      size = 3;
+    }
+    if (offset < start - lib->base || offset > end - lib->base - size) {
+      #ifdef DEBUG
+      fprintf(stderr, "%s at %lx is not in the mapping\n",
+              symbol_fields[k].name, (unsigned long)offset);
+      #endif
+      return -1;
+    }
+  }
+
+  uint8_t got[sizeof(gadgets)];
+  struct iovec local = {.iov_base = got, .iov_len = sizeof(got)};
+  struct iovec remote[] = {
+    {.iov_base = (void *)(lib->base + syms->syscall), .iov_len = 3},
+    {.iov_base = (void *)(lib->base + syms->trap), .iov_len = 1},
+  };
+  if (process_vm_readv(pid, &local, 1, remote, 2, 0) != sizeof(got)) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "/proc/%d/mem", pid);
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    bool copied =
+        pread(fd, got, 3, (off_t)(uintptr_t)remote[0].iov_base) == 3 &&
+        pread(fd, got + 3, 1, (off_t)(uintptr_t)remote[1].iov_base) == 1;
+    close(fd);
+    if (!copied) {
+      return -1;
+    }
+  }
+  if (memcmp(got, gadgets, sizeof(gadgets))) {
+    #ifdef DEBUG
+    fprintf(stderr, "the gadgets in %s do not match\n", lib->path);
+    #endif
+    return -1;
+  }
+  return 0;
+}
+
+// Resolve the addresses of the libc symbols we need in the remote process.
+// This reads the symbols from the ELF file of the libc that the process has
+// mapped, so it works no matter which libc we are linked against. The
+// results are cached by the build-id of the libc, so later runs only have
+// to read the build-id, or nothing at all if the kernel reports it, and in
+// front of that in the layout cache, so a libc that we saw lately only
+// needs a stat(2), and one that this process resolved already nothing.
+// Offsets from any of the caches are checked against the mapping with
+// check_symbols(), and resolved from the file again if they do not match.
+// The library is stored in lib.
+static int resolve_libc_library(pid_t pid, struct library *lib,
+                                struct libc_symbols *syms) {
+  if (find_library(pid, libc_string, lib)) {
+    return -1;
+  }
+  bool known = lib->ino != 0 && known_libc(lib, syms) == 0;
+  struct stat st;
+  bool have_stat = !known && stat_library(pid, lib, &st) == 0;
+  bool stale = false;
+  if (!known && (!have_stat || layout_lookup(&st, syms))) {
+    // with a build-id from PROCMAP_QUERY, a cache hit does not even need
+    // to open the file
+    if (lib->build_id[0] == '\0' || load_cached_symbols(lib->build_id, syms)) {
+      if (resolve_libc_file(pid, lib, syms, true)) {
+        return -1;
+      }
+    }
+    stale = true; // not in the layout cache yet
+  }
+  if (check_symbols(pid, lib, syms)) {
+    if (resolve_libc_file(pid, lib, syms, false) ||
+        check_symbols(pid, lib, syms)) {
+      fprintf(stderr, "the symbols of %s do not match its mapping\n",
+              lib->path);
+      return -1;
+    }
+    if (known) {
+      have_stat = stat_library(pid, lib, &st) == 0;
+    }
+    known = false;
+    stale = true;
+  }
+  if (stale && have_stat) {
+    layout_store(&st, syms);
+  }
+  if (!known && lib->ino != 0) {
+    add_known_libc(lib, syms);
+  }
+
+  #ifdef DEBUG
+  fprintf(stderr, "their libc           %s at %p\n", lib->path,
+          (void *)lib->base);
+  #endif
+  for (size_t k = 0; k < SYMBOL_FIELDS; k++) {
+    SYMBOL_FIELD(syms, k) += lib->base;
+  }
+  return 0;
+}
+
+static int resolve_libc(pid_t pid, struct libc_symbols *syms) {
+  struct library lib;
+  return resolve_libc_library(pid, &lib, syms);
+}
+
+const char *const remote_phase_names[REMOTE_NPHASES] = {
+  "attach", "mmap", "upload", "call", "readback", "restore", "detach",
+};
+
+// The stats that the queries on this thread add to, or NULL, see
+// remote_set_stats(). The time between two calls to stats_phase() is
+// charged to the phase named by the second one.
+static __thread struct remote_stats *stats;
+static __thread uint64_t stats_last;
+static __thread uint64_t stats_attached; // when we started to attach
+
+void remote_set_stats(struct remote_stats *s) {
+  stats = s;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_start(void) {
+  if (stats != NULL) {
+    stats_last = now_ns();
+  }
+}
+
+static void stats_phase(enum remote_phase phase) {
+  if (stats != NULL) {
+    uint64_t now = now_ns();
+    stats->ns[phase] += now - stats_last;
+    stats_last = now;
+    if (phase == REMOTE_PHASE_DETACH) {
+      stats->pause += now - stats_attached;
+    }
+  }
+}
+
+// Static probes in the style of <sys/sdt.h>, for perf and bpftrace, which
+// are compiled in with -DGETENV_PROBES (make probes). Each one is a nop
+// with a note in .note.stapsdt that names it, provider getenv, and tells
+// where its arguments are; they are all passed as 64 bit values.
+#ifdef GETENV_PROBES
+#define PROBE_NOTE(name, args)                                               \
+  "990: nop\n"                                                               \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+  ".balign 4\n"                                                              \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+  "991: .asciz \"stapsdt\"\n"                                                \
+  "992: .balign 4\n"                                                         \
+  "993: .8byte 990b, _.stapsdt.base, 0\n"                                    \
+  ".asciz \"getenv\"\n"                                                      \
+  ".asciz \"" #name "\"\n"                                                   \
+  ".asciz \"" args "\"\n"                                                    \
+  "994: .balign 4\n"                                                         \
+  ".popsection\n"                                                            \
+  ".ifndef _.stapsdt.base\n"                                                 \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+  ".weak _.stapsdt.base\n"                                                   \
+  ".hidden _.stapsdt.base\n"                                                 \
+  "_.stapsdt.base: .space 1\n"                                               \
+  ".size _.stapsdt.base, 1\n"                                                \
+  ".popsection\n"                                                            \
+  ".endif\n"
+#define PROBE2(name, a, b)                                                   \
+  __asm__ __volatile__(PROBE_NOTE(name, "8@%0 8@%1")                         \
+                       :: "nor"((uint64_t)(a)), "nor"((uint64_t)(b)))
+#define PROBE3(name, a, b, c)                                                \
+  __asm__ __volatile__(PROBE_NOTE(name, "8@%0 8@%1 8@%2")                    \
+                       :: "nor"((uint64_t)(a)), "nor"((uint64_t)(b)),        \
+                          "nor"((uint64_t)(c)))
+#else
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
+// whether to log every ptrace request and wait, see remote_set_trace()
+static bool tracing = false;
+
+void remote_set_trace(int on) {
+  tracing = on != 0;
+}
+
+static const char *ptrace_name(enum __ptrace_request request) {
+  switch (request) {
+  case PTRACE_PEEKTEXT:
+    return "PTRACE_PEEKTEXT";
+  case PTRACE_PEEKDATA:
+    return "PTRACE_PEEKDATA";
+  case PTRACE_POKETEXT:
+    return "PTRACE_POKETEXT";
+  case PTRACE_CONT:
+    return "PTRACE_CONT";
+  case PTRACE_SINGLESTEP:
+    return "PTRACE_SINGLESTEP";
+  case PTRACE_GETREGS:
+    return "PTRACE_GETREGS";
+  case PTRACE_SETREGS:
+    return "PTRACE_SETREGS";
+  case PTRACE_DETACH:
+    return "PTRACE_DETACH";
+  case PTRACE_SETOPTIONS:
+    return "PTRACE_SETOPTIONS";
+  case PTRACE_GETSIGINFO:
+    return "PTRACE_GETSIGINFO";
+  case PTRACE_SEIZE:
+    return "PTRACE_SEIZE";
+  case PTRACE_INTERRUPT:
+    return "PTRACE_INTERRUPT";
+  case PTRACE_GETSIGMASK:
+    return "PTRACE_GETSIGMASK";
+  case PTRACE_SETSIGMASK:
+    return "PTRACE_SETSIGMASK";
+  default:
+    return "PTRACE_UNKNOWN";
+  }
+}
+
+// ptrace(2), with the probes ptrace_begin and ptrace_end (request, pid and
+// the result) around it, and logged with --trace. errno is kept.
+static long do_ptrace(enum __ptrace_request request, pid_t pid, void *addr,
+                      void *data) {
+  uint64_t start = tracing ? now_ns() : 0;
+  PROBE2(ptrace_begin, request, pid);
+  long ret = ptrace(request, pid, addr, data);
+  PROBE3(ptrace_end, request, pid, ret);
+  if (tracing) {
+    int err = errno;
+    uint64_t end = now_ns();
+    fprintf(stderr, "trace ts=%" PRIu64 " pid=%d req=%s ret=%ld ns=%" PRIu64
+            "\n", start, pid, ptrace_name(request), ret, end - start);
+    errno = err;
+  }
+  return ret;
+}
+
+// waitpid(2), with the probes wait_begin and wait_end (the pid that was
+// waited for, and the one that stopped with its status) around it, and
+// logged with --trace. This is where the time that a stopped process runs
+// our code, or takes to stop, goes. errno is kept.
+static pid_t do_waitpid(pid_t pid, int *status, int options) {
+  uint64_t start = tracing ? now_ns() : 0;
+  PROBE2(wait_begin, pid, options);
+  pid_t ret = waitpid(pid, status, options);
+  PROBE3(wait_end, pid, ret, ret > 0 ? *status : 0);
+  if (tracing) {
+    int err = errno;
+    uint64_t end = now_ns();
+    fprintf(stderr, "trace ts=%" PRIu64 " pid=%d req=wait ret=%d status=0x%x "
+            "ns=%" PRIu64 "\n", start, pid, ret, ret > 0 ? *status : 0,
+            end - start);
+    errno = err;
+  }
+  return ret;
+}
+
+// Open /proc/<pid>/mem of an attached process for bulk writes to its text,
+// or return -1 if that is not possible, in which case poke_text() uses
+// PTRACE_POKETEXT.
+static int open_mem(pid_t pid) {
+  char filename[32];
+  snprintf(filename, sizeof(filename), "/proc/%d/mem", pid);
+  int fd = open(filename, O_RDWR | O_CLOEXEC);
+  #ifdef DEBUG
+  if (fd < 0) {
+    perror(filename);
+  }
+  #endif
+  return fd;
+}
+
+// Update the text area of pid at the area starting at where. The data copied
+// should be in the new_text buffer whose size is given by len. If old_text is
+// not null, the original text data will be copied into it. Therefore old_text
+// must have the same size as new_text.
+//
+// If mem_fd is an fd returned by open_mem(), the whole buffer is written (and
+// saved) with a single pwrite (and pread). Otherwise, or if the kernel refuses
+// that write, it is copied one word at a time with PTRACE_POKETEXT.
+static int poke_text(pid_t pid, int mem_fd, void *where, void *new_text,
+                     void *old_text, size_t len) {
+  if (len % sizeof(void *) != 0) {
+    fprintf(stderr, "invalid len, not a multiple of %zd\n", sizeof(void *));
+    return -1;
+  }
+
+  if (mem_fd >= 0) {
+    if ((old_text == NULL ||
+         pread(mem_fd, old_text, len, (off_t)where) == (ssize_t)len) &&
+        pwrite(mem_fd, new_text, len, (off_t)where) == (ssize_t)len) {
+      return 0;
+    }
+    #ifdef DEBUG
+    perror("/proc/<pid>/mem");
+    #endif
+  }
+
+  long poke_data;
+  for (size_t copied = 0; copied < len; copied += sizeof(poke_data)) {
+    memmove(&poke_data, new_text + copied, sizeof(poke_data));
+    if (old_text != NULL) {
+      errno = 0;
+      long peek_data = do_ptrace(PTRACE_PEEKTEXT, pid, where + copied, NULL);
+      if (peek_data == -1 && errno) {
+        perror("PTRACE_PEEKTEXT");
+        return -1;
+      }
+      memmove(old_text + copied, &peek_data, sizeof(peek_data));
+    }
+    if (do_ptrace(PTRACE_POKETEXT, pid, where + copied, (void *)poke_data) < 0) {
+      perror("PTRACE_POKETEXT");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// the name of the memfd of the resident agent, and of its thread
+#define AGENT_NAME "getenv-agent"
+
+// the longest we keep a process stopped, in milliseconds, or 0
+static long timeout_ms = 0;
+
+// older glibc headers lack the name for the thread id of SIGEV_THREAD_ID
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// The deadline of the query that runs on this thread is a timer that sends
+// SIGALRM to this thread only. Its handler is installed without SA_RESTART,
+// so a waitpid() that is still blocked at the deadline fails with EINTR.
+static __thread timer_t deadline_timer;
+static __thread bool has_deadline_timer = false;
+static __thread volatile sig_atomic_t deadline_expired = 0;
+
+static void deadline_handler(int sig) {
+  deadline_expired = 1;
+}
+
+// deletes the timer of a thread when it exits
+static pthread_key_t deadline_key;
+static pthread_once_t deadline_once = PTHREAD_ONCE_INIT;
+
+static void deadline_delete(void *unused) {
+  if (has_deadline_timer) {
+    timer_delete(deadline_timer);
+    has_deadline_timer = false;
+  }
+}
+
+static void deadline_key_create(void) {
+  pthread_key_create(&deadline_key, deadline_delete);
+}
+
+int remote_set_timeout(long ms) {
+  struct sigaction sa = {.sa_handler = deadline_handler};
+  sigemptyset(&sa.sa_mask);
+  if (ms && sigaction(SIGALRM, &sa, NULL)) {
+    perror("sigaction");
+    return -1;
+  }
+  timeout_ms = ms;
+  return 0;
+}
+
+static bool deadline_create(void) {
+  if (!has_deadline_timer) {
+    struct sigevent sev = {
+      .sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGALRM,
+    };
+    sev.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &sev, &deadline_timer)) {
+      perror("timer_create");
+      return false;
+    }
+    has_deadline_timer = true;
+    pthread_once(&deadline_once, deadline_key_create);
+    pthread_setspecific(deadline_key, &deadline_timer);
+  }
+  return true;
+}
+
+static void deadline_start(void) {
+  deadline_expired = 0;
+  if (timeout_ms == 0 || !deadline_create()) {
+    return;
+  }
+  struct itimerspec its = {
+    .it_value = {.tv_sec = timeout_ms / 1000,
+                 .tv_nsec = timeout_ms % 1000 * 1000000},
+  };
+  if (timer_settime(deadline_timer, 0, &its, NULL)) {
+    perror("timer_settime");
+  }
+}
+
+static void deadline_stop(void) {
+  struct itimerspec its = {{0, 0}, {0, 0}};
+  if (has_deadline_timer) {
+    timer_settime(deadline_timer, 0, &its, NULL);
+  }
+}
+
+// Stop a process that is still running our code when the deadline passed,
+// so its registers can be restored. Any stop will do for that, so a signal
+// that arrives first is simply deferred like in do_wait().
+static int interrupt_process(pid_t pid, int *pending) {
+  if (do_ptrace(PTRACE_INTERRUPT, pid, NULL, NULL)) {
+    perror("PTRACE_INTERRUPT");
+    return -1;
+  }
+  while (true) {
+    int status;
+    if (do_waitpid(pid, &status, __WALL) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("wait");
+      return -1;
+    }
+    if (!WIFSTOPPED(status)) {
+      fprintf(stderr, "process %d exited while interrupting it\n", pid);
+      return -1;
+    }
+    if (status >> 16 != PTRACE_EVENT_STOP && WSTOPSIG(status) != SIGTRAP) {
+      *pending = WSTOPSIG(status);
+    }
+    return 0;
+  }
+}
+
+// Whether the signal sig that stopped pid was raised by a fault of the code
+// it runs, rather than sent by someone. Such a signal is caused by our
+// payload, and would only be raised again if we resumed the process.
+static bool is_fault(pid_t pid, int sig) {
+  if (sig != SIGSEGV && sig != SIGBUS && sig != SIGILL && sig != SIGFPE) {
+    return false;
+  }
+  siginfo_t info;
+  return do_ptrace(PTRACE_GETSIGINFO, pid, NULL, &info) == 0 && info.si_code > 0;
+}
+
+// Wait for pid to stop with a SIGTRAP after it was resumed with request.
+// Other signals that arrive in the meantime are not delivered, as they would
+// run the process' signal handlers on top of our injected code. Most are
+// kept pending by the kernel, see block_signals(); of those that still get
+// here, the last one is stored in *pending, to be delivered when we detach,
+// and the process is resumed with the same request again. This fails with the
+// process stopped if our code faults, or if the deadline passes first.
+static int do_wait(pid_t pid, enum __ptrace_request request,
+                   const char *name, int *pending) {
+  while (true) {
+    int status;
+    if (do_waitpid(pid, &status, __WALL) == -1) {
+      if (errno == EINTR && deadline_expired) {
+        fprintf(stderr, "%s timed out after %ld ms, interrupting process %d\n",
+                name, timeout_ms, pid);
+        interrupt_process(pid, pending);
+        return -1;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("wait");
+      return -1;
+    }
+    if (!WIFSTOPPED(status)) {
+      fprintf(stderr, "%s got unexpected status %d\n", name, status);
+      return -1;
+    }
+    if (WSTOPSIG(status) == SIGTRAP) {
+      return 0;
+    }
+    if (is_fault(pid, WSTOPSIG(status))) {
+      fprintf(stderr, "%s: the injected code got %s\n", name,
+              strsignal(WSTOPSIG(status)));
+      return -1;
+    }
+    // group-stops are reported as PTRACE_EVENT_STOP, and need no signal
+    if (status >> 16 != PTRACE_EVENT_STOP) {
+      #ifdef DEBUG
+      fprintf(stderr, "%s deferring signal %s\n", name,
+              strsignal(WSTOPSIG(status)));
+      #endif
+      *pending = WSTOPSIG(status);
+    }
+    if (deadline_expired) {
+      fprintf(stderr, "%s timed out after %ld ms\n", name, timeout_ms);
+      return -1;
+    }
+    if (do_ptrace(request, pid, NULL, NULL)) {
+      perror(name);
+      return -1;
+    }
+  }
+}
+
+static int singlestep(pid_t pid, int *pending) {
+  if (do_ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL)) {
+    perror("PTRACE_SINGLESTEP");
+    return -1;
+  }
+  return do_wait(pid, PTRACE_SINGLESTEP, "PTRACE_SINGLESTEP", pending);
+}
+
+// Turn PTRACE_O_EXITKILL on while the registers of pid are pointing into our
+// injected code, so if we get killed halfway through, the process is killed
+// rather than resumed in a state it cannot recover from.
+static int set_exitkill(pid_t pid, bool on) {
+  if (do_ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             (void *)(long)(on ? PTRACE_O_EXITKILL : 0))) {
+    perror("PTRACE_SETOPTIONS");
+    return -1;
+  }
+  return 0;
+}
+
+// The signals that block_signals() leaves alone: the ones that our code
+// raises itself, or a fault of it would. The kernel unblocks those by
+// force, and resets the handler of the program to the default with it.
+#define SIGNAL_BIT(sig) ((uint64_t)1 << ((sig) - 1))
+#define SYNC_SIGNALS                                                        \
+  (SIGNAL_BIT(SIGTRAP) | SIGNAL_BIT(SIGSEGV) | SIGNAL_BIT(SIGBUS) |         \
+   SIGNAL_BIT(SIGILL) | SIGNAL_BIT(SIGFPE) | SIGNAL_BIT(SIGSYS))
+
+// Whether a thread stopped in syscall nr runs with a temporary signal mask
+// that the kernel puts back when it returns to user space. Setting the mask
+// with ptrace makes it forget the one to put back, so the program would be
+// left with the temporary one.
+static bool swaps_sigmask(long nr) {
+  switch (nr) {
+  case SYS_ppoll:
+  case SYS_pselect6:
+  case SYS_rt_sigsuspend:
+  case SYS_epoll_pwait:
+  #ifdef SYS_epoll_pwait2
+  case SYS_epoll_pwait2:
+  #endif
+  case SYS_io_pgetevents:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Block the signals of pid, stopped with regs, while it runs our code, so
+// that the kernel keeps them pending instead of reporting them to us: they
+// would run the signal handlers of the program on top of our code. Its own
+// mask is stored in *mask, to be put back with unblock_signals() before we
+// detach, which delivers them. Returns false if the mask was left as it is,
+// as for a thread in a syscall that swaps it; do_wait() then defers the
+// signals that arrive.
+static bool block_signals(pid_t pid, const struct user_regs_struct *regs,
+                          uint64_t *mask) {
+  if (swaps_sigmask(regs->orig_rax) ||
+      do_ptrace(PTRACE_GETSIGMASK, pid, (void *)sizeof(*mask), mask)) {
+    return false;
+  }
+  uint64_t blocked = *mask | ~SYNC_SIGNALS;
+  if (do_ptrace(PTRACE_SETSIGMASK, pid, (void *)sizeof(blocked), &blocked)) {
+    perror("PTRACE_SETSIGMASK");
+    return false;
+  }
+  return true;
+}
+
+static int unblock_signals(pid_t pid, uint64_t mask) {
+  if (do_ptrace(PTRACE_SETSIGMASK, pid, (void *)sizeof(mask), &mask)) {
+    perror("PTRACE_SETSIGMASK");
+    return -1;
+  }
+  return 0;
+}
+
+static void check_yama(void) {
+  FILE *yama_file = fopen("/proc/sys/kernel/yama/ptrace_scope", "r");
+  if (yama_file == NULL) {
+    return;
+  }
+  char yama_buf[8];
+  memset(yama_buf, 0, sizeof(yama_buf));
+  if (fread(yama_buf, 1, sizeof(yama_buf), yama_file) == 0) {
+      fprintf(stderr, "Could not read yama file\n");
+  }
+  if (strcmp(yama_buf, "0\n") != 0) {
+    fprintf(stderr, "\nThe likely cause of this failure is that your system has "
+           "kernel.yama.ptrace_scope = %s",
+           yama_buf);
+    fprintf(stderr, "If you would like to disable Yama, you can run: "
+           "sudo sysctl kernel.yama.ptrace_scope=0\n");
+  }
+  fclose(yama_file);
+}
+
+// The code that we run in the remote process is assembled into a payload:
+// the code, followed by the data that it refers to on the next page. Operands
+// that point into the payload are recorded as fixups and resolved by
+// payload_finish() once the size of the code is known, so the payload only
+// addresses itself relative to %rip and does not depend on where it ends up
+// being mapped. The mapping is never writable and executable at once: it is
+// mapped read-only and executable, we write it through /proc/pid/mem, and
+// the prologue makes the pages of the data and the bss writable.
+enum fixup_kind {
+  FIXUP_DATA, // rel32 displacement of an offset in the data
+  FIXUP_CODE, // rel32 displacement of an offset in the code
+  FIXUP_BSS,  // rel32 displacement of an offset in the bss
+  FIXUP_DONE, // rel32 displacement of the epilogue
+  FIXUP_SIZE, // imm32 size of the mapping
+  FIXUP_RW,   // imm32 size of the writable pages after the code
+};
+
+struct fixup {
+  enum fixup_kind kind;
+  size_t at; // offset of the 32 bit field in the code
+  size_t target;
+};
+
+struct payload {
+  struct remote_arena *arena; // that the buffers are scratch space of
+  uint8_t *code, *data;
+  size_t code_len, code_cap, data_len, data_cap;
+  size_t bss;   // zero bytes after the data, mapped but never copied over
+  struct fixup *fixups;
+  size_t nfixups, fixups_cap;
+  size_t done;  // offset of the epilogue
+  bool failed;  // an allocation failed, and payload_finish() fails
+};
+
+// The direction flag in %eflags. Payloads and the calls they make run with
+// it clear, as the ABI wants on function entry, whatever it was in the
+// thread that was interrupted; otherwise string instructions like repne
+// scasb would run backwards.
+#define EFLAGS_DF (1 << 10)
+
+// general purpose registers, numbered as in their encoding
+enum reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+           R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// make room for need elements of size bytes in *buf
+static bool payload_reserve(struct payload *p, void **buf, size_t *cap,
+                            size_t need, size_t size) {
+  if (p->failed) {
+    return false;
+  }
+  if (need <= *cap) {
+    return true;
+  }
+  size_t grown_cap = *cap ? *cap : 64;
+  while (grown_cap < need) {
+    grown_cap *= 2;
+  }
+  void *grown = arena_grow(p->arena, *buf, *cap * size, grown_cap * size,
+                           true);
+  if (grown == NULL) {
+    p->failed = true;
+    return false;
+  }
+  *buf = grown;
+  *cap = grown_cap;
+  return true;
+}
+
+// append len bytes of code to the payload
+static void emit(struct payload *p, const void *bytes, size_t len) {
+  if (payload_reserve(p, (void **)&p->code, &p->code_cap, p->code_len + len,
+                      1)) {
+    memmove(p->code + p->code_len, bytes, len);
+    p->code_len += len;
+  }
+}
+
+// append a 32 bit field that payload_finish() fills in
+static void emit_fixup(struct payload *p, enum fixup_kind kind,
+                       size_t target) {
+  if (payload_reserve(p, (void **)&p->fixups, &p->fixups_cap,
+                      p->nfixups + 1, sizeof(struct fixup))) {
+    p->fixups[p->nfixups++] =
+        (struct fixup){.kind = kind, .at = p->code_len, .target = target};
+  }
+  static const uint8_t zero[4];
+  emit(p, zero, sizeof(zero));
+}
+
+// append len bytes of data to the payload, aligned to a word, and return
+// their offset in the data
+static size_t payload_data(struct payload *p, const void *bytes, size_t len) {
+  size_t offset = (p->data_len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (payload_reserve(p, (void **)&p->data, &p->data_cap, offset + len, 1)) {
+    memset(p->data + p->data_len, 0, offset - p->data_len);
+    memmove(p->data + offset, bytes, len);
+    p->data_len = offset + len;
+  }
+  return offset;
+}
+
+// reserve len zero bytes after the data, aligned to a word, and return
+// their offset there
+static size_t payload_bss(struct payload *p, size_t len) {
+  size_t offset = (p->bss + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  p->bss = offset + len;
+  return offset;
+}
+
+// the REX prefix for a 64 bit operation with reg in ModRM.reg and rm in
+// ModRM.rm
+static uint8_t rex_w(enum reg reg, enum reg rm) {
+  return 0x48 | (reg >= R8 ? 0x04 : 0) | (rm >= R8 ? 0x01 : 0);
+}
+
+// mov $imm, %reg
+static void emit_mov_imm(struct payload *p, enum reg reg, uint64_t imm) {
+  uint8_t insn[] = {rex_w(RAX, reg), 0xb8 + (reg & 7)};
+  emit(p, insn, sizeof(insn));
+  emit(p, &imm, sizeof(imm));
+}
+
+// mov %src, %dst
+static void emit_mov_reg(struct payload *p, enum reg dst, enum reg src) {
+  uint8_t insn[] = {rex_w(src, dst), 0x89, 0xc0 | (src & 7) << 3 | (dst & 7)};
+  emit(p, insn, sizeof(insn));
+}
+
+// lea data(%rip), %reg, for an offset returned by payload_data()
+static void emit_lea_data(struct payload *p, enum reg reg, size_t data) {
+  uint8_t insn[] = {rex_w(reg, RAX), 0x8d, 0x05 | (reg & 7) << 3};
+  emit(p, insn, sizeof(insn));
+  emit_fixup(p, FIXUP_DATA, data);
+}
+
+// lea bss(%rip), %reg, for an offset returned by payload_bss()
+static void emit_lea_bss(struct payload *p, enum reg reg, size_t bss) {
+  uint8_t insn[] = {rex_w(reg, RAX), 0x8d, 0x05 | (reg & 7) << 3};
+  emit(p, insn, sizeof(insn));
+  emit_fixup(p, FIXUP_BSS, bss);
+}
+
+// lea disp(%base), %reg; %base cannot be %rsp or %r12, which need a SIB byte
+static void emit_lea(struct payload *p, enum reg reg, enum reg base,
+                     int32_t disp) {
+  assert((base & 7) != RSP);
+  uint8_t insn[] = {rex_w(reg, base), 0x8d,
+                    0x80 | (reg & 7) << 3 | (base & 7)};
+  emit(p, insn, sizeof(insn));
+  emit(p, &disp, sizeof(disp));
+}
+
+// mov %src, disp(%base), with the same restriction as emit_lea()
+static void emit_store(struct payload *p, enum reg base, int32_t disp,
+                       enum reg src) {
+  assert((base & 7) != RSP);
+  uint8_t insn[] = {rex_w(src, base), 0x89,
+                    0x80 | (src & 7) << 3 | (base & 7)};
+  emit(p, insn, sizeof(insn));
+  emit(p, &disp, sizeof(disp));
+}
+
+// mov disp(%base), %dst, with the same restriction as emit_lea()
+static void emit_load(struct payload *p, enum reg dst, enum reg base,
+                      int32_t disp) {
+  assert((base & 7) != RSP);
+  uint8_t insn[] = {rex_w(dst, base), 0x8b,
+                    0x80 | (dst & 7) << 3 | (base & 7)};
+  emit(p, insn, sizeof(insn));
+  emit(p, &disp, sizeof(disp));
+}
+
+// mov %rax, addr
+static void emit_store_rax(struct payload *p, uintptr_t addr) {
+  static const uint8_t insn[] = {0x48, 0xa3};
+  emit(p, insn, sizeof(insn));
+  emit(p, &addr, sizeof(addr));
+}
+
+// Store the string pointer in %rax at slot of the results that %base points
+// to, and its length without the NUL at len_slot, unless it is NULL. The
+// length is counted with repne scasb, so that the string can be read back
+// with exactly its size. strlen and memcpy are not called, as in glibc
+// their symbols are IFUNCs, which return an implementation instead.
+//
+// With copy, the bytes of the string are also copied to %r14 with rep
+// movsb, and %r14 is moved on to the next word after them, if they fit
+// below %r13. copy_strings() finds them there the same way.
+static void emit_store_string(struct payload *p, enum reg base, size_t slot,
+                              size_t len_slot, bool copy) {
+  static const uint8_t test_jz[] = {
+    0x48, 0x85, 0xc0, // test %rax, %rax
+    0x74, 0x00,       // jz past the length, and the copy
+  };
+  static const uint8_t strlen_rax[] = {
+    0x48, 0x89, 0xc7,                         // mov %rax, %rdi
+    0x31, 0xc0,                               // xor %eax, %eax
+    0x48, 0xc7, 0xc1, 0xff, 0xff, 0xff, 0xff, // mov $-1, %rcx
+    0xf2, 0xae,                               // repne scasb
+    0x48, 0xf7, 0xd1,                         // not %rcx
+    0x48, 0xff, 0xc9,                         // dec %rcx
+  };
+  static const uint8_t check_room[] = {
+    0x4c, 0x89, 0xf2, // mov %r14, %rdx
+    0x48, 0x01, 0xca, // add %rcx, %rdx
+    0x4c, 0x39, 0xea, // cmp %r13, %rdx
+    0x77, 20,         // ja past the copy
+  };
+  static const uint8_t copy_rsi[] = {
+    0x4c, 0x89, 0xf7,       // mov %r14, %rdi
+    0xf3, 0xa4,             // rep movsb
+    0x4c, 0x8d, 0x77, 0x07, // lea 7(%rdi), %r14
+    0x49, 0x83, 0xe6, 0xf8, // and $-8, %r14
+  };
+  emit_store(p, base, slot * sizeof(void *), RAX);
+  size_t jz = p->code_len + sizeof(test_jz);
+  emit(p, test_jz, sizeof(test_jz));
+  emit(p, strlen_rax, sizeof(strlen_rax));
+  emit_store(p, base, len_slot * sizeof(void *), RCX);
+  if (copy) {
+    emit(p, check_room, sizeof(check_room));
+    emit_load(p, RSI, base, slot * sizeof(void *));
+    emit(p, copy_rsi, sizeof(copy_rsi));
+  }
+  if (!p->failed) {
+    p->code[jz - 1] = (uint8_t)(p->code_len - jz);
+  }
+}
+
+// call the function at addr, which clobbers %rax
+static void emit_call(struct payload *p, uintptr_t addr) {
+  static const uint8_t call_rax[] = {0xff, 0xd0};
+  emit_mov_imm(p, RAX, addr);
+  emit(p, call_rax, sizeof(call_rax));
+}
+
+// run system call nr with the arguments that are already in place
+static void emit_syscall(struct payload *p, long nr) {
+  static const uint8_t syscall[] = {0x0f, 0x05};
+  emit_mov_imm(p, RAX, nr);
+  emit(p, syscall, sizeof(syscall));
+}
+
+// jump to the epilogue if the last system call failed
+static void emit_check(struct payload *p) {
+  static const uint8_t cmp_jae[] = {
+    0x48, 0x3d, 0x01, 0xf0, 0xff, 0xff, // cmp $-4095, %rax
+    0x0f, 0x83,                         // jae rel32
+  };
+  emit(p, cmp_jae, sizeof(cmp_jae));
+  emit_fixup(p, FIXUP_DONE, 0);
+}
+
+// Start the payload: mprotect(2) the pages after the code, which hold the
+// data and the bss, to be writable. Every payload starts with this.
+static void emit_prologue(struct payload *p) {
+  static const uint8_t mov_esi[] = {0xbe}; // mov $imm32, %esi
+  emit_lea_data(p, RDI, 0);
+  emit(p, mov_esi, sizeof(mov_esi));
+  emit_fixup(p, FIXUP_RW, 0);
+  emit_mov_imm(p, RDX, PROT_READ | PROT_WRITE);
+  emit_syscall(p, 10); // mprotect
+  emit_check(p);
+}
+
+// End the payload: set %ebx to 1 to tell us that it ran to completion, set
+// up munmap(2) for the mapping that holds the payload, and jump to the
+// syscall gadget with the address of the trap gadget pushed as the return
+// address, so the process stops right after the mapping is gone. Jumps from
+// emit_check() land after %ebx is set.
+static void emit_epilogue(struct payload *p, const struct libc_symbols *syms) {
+  static const uint8_t push_rcx[] = {0x51}; // push %rcx
+  static const uint8_t jmp_rcx[] = {0xff, 0xe1}; // jmp *%rcx
+  static const uint8_t mov_esi[] = {0xbe}; // mov $imm32, %esi
+  emit_mov_imm(p, RBX, 1);
+  p->done = p->code_len;
+  uint8_t lea_rdi[] = {rex_w(RDI, RAX), 0x8d, 0x3d}; // lea rel32(%rip), %rdi
+  emit(p, lea_rdi, sizeof(lea_rdi));
+  emit_fixup(p, FIXUP_CODE, 0);
+  emit(p, mov_esi, sizeof(mov_esi));
+  emit_fixup(p, FIXUP_SIZE, 0);
+  emit_mov_imm(p, RAX, 11); // munmap
+  emit_mov_imm(p, RCX, syms->trap);
+  emit(p, push_rcx, sizeof(push_rcx));
+  emit_mov_imm(p, RCX, syms->syscall);
+  emit(p, jmp_rcx, sizeof(jmp_rcx));
+}
+
+// the size of the mapping for a payload of len bytes, in whole pages
+static size_t payload_maplen(size_t len) {
+  return (len + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+// Lay out the code and the data of the payload, which starts on the page
+// after the code, and resolve its fixups. The result is scratch space of
+// *len bytes, a whole number of words, and the bss follows it in the
+// mapping.
+static uint8_t *payload_finish(struct payload *p, size_t *len) {
+  uint8_t *text = NULL;
+  if (p->failed) {
+    goto out;
+  }
+  size_t data = payload_maplen(p->code_len);
+  *len = (data + p->data_len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  text = arena_scratch(p->arena, *len);
+  if (text == NULL) {
+    goto out;
+  }
+  memset(text, 0, *len);
+  memmove(text, p->code, p->code_len);
+  memmove(text + data, p->data, p->data_len);
+  for (size_t i = 0; i < p->nfixups; i++) {
+    const struct fixup *f = &p->fixups[i];
+    size_t next = f->at + sizeof(int32_t);
+    int32_t value = 0;
+    switch (f->kind) {
+    case FIXUP_DATA:
+      value = (int32_t)(data + f->target - next);
+      break;
+    case FIXUP_CODE:
+      value = (int32_t)(f->target - next);
+      break;
+    case FIXUP_BSS:
+      value = (int32_t)(*len + f->target - next);
+      break;
+    case FIXUP_DONE:
+      value = (int32_t)(p->done - next);
+      break;
+    case FIXUP_SIZE:
+      value = (int32_t)payload_maplen(*len + p->bss);
+      break;
+    case FIXUP_RW:
+      value = (int32_t)(payload_maplen(*len + p->bss) - data);
+      break;
+    }
+    memmove(text + f->at, &value, sizeof(value));
+  }
+
+out:
+  *p = (struct payload){.arena = p->arena};
+  return text;
+}
+
+// Run a payload in the remote process, whose original registers are in
+// oldregs. First, we allocate some memory for ourselves so we don't need to
+// stomp on the remote process' memory, by pointing %rip at the SYSCALL
+// instruction in libc and asking for a mapping. The payload is copied there
+// and run with %rsp set to sp, until its epilogue unmaps it again and stops
+// on the trap gadget. The registers at that point are stored in regs.
+static int run_payload(pid_t pid, int mem_fd, const struct libc_symbols *syms,
+                       const struct user_regs_struct *oldregs,
+                       uint8_t *text, size_t len, uintptr_t sp, int *pending,
+                       struct user_regs_struct *regs) {
+  size_t maplen = payload_maplen(len);
+  memmove(regs, oldregs, sizeof(*regs));
+  regs->rax = 9;                           // mmap
+  regs->rdi = 0;                           // addr
+  regs->rsi = maplen;                      // length
+  regs->rdx = PROT_READ | PROT_EXEC;       // prot
+  regs->r10 = MAP_PRIVATE | MAP_ANONYMOUS; // flags
+  regs->r8 = -1;                           // fd
+  regs->r9 = 0;                            //  offset
+  regs->rip = syms->syscall;
+  regs->eflags &= ~EFLAGS_DF;
+  // If the process was stopped in a syscall, the kernel restarts it when
+  // the process resumes, by rewinding %rip, unless orig_rax says that it is
+  // not in one. It is restarted for real once oldregs are restored.
+  regs->orig_rax = -1;
+  if (set_exitkill(pid, true)) {
+    return -1;
+  }
+  if (do_ptrace(PTRACE_SETREGS, pid, NULL, regs)) {
+    perror("PTRACE_SETREGS");
+    return -1;
+  }
+
+  // invoke mmap(2)
+  if (singlestep(pid, pending)) {
+    return -1;
+  }
+  if (do_ptrace(PTRACE_GETREGS, pid, NULL, regs)) {
+    perror("PTRACE_GETREGS");
+    return -1;
+  }
+  if (regs->rip != syms->syscall + 2) {
+    fprintf(stderr, "unexpectedly stopped at %p\n", (void *)regs->rip);
+    return -1;
+  }
+  stats_phase(REMOTE_PHASE_MMAP);
+
+  // this is the address of the memory we allocated
+  void *mmap_memory = (void *)regs->rax;
+  if ((unsigned long)regs->rax >= (unsigned long)-4095) {
+    fprintf(stderr, "failed to mmap: %s\n", strerror(-regs->rax));
+    return -1;
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "allocated memory at  %p\n", mmap_memory);
+  #endif
+
+  // update the mmap area
+  #ifdef DEBUG
+  fprintf(stderr, "inserting code/data into the mmap area at %p\n", mmap_memory);
+  #endif
+  if (poke_text(pid, mem_fd, mmap_memory, text, NULL, len)) {
+    return -1;
+  }
+
+  regs->rip = (long)mmap_memory;
+  regs->rsp = sp;
+  regs->rbx = 0;                           // set by the epilogue
+  #ifdef DEBUG
+  fprintf(stderr, "setting the registers of the remote process\n");
+  #endif
+  if (do_ptrace(PTRACE_SETREGS, pid, NULL, regs)) {
+    perror("PTRACE_SETREGS");
+    return -1;
+  }
+  stats_phase(REMOTE_PHASE_UPLOAD);
+
+  // continue the program, and wait for the trap
+  #ifdef DEBUG
+  fprintf(stderr, "continuing execution\n");
+  #endif
+  do_ptrace(PTRACE_CONT, pid, NULL, NULL);
+  if (do_wait(pid, PTRACE_CONT, "PTRACE_CONT", pending)) {
+    // The payload is abandoned wherever it faulted or got stuck, and the
+    // caller restores the registers. Give its memory back first, if the
+    // process is still there.
+    memmove(regs, oldregs, sizeof(*regs));
+    regs->rax = 11; // munmap
+    regs->rdi = (long)mmap_memory;
+    regs->rsi = maplen;
+    regs->rip = syms->syscall;
+    regs->orig_rax = -1;
+    if (do_ptrace(PTRACE_SETREGS, pid, NULL, regs) == 0) {
+      singlestep(pid, pending);
+    }
+    return -1;
+  }
+
+  if (do_ptrace(PTRACE_GETREGS, pid, NULL, regs)) {
+    perror("PTRACE_GETREGS");
+    return -1;
+  }
+  if (regs->rip != syms->trap + 1) {
+    fprintf(stderr, "unexpectedly stopped at %p\n", (void *)regs->rip);
+    return -1;
+  }
+  stats_phase(REMOTE_PHASE_CALL);
+  #ifdef DEBUG
+  fprintf(stderr, "munmap returned with status %llu\n", regs->rax);
+  #endif
+  if (regs->rax != 0) {
+    fprintf(stderr, "warning: failed to munmap: %s\n", strerror(-regs->rax));
+  }
+  return 0;
+}
+
+// Copy the NUL terminated string at addr in the remote process into a
+// result in the arena using PTRACE_PEEKDATA. This is the slow path for when
+// process_vm_readv is not available: it costs one syscall per word, but only
+// needs the process to be attached. Words are read aligned, so we never
+// touch the page after the one holding the NUL.
+static int read_string(pid_t pid, void *addr, struct remote_arena *arena,
+                       struct remote_value *out) {
+  uintptr_t where = (uintptr_t)addr & ~(sizeof(long) - 1);
+  size_t skip = (uintptr_t)addr - where;
+  size_t len = 0, cap = 0;
+  char *buf = NULL;
+  while (true) {
+    if (len + sizeof(long) + 1 > cap) {
+      size_t grown_cap = cap ? cap * 2 : 64;
+      buf = arena_grow(arena, buf, cap, grown_cap, false);
+      if (buf == NULL) {
+        return -1;
+      }
+      cap = grown_cap;
+    }
+    errno = 0;
+    long data = do_ptrace(PTRACE_PEEKDATA, pid, (void *)where, NULL);
+    if (data == -1 && errno) {
+      perror("PTRACE_PEEKDATA");
+      return -1;
+    }
+    where += sizeof(data);
+    size_t got = sizeof(data) - skip;
+    memmove(buf + len, (char *)&data + skip, got);
+    skip = 0;
+    char *nul = memchr(buf + len, '\0', got);
+    if (nul != NULL) {
+      out->value = buf;
+      out->len = nul - buf;
+      // give back what the last word read past the NUL
+      arena->used = nul + 1 - arena->base;
+      return 0;
+    }
+    len += got;
+  }
+}
+
+// Copy len bytes starting at addr using PTRACE_PEEKDATA, as a fallback for
+// read_remote(). Like read_string(), all words are read aligned.
+static ssize_t peek_data(pid_t pid, void *addr, void *buf, size_t len) {
+  uintptr_t where = (uintptr_t)addr & ~(sizeof(long) - 1);
+  size_t skip = (uintptr_t)addr - where;
+  size_t copied = 0;
+  while (copied < len) {
+    errno = 0;
+    long data = do_ptrace(PTRACE_PEEKDATA, pid, (void *)where, NULL);
+    if (data == -1 && errno) {
+      if (copied > 0) {
+        break;
+      }
+      perror("PTRACE_PEEKDATA");
+      return -1;
+    }
+    size_t got = sizeof(data) - skip;
+    if (got > len - copied) {
+      got = len - copied;
+    }
+    memmove(buf + copied, (char *)&data + skip, got);
+    copied += got;
+    where += sizeof(data);
+    skip = 0;
+  }
+  return copied;
+}
+
+// set once process_vm_readv turned out to be unusable, e.g. because a
+// seccomp policy forbids it, after which only PTRACE_PEEKDATA is used
+static bool no_vm_readv = false;
+
+// process_vm_readv failed with errno; decide whether to use the fallback
+static bool vm_readv_unavailable(void) {
+  if (errno == ENOSYS || errno == EPERM) {
+    no_vm_readv = true;
+  }
+  return no_vm_readv;
+}
+
+// how many bytes of each string read_strings() asks for in its first round
+#define STRING_CHUNK 256
+
+// copy len bytes at addr in the remote process into buf, returning the
+// number of bytes copied or -1 on error
+static ssize_t read_remote(pid_t pid, void *addr, void *buf, size_t len) {
+  if (no_vm_readv) {
+    return peek_data(pid, addr, buf, len);
+  }
+  struct iovec local = {.iov_base = buf, .iov_len = len};
+  struct iovec remote = {.iov_base = addr, .iov_len = len};
+  ssize_t ret = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+  if (ret < 0) {
+    if (vm_readv_unavailable()) {
+      return peek_data(pid, addr, buf, len);
+    }
+    perror("process_vm_readv");
+  }
+  return ret;
+}
+
+// read_strings() for when process_vm_readv is not available
+static int read_strings_slow(pid_t pid, void **addrs, size_t n,
+                             struct remote_arena *arena,
+                             struct remote_value *out) {
+  for (size_t i = 0; i < n; i++) {
+    if (read_string(pid, addrs[i], arena, &out[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Copy the n NUL terminated strings at addrs in the remote process into
+// results in the arena, stored in out. The strings are read in rounds with
+// a single process_vm_readv call for all strings that are not complete yet,
+// into scratch space, and each one is copied into a result of its exact
+// size once it is complete. No read crosses a page boundary, so a string at
+// the very end of a mapping never makes the whole batch fail. If
+// process_vm_readv cannot be used, this falls back to reading the strings
+// one by one with read_string().
+static int read_strings(pid_t pid, void **addrs, size_t n,
+                        struct remote_arena *arena,
+                        struct remote_value *out) {
+  if (no_vm_readv) {
+    return read_strings_slow(pid, addrs, n, arena, out);
+  }
+  size_t batch_max = n < IOV_MAX ? n : IOV_MAX;
+  struct iovec *local = arena_scratch(arena, batch_max * sizeof(struct iovec));
+  struct iovec *remote = arena_scratch(arena,
+                                       batch_max * sizeof(struct iovec));
+  char **bufs = arena_scratch(arena, n * sizeof(char *));
+  size_t *lens = arena_scratch(arena, n * sizeof(size_t));
+  size_t *caps = arena_scratch(arena, n * sizeof(size_t));
+  size_t *pending = arena_scratch(arena, n * sizeof(size_t));
+  if (local == NULL || remote == NULL || bufs == NULL || lens == NULL ||
+      caps == NULL || pending == NULL) {
+    return -1;
+  }
+
+  size_t npending = n;
+  for (size_t i = 0; i < n; i++) {
+    bufs[i] = NULL;
+    lens[i] = caps[i] = 0;
+    pending[i] = i;
+  }
+  while (npending > 0) {
+    size_t batch = npending < IOV_MAX ? npending : IOV_MAX;
+    for (size_t j = 0; j < batch; j++) {
+      size_t i = pending[j];
+      uintptr_t where = (uintptr_t)addrs[i] + lens[i];
+      size_t chunk = lens[i] < STRING_CHUNK ? STRING_CHUNK : lens[i];
+      size_t to_page_end = PAGE_SIZE - (where & (PAGE_SIZE - 1));
+      if (chunk > to_page_end) {
+        chunk = to_page_end;
+      }
+      bufs[i] = arena_grow(arena, bufs[i], caps[i], lens[i] + chunk + 1,
+                           true);
+      if (bufs[i] == NULL) {
+        return -1;
+      }
+      caps[i] = lens[i] + chunk + 1;
+      local[j].iov_base = bufs[i] + lens[i];
+      local[j].iov_len = chunk;
+      remote[j].iov_base = (void *)where;
+      remote[j].iov_len = chunk;
+    }
+
+    ssize_t copied = process_vm_readv(pid, local, batch, remote, batch, 0);
+    if (copied < 0) {
+      if (vm_readv_unavailable()) {
+        return read_strings_slow(pid, addrs, n, arena, out);
+      }
+      perror("process_vm_readv");
+      return -1;
+    }
+
+    // strings that are terminated are done, the others go into another round
+    size_t still_pending = 0;
+    for (size_t j = 0; j < batch; j++) {
+      size_t i = pending[j];
+      size_t got = (size_t)copied < local[j].iov_len ? (size_t)copied
+                                                      : local[j].iov_len;
+      copied -= got;
+      if (got == 0) {
+        fprintf(stderr, "cannot read string at %p\n", addrs[i]);
+        return -1;
+      }
+      char *nul = memchr(local[j].iov_base, '\0', got);
+      if (nul != NULL) {
+        lens[i] = nul - bufs[i];
+      } else {
+        lens[i] += got;
+        pending[still_pending++] = i;
+      }
+    }
+    memmove(pending + still_pending, pending + batch,
+            (npending - batch) * sizeof(size_t));
+    npending -= batch - still_pending;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    char *value = arena_alloc(arena, lens[i] + 1);
+    if (value == NULL) {
+      return -1;
+    }
+    memmove(value, bufs[i], lens[i] + 1);
+    out[i].value = value;
+    out[i].len = lens[i];
+  }
+  return 0;
+}
+
+// Copy the n strings at addrs in the remote process, of the lengths in lens
+// without their NUL, into results in the arena, stored in out. As the
+// lengths are known, every string is read straight into a result of its
+// exact size, with one process_vm_readv call for up to IOV_MAX of them, and
+// nothing is read past its end.
+static int read_strings_sized(pid_t pid, void **addrs, const size_t *lens,
+                              size_t n, struct remote_arena *arena,
+                              struct remote_value *out) {
+  size_t batch_max = n < IOV_MAX ? n : IOV_MAX;
+  struct iovec *local = arena_scratch(arena, batch_max * sizeof(struct iovec));
+  struct iovec *remote = arena_scratch(arena,
+                                       batch_max * sizeof(struct iovec));
+  if (local == NULL || remote == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n;) {
+    size_t batch = n - i < batch_max ? n - i : batch_max, want = 0;
+    for (size_t j = 0; j < batch; j++) {
+      size_t len = lens[i + j];
+      char *value = arena_alloc(arena, len + 1);
+      if (value == NULL) {
+        return -1;
+      }
+      value[len] = '\0';
+      out[i + j].value = value;
+      out[i + j].len = len;
+      local[j].iov_base = value;
+      local[j].iov_len = len;
+      remote[j].iov_base = addrs[i + j];
+      remote[j].iov_len = len;
+      want += len;
+    }
+
+    ssize_t copied = -1;
+    if (!no_vm_readv) {
+      copied = process_vm_readv(pid, local, batch, remote, batch, 0);
+      if (copied < 0 && !vm_readv_unavailable()) {
+        perror("process_vm_readv");
+        return -1;
+      }
+    }
+    if (copied < 0) {
+      copied = 0;
+      for (size_t j = 0; j < batch; j++) {
+        ssize_t got = peek_data(pid, remote[j].iov_base, local[j].iov_base,
+                                local[j].iov_len);
+        if (got < 0) {
+          return -1;
+        }
+        copied += got;
+      }
+    }
+    if ((size_t)copied != want) {
+      fprintf(stderr, "cannot read the strings at %p\n", addrs[i]);
+      return -1;
+    }
+    i += batch;
+  }
+  return 0;
+}
+
+// Detach from the process, delivering the signal pending if it is not 0,
+// and stop the deadline.
+static int detach_process(pid_t pid, int pending) {
+  deadline_stop();
+  if (do_ptrace(PTRACE_DETACH, pid, NULL, (void *)(long)pending)) {
+    perror("PTRACE_DETACH");
+    return -1;
+  }
+  return 0;
+}
+
+// Whether a thread sleeping in syscall nr can be stopped and resumed without
+// the program noticing: these are restarted by the kernel (or return a
+// result the caller retries anyway) when the thread is interrupted for a
+// ptrace stop. Others, like epoll_wait(2) or sigtimedwait(2), fail with
+// EINTR after any stop, which the program would see.
+static bool restartable_syscall(long nr) {
+  switch (nr) {
+  case SYS_futex:
+  case SYS_nanosleep:
+  case SYS_clock_nanosleep:
+  case SYS_poll:
+  case SYS_ppoll:
+  case SYS_select:
+  case SYS_pselect6:
+  case SYS_pause:
+  case SYS_rt_sigsuspend:
+  case SYS_wait4:
+  case SYS_waitid:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Whether thread tid of pid is idle: sleeping in a restartable syscall, and
+// not the agent thread, which runs without a libc thread of its own.
+static bool idle_thread(pid_t pid, const char *tid) {
+  char filename[64], buf[128];
+  snprintf(filename, sizeof(filename), "/proc/%d/task/%s/syscall", pid, tid);
+  // "running", or the syscall number followed by its arguments
+  if (read_file(filename, buf, sizeof(buf)) <= 0 || !isdigit(buf[0]) ||
+      !restartable_syscall(strtol(buf, NULL, 10))) {
+    return false;
+  }
+  snprintf(filename, sizeof(filename), "/proc/%d/task/%s/comm", pid, tid);
+  return read_file(filename, buf, sizeof(buf)) < 0 ||
+         strcmp(buf, AGENT_NAME "\n") != 0;
+}
+
+// Pick the thread of pid that we stop and inject into. The thread group
+// leader is often the busy event loop of a server, while its workers sleep,
+// so we prefer a thread that sleeps in a restartable syscall, starting with
+// pid itself, and only fall back to pid if there is none. If pid is not a
+// thread group leader, the user picked that thread, and it is used as is.
+static pid_t pick_thread(pid_t pid) {
+  char filename[64], buf[4096];
+  snprintf(filename, sizeof(filename), "/proc/%d/status", pid);
+  if (read_file(filename, buf, sizeof(buf)) < 0) {
+    return pid;
+  }
+  char *line = strstr(buf, "\nTgid:");
+  long tgid = line != NULL ? strtol(line + 6, NULL, 10) : pid;
+  snprintf(buf, sizeof(buf), "%d", pid);
+  if (tgid != pid || idle_thread(pid, buf)) {
+    return pid;
+  }
+
+  snprintf(filename, sizeof(filename), "/proc/%d/task", pid);
+  struct dir_reader dir;
+  if (dir_open(&dir, filename)) {
+    return pid;
+  }
+  pid_t tid = pid;
+  const char *entry;
+  while ((entry = dir_next(&dir)) != NULL) {
+    if (isdigit(entry[0]) && idle_thread(pid, entry)) {
+      tid = strtol(entry, NULL, 10);
+      break;
+    }
+  }
+  dir_close(&dir);
+  #ifdef DEBUG
+  fprintf(stderr, "injecting into thread %d\n", tid);
+  #endif
+  return tid;
+}
+
+// Wait for a seized thread to stop after PTRACE_INTERRUPT, letting the
+// signals that it gets before that through. Returns 1 if it exited.
+static int wait_interrupted(pid_t pid) {
+  while (true) {
+    int status;
+    if (do_waitpid(pid, &status, __WALL) == -1) {
+      if (errno == EINTR && !deadline_expired) {
+        continue;
+      }
+      if (errno == EINTR) {
+        fprintf(stderr, "process %d did not stop within %ld ms\n", pid,
+                timeout_ms);
+      } else {
+        perror("wait");
+      }
+      return -1;
+    }
+    if (!WIFSTOPPED(status)) {
+      return 1;
+    }
+    if (status >> 16 == PTRACE_EVENT_STOP) {
+      return 0;
+    }
+    if (do_ptrace(PTRACE_CONT, pid, NULL, (void *)(long)WSTOPSIG(status))) {
+      perror("PTRACE_CONT");
+      return -1;
+    }
+  }
+}
+
+// Attach to the process, and wait for it to actually stop. This uses
+// PTRACE_SEIZE and PTRACE_INTERRUPT rather than PTRACE_ATTACH, which would
+// send a real SIGSTOP that goes through signal delivery, is visible to job
+// control, and stays pending if we die before the process stops. Signals
+// that arrive before the process stops for us are delivered as usual.
+//
+// This also starts the deadline for --timeout. If the process does not even
+// stop in time, we give up on it; it stays seized until the thread of the
+// query exits, see run_query(), and then carries on.
+static int attach_process(pid_t pid) {
+  stats_start();
+  stats_attached = stats_last;
+  deadline_start();
+  if (do_ptrace(PTRACE_SEIZE, pid, NULL, NULL)) {
+    perror("PTRACE_SEIZE");
+    check_yama();
+    deadline_stop();
+    return -1;
+  }
+  if (do_ptrace(PTRACE_INTERRUPT, pid, NULL, NULL)) {
+    perror("PTRACE_INTERRUPT");
+    detach_process(pid, 0);
+    return -1;
+  }
+  int ret = wait_interrupted(pid);
+  if (ret == 1) {
+    fprintf(stderr, "process %d exited while attaching\n", pid);
+  }
+  if (ret) {
+    deadline_stop();
+    return -1;
+  }
+  stats_phase(REMOTE_PHASE_ATTACH);
+  return 0;
+}
+
+// Freeze every thread of pid: seize them all, and wait until each one has
+// stopped, so that none of them can change the environment while we look
+// at it. The threads that are started until then are picked up by reading
+// the task directory again, until a pass finds no new ones. The tids of
+// the frozen threads are stored in scratch space at *tids.
+static int freeze_threads(pid_t pid, struct remote_arena *arena,
+                          pid_t **tids, size_t *n) {
+  stats_start();
+  stats_attached = stats_last;
+  deadline_start();
+  char dirname[32];
+  snprintf(dirname, sizeof(dirname), "/proc/%d/task", pid);
+  size_t cap = 0, frozen = 0;
+  *tids = NULL;
+  *n = 0;
+  bool added;
+  do {
+    added = false;
+    struct dir_reader dir;
+    if (dir_open(&dir, dirname)) {
+      perror(dirname);
+      goto fail;
+    }
+    const char *entry;
+    while ((entry = dir_next(&dir)) != NULL) {
+      if (!isdigit(entry[0])) {
+        continue;
+      }
+      pid_t tid = strtol(entry, NULL, 10);
+      size_t i = 0;
+      while (i < *n && (*tids)[i] != tid) {
+        i++;
+      }
+      if (i < *n) {
+        continue;
+      }
+      // make room first, a thread that is seized cannot be let go again
+      // before it stops
+      if (*n == cap) {
+        size_t grown_cap = cap ? cap * 2 : 64;
+        pid_t *grown = arena_grow(arena, *tids, cap * sizeof(pid_t),
+                                  grown_cap * sizeof(pid_t), true);
+        if (grown == NULL) {
+          dir_close(&dir);
+          goto fail;
+        }
+        *tids = grown;
+        cap = grown_cap;
+      }
+      if (do_ptrace(PTRACE_SEIZE, tid, NULL, NULL)) {
+        if (errno == ESRCH) {
+          continue; // it exited in the meantime
+        }
+        perror("PTRACE_SEIZE");
+        check_yama();
+        dir_close(&dir);
+        goto fail;
+      }
+      (*tids)[(*n)++] = tid;
+      added = true;
+      if (do_ptrace(PTRACE_INTERRUPT, tid, NULL, NULL)) {
+        perror("PTRACE_INTERRUPT");
+        dir_close(&dir);
+        goto fail;
+      }
+    }
+    dir_close(&dir);
+
+    // the ones that were interrupted in this pass
+    while (frozen < *n) {
+      int ret = wait_interrupted((*tids)[frozen]);
+      if (ret < 0) {
+        goto fail;
+      }
+      if (ret == 1) {
+        (*tids)[frozen] = (*tids)[--(*n)];
+      } else {
+        frozen++;
+      }
+    }
+  } while (added);
+  if (*n == 0) {
+    fprintf(stderr, "process %d exited while attaching\n", pid);
+    goto fail;
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "froze %zu threads\n", *n);
+  #endif
+  stats_phase(REMOTE_PHASE_ATTACH);
+  return 0;
+
+fail:
+  // Those that were interrupted but not waited for yet have to stop before
+  // they can be let go. At the deadline, they stay seized until the thread
+  // of the query exits instead, see run_query().
+  for (size_t i = 0; i < *n; i++) {
+    if (i < frozen ||
+        (!deadline_expired && wait_interrupted((*tids)[i]) == 0)) {
+      do_ptrace(PTRACE_DETACH, (*tids)[i], NULL, NULL);
+    }
+  }
+  deadline_stop();
+  return -1;
+}
+
+// let all of the n threads at tids go again
+static int thaw_threads(const pid_t *tids, size_t n) {
+  int ret = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (do_ptrace(PTRACE_DETACH, tids[i], NULL, NULL)) {
+      perror("PTRACE_DETACH");
+      ret = -1;
+    }
+  }
+  deadline_stop();
+  stats_phase(REMOTE_PHASE_DETACH);
+  return ret;
+}
+
+// Read the environ pointer array of the remote process, through the GOT
+// slot of __environ at slot, into scratch space at *array of *len entries,
+// not counting the NULL. The address of the array is stored in *base. We
+// cannot simply use the address of libc's __environ: if the main executable
+// references environ, the linker gives it a copy relocation and libc's own
+// __environ is never used again. Going through the GOT finds the live
+// variable either way.
+static int read_environ_array(pid_t pid, void *slot,
+                              struct remote_arena *arena, void **base,
+                              void ***array, size_t *len) {
+  void *their_environ_var, *their_environ;
+  if (read_remote(pid, slot, &their_environ_var,
+                  sizeof(their_environ_var)) != sizeof(their_environ_var) ||
+      read_remote(pid, their_environ_var, &their_environ,
+                  sizeof(their_environ)) != sizeof(their_environ)) {
+    fprintf(stderr, "cannot read __environ\n");
+    return -1;
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "their environ        %p\n", their_environ);
+  #endif
+
+  // read the pointer array in growing chunks until we find the NULL
+  *base = their_environ;
+  *array = NULL;
+  *len = 0;
+  size_t cap = 0;
+  while (their_environ != NULL) {
+    if (*len == cap) {
+      size_t grown_cap = cap ? cap * 2 : 64;
+      *array = arena_grow(arena, *array, cap * sizeof(void *),
+                          grown_cap * sizeof(void *), true);
+      if (*array == NULL) {
+        return -1;
+      }
+      cap = grown_cap;
+    }
+    ssize_t got = read_remote(pid, their_environ + *len * sizeof(void *),
+                              *array + *len, (cap - *len) * sizeof(void *));
+    if (got < (ssize_t)sizeof(void *)) {
+      fprintf(stderr, "cannot read environ array\n");
+      return -1;
+    }
+    size_t end = *len + got / sizeof(void *);
+    for (; *len < end && (*array)[*len] != NULL; (*len)++)
+      ;
+    if (*len < end) {
+      break;
+    }
+  }
+  return 0;
+}
+
+// Read the whole live environment of the remote process into an array of
+// count "VAR=value" strings, all allocated from the arena. Instead of
+// injecting code, this finds the remote __environ through the GOT slot that
+// the remote libc uses for it, and copies the pointer array and all the
+// strings with bulk reads while the process is stopped.
+static int dump_process(pid_t pid, struct remote_arena *arena,
+                        struct remote_value **vars, size_t *count) {
+  struct libc_symbols syms;
+  if (resolve_libc(pid, &syms)) {
+    return -1;
+  }
+
+  pid_t tid = pick_thread(pid);
+  if (attach_process(tid)) {
+    return -1;
+  }
+
+  int ret = -1;
+  void *base;
+  void **array = NULL;
+  size_t len;
+  #ifdef DEBUG
+  fprintf(stderr, "their __environ slot %p\n", (void *)syms.environ);
+  #endif
+  if (read_environ_array(tid, (void *)syms.environ, arena, &base, &array,
+                         &len)) {
+    goto out;
+  }
+
+  *vars = arena_alloc(arena, len * sizeof(struct remote_value));
+  if (*vars == NULL || read_strings(tid, array, len, arena, *vars)) {
+    goto out;
+  }
+  *count = len;
+  ret = 0;
+
+out:
+  stats_phase(REMOTE_PHASE_READBACK);
+  if (detach_process(tid, 0)) {
+    ret = -1;
+  }
+  stats_phase(REMOTE_PHASE_DETACH);
+  return ret;
+}
+
+// One try of consistent_environ(). Only the pointer array is read while
+// all the threads are frozen, and the strings are copied after they are
+// let go. That is safe as far as glibc goes, which never frees or changes
+// a string of its own: unsetenv only drops the pointer, and a value that
+// setenv replaced stays around. A putenv string belongs to the program,
+// which may rewrite it in the meantime, and then we copy what it holds by
+// then. If a string cannot be read afterwards (say a putenv one that the
+// program freed), this returns 1, and the strings are read before letting
+// go on the next try; they are too if there is no process_vm_readv.
+static int snapshot_process(pid_t pid, const struct libc_symbols *syms,
+                            bool frozen_strings, struct remote_arena *arena,
+                            struct remote_value **vars, size_t *count) {
+  size_t used = arena->used, scratch = arena->scratch;
+  pid_t *tids;
+  size_t ntids;
+  if (freeze_threads(pid, arena, &tids, &ntids)) {
+    return -1;
+  }
+  int ret = -1;
+  void *base;
+  void **array;
+  size_t len;
+  if (read_environ_array(tids[0], (void *)syms->environ, arena, &base,
+                         &array, &len)) {
+    thaw_threads(tids, ntids);
+    return -1;
+  }
+  *vars = arena_alloc(arena, len * sizeof(struct remote_value));
+  if (*vars == NULL) {
+    thaw_threads(tids, ntids);
+    return -1;
+  }
+  if (frozen_strings || no_vm_readv) {
+    ret = read_strings(tids[0], array, len, arena, *vars);
+    stats_phase(REMOTE_PHASE_READBACK);
+    if (thaw_threads(tids, ntids)) {
+      ret = -1;
+    }
+  } else {
+    stats_phase(REMOTE_PHASE_READBACK);
+    if (thaw_threads(tids, ntids)) {
+      return -1;
+    }
+    ret = read_strings(pid, array, len, arena, *vars);
+    stats_phase(REMOTE_PHASE_READBACK);
+    if (ret && !arena_full) {
+      arena->used = used;
+      arena->scratch = scratch;
+      return 1;
+    }
+  }
+  *count = len;
+  return ret;
+}
+
+// Read the whole environment like dump_process(), but with every thread of
+// the process frozen, not just one, so that no other thread can change it
+// halfway. They are kept frozen only for as long as it takes to copy the
+// pointer array.
+static int consistent_environ(pid_t pid, struct remote_arena *arena,
+                              struct remote_value **vars, size_t *count) {
+  struct libc_symbols syms;
+  if (resolve_libc(pid, &syms)) {
+    return -1;
+  }
+  int ret = snapshot_process(pid, &syms, false, arena, vars, count);
+  if (ret == 1) {
+    #ifdef DEBUG
+    fprintf(stderr, "strings went away after the snapshot, retrying\n");
+    #endif
+    ret = snapshot_process(pid, &syms, true, arena, vars, count);
+  }
+  return ret;
+}
+
+// how many times peek_environ() tries to get a consistent copy
+#define PEEK_TRIES 4
+
+// Read the whole environment like dump_process(), but without attaching, so
+// the process keeps running. To notice a concurrent change, the array is
+// read again after the strings, like a seqlock: if __environ or any of the
+// pointers moved in the meantime, the copy is thrown away and we try again.
+// glibc never changes a string of its own in place, but a putenv string
+// can be rewritten by the program, so with unchanged pointers the strings
+// are read a second time as well, and have to match the first copy.
+// Returns 1 if no consistent copy could be made, or if
+// process_vm_readv cannot be used, as PTRACE_PEEKDATA needs a stop.
+static int peek_environ(pid_t pid, struct remote_arena *arena,
+                        struct remote_value **vars, size_t *count) {
+  struct libc_symbols syms;
+  if (resolve_libc(pid, &syms)) {
+    return -1;
+  }
+  void *slot = (void *)syms.environ, *probe;
+  struct iovec local = {.iov_base = &probe, .iov_len = sizeof(probe)};
+  struct iovec remote = {.iov_base = slot, .iov_len = sizeof(probe)};
+  if (no_vm_readv ||
+      process_vm_readv(pid, &local, 1, &remote, 1, 0) != sizeof(probe)) {
+    #ifdef DEBUG
+    perror("process_vm_readv");
+    #endif
+    return 1;
+  }
+
+  stats_start();
+  size_t used = arena->used, scratch = arena->scratch;
+  for (int try = 0; try < PEEK_TRIES; try++) {
+    void *base, *again_base;
+    void **array, **again;
+    size_t len, again_len;
+    if (read_environ_array(pid, slot, arena, &base, &array, &len)) {
+      return -1;
+    }
+    *vars = arena_alloc(arena, len * sizeof(struct remote_value));
+    if (*vars == NULL) {
+      return -1;
+    }
+    // a string can be freed and unmapped under us by unsetenv, which then
+    // shows up as a changed array below
+    bool read = read_strings(pid, array, len, arena, *vars) == 0;
+    if (!read && arena_full) {
+      return -1;
+    }
+    if (read_environ_array(pid, slot, arena, &again_base, &again,
+                           &again_len)) {
+      again = NULL;
+    }
+    bool same = read && again != NULL && base == again_base &&
+                len == again_len &&
+                memcmp(array, again, len * sizeof(void *)) == 0;
+    if (same) {
+      size_t copied = arena->used;
+      struct remote_value *check =
+          arena_alloc(arena, len * sizeof(struct remote_value));
+      if (check == NULL) {
+        return -1;
+      }
+      if (read_strings(pid, array, len, arena, check)) {
+        if (arena_full) {
+          return -1;
+        }
+        same = false;
+      }
+      for (size_t i = 0; same && i < len; i++) {
+        same = check[i].len == (*vars)[i].len &&
+               memcmp(check[i].value, (*vars)[i].value, check[i].len) == 0;
+      }
+      arena->used = copied;
+    }
+    if (same) {
+      *count = len;
+      stats_phase(REMOTE_PHASE_READBACK);
+      return 0;
+    }
+    arena->used = used;
+    arena->scratch = scratch;
+    #ifdef DEBUG
+    fprintf(stderr, "environment changed while reading it, retrying\n");
+    #endif
+    sched_yield();
+  }
+  return 1;
+}
+
+// FNV-1a over len bytes, continuing from hash
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+// The offset of the first '=' or NUL in the len bytes at s, or len if
+// there is none: the length of the name of a "VAR=value" string. This is
+// what splits the environments that we copied, so it looks at 16 bytes at
+// a time with SSE2, or 32 with AVX2 where the CPU has it.
+static size_t split_scalar(const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && s[i] != '=' && s[i] != '\0') {
+    i++;
+  }
+  return i;
+}
+
+#ifdef __SSE2__
+static size_t split_sse2(const char *s, size_t len) {
+  const __m128i eq = _mm_set1_epi8('='), nul = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, eq),
+                                              _mm_cmpeq_epi8(chunk, nul)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + split_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t split_avx2(const char *s, size_t len) {
+  const __m256i eq = _mm256_set1_epi8('='), nul = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, eq),
+                        _mm256_cmpeq_epi8(chunk, nul)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + split_sse2(s + i, len - i);
+}
+#endif
+
+static size_t split_var(const char *s, size_t len) {
+#ifdef __SSE2__
+  // picked by the first caller; threads that race to it pick the same one.
+  // The CPU model is filled in by a constructor of libgcc, long before.
+  static size_t (*split_fn)(const char *, size_t);
+  size_t (*split)(const char *, size_t) =
+      __atomic_load_n(&split_fn, __ATOMIC_RELAXED);
+  if (split == NULL) {
+    split = __builtin_cpu_supports("avx2") ? split_avx2 : split_sse2;
+    __atomic_store_n(&split_fn, split, __ATOMIC_RELAXED);
+  }
+  return split(s, len);
+#else
+  return split_scalar(s, len);
+#endif
+}
+
+// The names of a query in an open addressing hash table, so that a whole
+// environment can be matched against them in one pass.
+struct name_table {
+  const char *const *names;
+  size_t *slots; // the index of a name plus one, or 0 for an empty slot
+  size_t mask;
+};
+
+// Look up the len bytes at name, returning the index of the first of the
+// names equal to it plus one, or 0 if there is none.
+static size_t name_table_find(const struct name_table *table,
+                              const char *name, size_t len) {
+  uint64_t hash = hash_bytes(0xcbf29ce484222325, name, len);
+  for (size_t at = hash & table->mask;; at = (at + 1) & table->mask) {
+    size_t slot = table->slots[at];
+    if (slot == 0) {
+      return 0;
+    }
+    const char *want = table->names[slot - 1];
+    if (strncmp(want, name, len) == 0 && want[len] == '\0') {
+      return slot;
+    }
+  }
+}
+
+// Build the table of the n names in scratch space of the arena. For every
+// name, first gets the index of the first name equal to it, which is the
+// one in the table.
+static int name_table_init(struct name_table *table,
+                           const char *const *names, size_t n,
+                           struct remote_arena *arena, size_t *first) {
+  size_t size = 16;
+  while (size < 2 * n) {
+    size *= 2;
+  }
+  table->names = names;
+  table->mask = size - 1;
+  table->slots = arena_scratch(arena, size * sizeof(size_t));
+  if (table->slots == NULL) {
+    return -1;
+  }
+  memset(table->slots, 0, size * sizeof(size_t));
+  for (size_t i = 0; i < n; i++) {
+    size_t len = strlen(names[i]);
+    size_t found = name_table_find(table, names[i], len);
+    if (found != 0) {
+      first[i] = found - 1;
+      continue;
+    }
+    uint64_t hash = hash_bytes(0xcbf29ce484222325, names[i], len);
+    size_t at = hash & table->mask;
+    while (table->slots[at] != 0) {
+      at = (at + 1) & table->mask;
+    }
+    table->slots[at] = i + 1;
+    first[i] = i;
+  }
+  return 0;
+}
+
+// Look up the n names in the count "VAR=value" strings of a copied
+// environment; like getenv(3), the first definition of a variable wins. The
+// values point into the strings, which are matched against the names in
+// one pass.
+static int match_names(const struct remote_value *vars, size_t count,
+                       const char *const *names, size_t n,
+                       struct remote_arena *arena,
+                       struct remote_value *results) {
+  struct name_table table;
+  size_t *first = arena_scratch(arena, n * sizeof(size_t));
+  if (first == NULL || name_table_init(&table, names, n, arena, first)) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    results[i] = (struct remote_value){0};
+  }
+  for (size_t j = 0; j < count; j++) {
+    size_t len = split_var(vars[j].value, vars[j].len);
+    size_t found = len < vars[j].len
+                       ? name_table_find(&table, vars[j].value, len) : 0;
+    if (found != 0 && results[found - 1].value == NULL) {
+      results[found - 1].value = vars[j].value + len + 1;
+      results[found - 1].len = vars[j].len - len - 1;
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    results[i] = results[first[i]];
+  }
+  return 0;
+}
+
+// getenv_process() on top of peek_environ(), with the same return values
+static int peek_getenv(pid_t pid, const char *const *names, size_t n,
+                       struct remote_arena *arena,
+                       struct remote_value *results) {
+  struct remote_value *vars;
+  size_t count;
+  int ret = peek_environ(pid, arena, &vars, &count);
+  if (ret) {
+    return ret;
+  }
+  return match_names(vars, count, names, n, arena, results);
+}
+
+// getenv_process() on top of consistent_environ()
+static int consistent_getenv(pid_t pid, const char *const *names, size_t n,
+                             struct remote_arena *arena,
+                             struct remote_value *results) {
+  struct remote_value *vars;
+  size_t count;
+  if (consistent_environ(pid, arena, &vars, &count)) {
+    return -1;
+  }
+  return match_names(vars, count, names, n, arena, results);
+}
+
+// What to inject into every process of a batch: the updates in order, and
+// then a getenv call for each of the n names, or for the name of each
+// update if names is NULL.
+struct batch_calls {
+  const struct remote_update *updates;
+  size_t nupdates;
+  const char *const *names;
+  size_t n;
+};
+
+static const char *batch_name(const struct batch_calls *calls, size_t i) {
+  return calls->names != NULL ? calls->names[i] : calls->updates[i].name;
+}
+
+// Queries of at most this many calls, with at most this much data, take the
+// fast path of tracee_fast().
+#define FAST_CALLS_MAX 2
+#define FAST_DATA_MAX 512
+
+// Results of up to this many bytes are stored on the stack of the process,
+// below the red zone, and larger ones in the mapping of the payload.
+#define STACK_RESULTS_MAX 4096
+
+// When the results are in the mapping, it has this many bytes for every
+// variable to copy the values to, see emit_store_string().
+#define COPY_PER_NAME 128
+
+// The states of a process in a batch. It goes through the same steps as in
+// run_payload(), but every wait is an event of the loop in run_batch() that
+// moves it on to the next state, so many processes can be in flight at once.
+enum tracee_state {
+  TRACEE_ATTACH, // seized and interrupted, until it stops
+  TRACEE_MMAP,   // singlestepping the mmap(2) for the payload
+  TRACEE_CALL,   // running the payload, until it stops on the trap gadget
+                 // or, with its results in the mapping, on its own int3
+  TRACEE_RELEASE, // running its epilogue after the readback, until it stops
+                  // on the trap gadget
+  TRACEE_FAST,   // running one call of the fast path, see tracee_fast()
+  TRACEE_HALT,   // interrupted at the deadline, until it stops
+  TRACEE_UNMAP,  // singlestepping the munmap(2) of an abandoned payload
+  TRACEE_DONE,
+};
+
+struct tracee {
+  struct remote_batch *query;
+  pid_t tid;
+  enum tracee_state state;
+  struct libc_symbols syms;
+  struct user_regs_struct oldregs, regs;
+  bool injected;      // whether the registers need to be restored
+  bool masked;        // whether the signal mask needs to be, to sigmask
+  uint64_t sigmask;
+  int mem_fd;
+  int pending;        // a signal to deliver when we detach
+  uintptr_t sp;       // the stack of the payload, and where its results are
+  uint8_t *text;      // the payload, in scratch space of the arena
+  size_t len;
+  size_t maplen;      // the size of its mapping
+  size_t results;     // the offset of its results in it, or 0 for sp
+  size_t copy_len;    // and the room for the values copied after them
+  size_t pause;       // and of the int3 it stops on then, plus one
+  int ret;            // the result of the readback, until the release
+  void *mapping;      // where it was mapped, once mmap(2) returned
+  uint64_t deadline;  // in now_ns(), or 0 for none
+  bool abandoned;     // done, but still seized, as it did not stop in time
+  bool reported;      // whether run_batch() passed it to done
+  uint64_t last;      // for the stats, like stats_last
+  uint64_t attached;
+  bool full;          // whether it failed because the arena is full
+  size_t used;        // of the arena, before the query
+  size_t scratch;     // and its scratch space, with this struct in it
+  // the fast path: the call being made, the remote addresses of the
+  // arguments of each call, and the results by slot
+  bool fast;
+  size_t call;
+  uintptr_t fast_args[FAST_CALLS_MAX][2];
+  void *fast_results[FAST_CALLS_MAX];
+};
+
+static void tracee_phase(struct tracee *t, enum remote_phase phase) {
+  PROBE2(phase, t->tid, phase);
+  struct remote_stats *s = t->query->stats;
+  if (s != NULL) {
+    uint64_t now = now_ns();
+    s->ns[phase] += now - t->last;
+    t->last = now;
+    if (phase == REMOTE_PHASE_DETACH) {
+      s->pause += now - t->attached;
+    }
+  }
+}
+
+// Finish with a process, with ret as the result of its query: restore its
+// registers if we changed them, and detach if it is stopped for us.
+static void tracee_finish(struct tracee *t, int ret, bool stopped) {
+  if (stopped && t->injected) {
+    #ifdef DEBUG
+    fprintf(stderr, "restoring old registers of %d\n", t->tid);
+    #endif
+    if (do_ptrace(PTRACE_SETREGS, t->tid, NULL, &t->oldregs)) {
+      perror("PTRACE_SETREGS");
+      ret = 1;
+    } else {
+      set_exitkill(t->tid, false);
+    }
+    tracee_phase(t, REMOTE_PHASE_RESTORE);
+  }
+  if (stopped && t->masked && unblock_signals(t->tid, t->sigmask)) {
+    ret = 1;
+  }
+  if (t->mem_fd >= 0) {
+    close(t->mem_fd);
+    t->mem_fd = -1;
+  }
+  if (stopped) {
+    if (do_ptrace(PTRACE_DETACH, t->tid, NULL, (void *)(long)t->pending)) {
+      perror("PTRACE_DETACH");
+      ret = 1;
+    }
+    tracee_phase(t, REMOTE_PHASE_DETACH);
+  }
+  t->full = ret != 0 && arena_full;
+  t->query->ret = ret;
+  t->state = TRACEE_DONE;
+  PROBE2(query_end, t->tid, ret);
+}
+
+// Find the libc of the process and attach to it. The process is not
+// waited for: its stop is the first event for it in run_batch().
+static void tracee_start(struct tracee *t, const struct remote_batch *q) {
+  t->mem_fd = -1;
+  if (resolve_libc(q->pid, &t->syms)) {
+    tracee_finish(t, -1, false);
+    return;
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "their getenv         %p\n", (void *)t->syms.getenv);
+  fprintf(stderr, "their setenv         %p\n", (void *)t->syms.setenv);
+  fprintf(stderr, "their unsetenv       %p\n", (void *)t->syms.unsetenv);
+  fprintf(stderr, "their syscall        %p\n", (void *)t->syms.syscall);
+  fprintf(stderr, "their trap           %p\n", (void *)t->syms.trap);
+  #endif
+  t->tid = pick_thread(q->pid);
+  PROBE2(query_begin, q->pid, t->tid);
+  t->last = t->attached = q->stats != NULL ? now_ns() : 0;
+  if (do_ptrace(PTRACE_SEIZE, t->tid, NULL, NULL)) {
+    perror("PTRACE_SEIZE");
+    check_yama();
+    tracee_finish(t, -1, false);
+    return;
+  }
+  if (do_ptrace(PTRACE_INTERRUPT, t->tid, NULL, NULL)) {
+    perror("PTRACE_INTERRUPT");
+    do_ptrace(PTRACE_DETACH, t->tid, NULL, NULL);
+    tracee_finish(t, -1, false);
+    return;
+  }
+  t->deadline = timeout_ms ? now_ns() + timeout_ms * 1000000 : 0;
+  t->state = TRACEE_ATTACH;
+}
+
+// Build the payload for the process, now that it is stopped. It makes
+// calls like:
+//
+//   setenv("VAR", "value", 1);
+//   unsetenv("VAR");
+//   getenv("VAR");
+//
+// for every update and every variable that was asked for, and we want the
+// process to stop only once more, when all of them are done. To do this
+// we're going to do the following:
+//
+//   * put code into the mmap area that aligns the stack, makes the calls
+//     and stores their results below the red zone of the remote stack
+//   * have that code unmap the mmap area by returning through the SYSCALL
+//     in libc into an int3 in libc
+//   * use the TRAP to read the results and restore the original program
+//     state
+//
+// The results are a slot for the pointer that each call returns, followed
+// by the length of each string that getenv returned. If they do not fit on
+// the stack, they go into the bss of the payload instead, along with a copy
+// of as many of the values as fit into the room after them. The payload
+// then stops once more before its epilogue, so that all of it can be read
+// with one read while it is still mapped.
+static int tracee_payload(struct tracee *t, const struct batch_calls *calls) {
+  static const uint8_t align_rsp[] = {0x48, 0x83, 0xe4, 0xf0}; // and $-16, %rsp
+  static const uint8_t int3[] = {0xcc};
+  size_t nslots = calls->n + calls->nupdates;
+  size_t results_len = (nslots + calls->n) * sizeof(void *);
+  bool on_stack = results_len <= STACK_RESULTS_MAX;
+  t->sp = (t->oldregs.rsp - 128 - (on_stack ? results_len : 0)) &
+          ~(uintptr_t)15;
+  struct payload payload = {.arena = t->query->arena};
+  emit_prologue(&payload);
+  // %r15 points to the results, and %r14 and %r13 to the room for the
+  // copies, which are all preserved by the calls
+  size_t results = 0, copy = 0;
+  if (on_stack) {
+    emit_mov_imm(&payload, R15, t->sp);
+  } else {
+    results = payload_bss(&payload, results_len);
+    t->copy_len = calls->n * COPY_PER_NAME;
+    copy = payload_bss(&payload, t->copy_len);
+    emit_lea_bss(&payload, R15, results);
+    emit_lea_bss(&payload, R14, copy);
+    emit_lea_bss(&payload, R13, copy + t->copy_len);
+  }
+  emit(&payload, align_rsp, sizeof(align_rsp));
+  // the results of the updates go after those of the getenv calls
+  for (size_t i = 0; i < calls->nupdates; i++) {
+    const struct remote_update *u = &calls->updates[i];
+    size_t name = payload_data(&payload, u->name, strlen(u->name) + 1);
+    emit_lea_data(&payload, RDI, name);
+    if (u->value != NULL) {
+      size_t value = payload_data(&payload, u->value, strlen(u->value) + 1);
+      emit_lea_data(&payload, RSI, value);
+      emit_mov_imm(&payload, RDX, 1);
+      emit_call(&payload, t->syms.setenv);
+    } else {
+      emit_call(&payload, t->syms.unsetenv);
+    }
+    emit_store(&payload, R15, (calls->n + i) * sizeof(void *), RAX);
+  }
+  for (size_t i = 0; i < calls->n; i++) {
+    const char *s = batch_name(calls, i);
+    size_t name = payload_data(&payload, s, strlen(s) + 1);
+    emit_lea_data(&payload, RDI, name);
+    emit_call(&payload, t->syms.getenv);
+    emit_store_string(&payload, R15, i, nslots + i, !on_stack);
+  }
+  if (!on_stack) {
+    emit(&payload, int3, sizeof(int3));
+    t->pause = payload.code_len;
+  }
+  emit_epilogue(&payload, &t->syms);
+  size_t bss = payload.bss;
+  t->text = payload_finish(&payload, &t->len);
+  if (t->text == NULL) {
+    return -1;
+  }
+  t->maplen = payload_maplen(t->len + bss);
+  if (!on_stack) {
+    t->results = t->len + results;
+  }
+  return 0;
+}
+
+// Set up the fast path for a small query, which needs no payload, and so
+// no mmap(2) and munmap(2) with their singlesteps: the strings go below the
+// red zone of the stack, which is mapped and writable already, and below
+// them the address of the trap gadget in libc, as the return address. Each
+// call is then made by pointing %rip at the function, with the arguments in
+// registers, and it returns straight into the trap. The stack is not
+// executable, so that is all the code we need. Returns 1 if the query is
+// too large for this, or the stack cannot be written.
+static int tracee_fast(struct tracee *t, const struct batch_calls *calls) {
+  size_t ncalls = calls->nupdates + calls->n;
+  if (ncalls > FAST_CALLS_MAX) {
+    return 1;
+  }
+  // the return address, followed by the strings
+  uint8_t data[sizeof(void *) + FAST_DATA_MAX];
+  size_t len = sizeof(void *), offsets[FAST_CALLS_MAX][2] = {{0}};
+  for (size_t k = 0; k < ncalls; k++) {
+    bool update = k < calls->nupdates;
+    const char *args[2] = {
+      update ? calls->updates[k].name : batch_name(calls, k - calls->nupdates),
+      update ? calls->updates[k].value : NULL,
+    };
+    for (int a = 0; a < 2 && args[a] != NULL; a++) {
+      size_t size = strlen(args[a]) + 1;
+      if (len + size > sizeof(data)) {
+        return 1;
+      }
+      memcpy(data + len, args[a], size);
+      offsets[k][a] = len;
+      len += size;
+    }
+  }
+  size_t end = len;
+  len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  memset(data + end, 0, len - end);
+  memcpy(data, &t->syms.trap, sizeof(void *));
+
+  // functions are entered with %rsp 8 bytes off a multiple of 16
+  uintptr_t strings = (t->oldregs.rsp - 128 - (len - sizeof(void *))) &
+                      ~(uintptr_t)15;
+  t->sp = strings - sizeof(void *);
+  if (poke_text(t->tid, t->mem_fd, (void *)t->sp, data, NULL, len)) {
+    return 1;
+  }
+  for (size_t k = 0; k < ncalls; k++) {
+    for (int a = 0; a < 2; a++) {
+      t->fast_args[k][a] = offsets[k][a] ? t->sp + offsets[k][a] : 0;
+    }
+  }
+  t->fast = true;
+  return 0;
+}
+
+// Make the next call of the fast path.
+static void tracee_fast_call(struct tracee *t,
+                             const struct batch_calls *calls) {
+  const struct remote_update *u =
+      t->call < calls->nupdates ? &calls->updates[t->call] : NULL;
+  t->regs = t->oldregs;
+  t->regs.rip = u == NULL          ? t->syms.getenv
+                : u->value != NULL ? t->syms.setenv
+                                   : t->syms.unsetenv;
+  t->regs.rdi = t->fast_args[t->call][0];
+  t->regs.rsi = t->fast_args[t->call][1];
+  t->regs.rdx = 1; // overwrite, for setenv
+  t->regs.rax = 0;
+  t->regs.rsp = t->sp;
+  // see run_payload()
+  t->regs.eflags &= ~EFLAGS_DF;
+  t->regs.orig_rax = -1;
+  if (do_ptrace(PTRACE_SETREGS, t->tid, NULL, &t->regs)) {
+    perror("PTRACE_SETREGS");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (do_ptrace(PTRACE_CONT, t->tid, NULL, NULL)) {
+    perror("PTRACE_CONT");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  t->state = TRACEE_FAST;
+}
+
+static int tracee_results(struct tracee *t, const struct batch_calls *calls);
+
+// A call of the fast path returned into the trap gadget: store its result
+// in its slot, like the payload would, and make the next call.
+static void tracee_fast_called(struct tracee *t,
+                               const struct batch_calls *calls) {
+  if (do_ptrace(PTRACE_GETREGS, t->tid, NULL, &t->regs)) {
+    perror("PTRACE_GETREGS");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (t->regs.rip != t->syms.trap + 1) {
+    fprintf(stderr, "unexpectedly stopped at %p\n", (void *)t->regs.rip);
+    tracee_finish(t, 1, true);
+    return;
+  }
+  size_t slot = t->call < calls->nupdates ? calls->n + t->call
+                                          : t->call - calls->nupdates;
+  t->fast_results[slot] = (void *)t->regs.rax;
+  if (++t->call < calls->nupdates + calls->n) {
+    tracee_fast_call(t, calls);
+    return;
+  }
+  tracee_phase(t, REMOTE_PHASE_CALL);
+  tracee_finish(t, tracee_results(t, calls) != 0, true);
+}
+
+// Take the n values that emit_store_string() copied to the payload, of
+// the lengths in lens, out of buf, the len bytes of room it had for them,
+// into results in the arena, stored in out. Those that did not fit are
+// left with a NULL value.
+static int copy_strings(const char *buf, size_t len, const size_t *lens,
+                        size_t n, struct remote_arena *arena,
+                        struct remote_value *out) {
+  size_t at = 0;
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (struct remote_value){.len = lens[i]};
+    if (lens[i] > len - at) {
+      continue;
+    }
+    char *value = arena_alloc(arena, lens[i] + 1);
+    if (value == NULL) {
+      return -1;
+    }
+    memcpy(value, buf + at, lens[i]);
+    value[lens[i]] = '\0';
+    out[i].value = value;
+    at = (at + lens[i] + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  }
+  return 0;
+}
+
+// Collect the results of the payload with one read, and then the strings
+// of the variables that are set in one batch, bounded by their lengths
+// unless they come from the fast path. If the results are in the mapping,
+// the read includes the values copied there, and only those that did not
+// fit are read from where they are.
+static int tracee_results(struct tracee *t, const struct batch_calls *calls) {
+  struct remote_arena *arena = t->query->arena;
+  size_t n = calls->n, nslots = n + calls->nupdates;
+  size_t results_len = (nslots + n) * sizeof(void *);
+  size_t read_len = results_len + (t->results ? t->copy_len : 0);
+  void **addrs = arena_scratch(arena, read_len);
+  void **set = arena_scratch(arena, n * sizeof(void *));
+  size_t *lens = arena_scratch(arena, n * sizeof(size_t));
+  size_t *left = arena_scratch(arena, n * sizeof(size_t));
+  struct remote_value *values =
+      arena_scratch(arena, 2 * n * sizeof(struct remote_value));
+  if (addrs == NULL || set == NULL || lens == NULL || left == NULL ||
+      values == NULL) {
+    return -1;
+  }
+  size_t nset = 0;
+  void *results = t->results ? (char *)t->mapping + t->results
+                             : (void *)t->sp;
+  if (t->fast) {
+    memcpy(addrs, t->fast_results, nslots * sizeof(void *));
+  } else if (read_remote(t->tid, results, addrs, read_len) !=
+             (ssize_t)read_len) {
+    fprintf(stderr, "cannot read getenv results\n");
+    return -1;
+  }
+  // setenv and unsetenv return an int, so only the low half of %rax counts
+  int failed = 0;
+  for (size_t i = 0; i < calls->nupdates; i++) {
+    if ((int)(uintptr_t)addrs[n + i] != 0) {
+      fprintf(stderr, "%s(%s) failed in process %d\n",
+              calls->updates[i].value != NULL ? "setenv" : "unsetenv",
+              calls->updates[i].name, t->query->pid);
+      failed = 1;
+    }
+  }
+  // only the payload stores the lengths after the addresses; the fast path
+  // reads the strings up to their NUL
+  for (size_t i = 0; i < n; i++) {
+    if (addrs[i] != NULL) {
+      if (!t->fast) {
+        lens[nset] = (size_t)addrs[nslots + i];
+      }
+      set[nset++] = addrs[i];
+    }
+  }
+  if (t->fast) {
+    if (read_strings(t->tid, set, nset, arena, values)) {
+      return -1;
+    }
+  } else {
+    size_t nleft = 0;
+    if (t->results) {
+      if (copy_strings((char *)addrs + results_len, t->copy_len, lens, nset,
+                       arena, values)) {
+        return -1;
+      }
+      for (size_t j = 0; j < nset; j++) {
+        if (values[j].value == NULL) {
+          set[nleft] = set[j];
+          lens[nleft] = lens[j];
+          left[nleft++] = j;
+        }
+      }
+    } else {
+      for (size_t j = 0; j < nset; j++) {
+        left[nleft++] = j;
+      }
+    }
+    struct remote_value *read = values + n;
+    if (read_strings_sized(t->tid, set, lens, nleft, arena, read)) {
+      return -1;
+    }
+    for (size_t j = 0; j < nleft; j++) {
+      values[left[j]] = read[j];
+    }
+  }
+  for (size_t i = 0, j = 0; i < n; i++) {
+    t->query->results[i] =
+        addrs[i] != NULL ? values[j++] : (struct remote_value){0};
+  }
+  tracee_phase(t, REMOTE_PHASE_READBACK);
+  return failed;
+}
+
+// Point the process at the syscall gadget with the registers set up for
+// munmap(2) of its payload, after the payload was abandoned.
+static void tracee_unmap(struct tracee *t) {
+  t->regs = t->oldregs;
+  t->regs.rax = 11; // munmap
+  t->regs.rdi = (long)t->mapping;
+  t->regs.rsi = t->maplen;
+  t->regs.rip = t->syms.syscall;
+  t->regs.orig_rax = -1;
+  t->deadline = 0;
+  if (do_ptrace(PTRACE_SETREGS, t->tid, NULL, &t->regs) ||
+      do_ptrace(PTRACE_SINGLESTEP, t->tid, NULL, NULL)) {
+    tracee_finish(t, 1, true);
+    return;
+  }
+  t->state = TRACEE_UNMAP;
+}
+
+// The process stopped for us after it was seized: set it up to mmap(2)
+// memory for the payload, by pointing %rip at the SYSCALL instruction in
+// libc and singlestepping it.
+static void tracee_attached(struct tracee *t, const struct batch_calls *calls) {
+  tracee_phase(t, REMOTE_PHASE_ATTACH);
+  // Only the attach of an update is timed: a setenv() that is interrupted
+  // halfway would keep the lock of the environment, and maybe leave it
+  // half changed, when its registers are restored.
+  if (calls->nupdates) {
+    t->deadline = 0;
+  }
+  if (do_ptrace(PTRACE_GETREGS, t->tid, NULL, &t->oldregs)) {
+    perror("PTRACE_GETREGS");
+    tracee_finish(t, -1, true);
+    return;
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "their %%rip           %p\n", (void *)t->oldregs.rip);
+  #endif
+  t->masked = block_signals(t->tid, &t->oldregs, &t->sigmask);
+  t->mem_fd = open_mem(t->tid);
+  if (tracee_fast(t, calls) == 0) {
+    t->injected = true;
+    if (set_exitkill(t->tid, true)) {
+      tracee_finish(t, 1, true);
+      return;
+    }
+    tracee_phase(t, REMOTE_PHASE_UPLOAD);
+    tracee_fast_call(t, calls);
+    return;
+  }
+  if (tracee_payload(t, calls)) {
+    tracee_finish(t, 1, true);
+    return;
+  }
+  t->regs = t->oldregs;
+  t->regs.rax = 9;                           // mmap
+  t->regs.rdi = 0;                           // addr
+  t->regs.rsi = t->maplen;                   // length
+  t->regs.rdx = PROT_READ | PROT_EXEC;       // prot
+  t->regs.r10 = MAP_PRIVATE | MAP_ANONYMOUS; // flags
+  t->regs.r8 = -1;                           // fd
+  t->regs.r9 = 0;                            // offset
+  t->regs.rip = t->syms.syscall;
+  // see run_payload()
+  t->regs.eflags &= ~EFLAGS_DF;
+  t->regs.orig_rax = -1;
+  t->injected = true;
+  if (set_exitkill(t->tid, true)) {
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (do_ptrace(PTRACE_SETREGS, t->tid, NULL, &t->regs)) {
+    perror("PTRACE_SETREGS");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (do_ptrace(PTRACE_SINGLESTEP, t->tid, NULL, NULL)) {
+    perror("PTRACE_SINGLESTEP");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  t->state = TRACEE_MMAP;
+}
+
+// The mmap(2) returned: copy the payload over and run it.
+static void tracee_mapped(struct tracee *t) {
+  if (do_ptrace(PTRACE_GETREGS, t->tid, NULL, &t->regs)) {
+    perror("PTRACE_GETREGS");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (t->regs.rip != t->syms.syscall + 2) {
+    fprintf(stderr, "unexpectedly stopped at %p\n", (void *)t->regs.rip);
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if ((unsigned long)t->regs.rax >= (unsigned long)-4095) {
+    fprintf(stderr, "failed to mmap: %s\n", strerror(-t->regs.rax));
+    tracee_finish(t, 1, true);
+    return;
+  }
+  tracee_phase(t, REMOTE_PHASE_MMAP);
+  t->mapping = (void *)t->regs.rax;
+  #ifdef DEBUG
+  fprintf(stderr, "allocated memory at  %p\n", t->mapping);
+  #endif
+  if (poke_text(t->tid, t->mem_fd, t->mapping, t->text, NULL, t->len)) {
+    tracee_unmap(t);
+    return;
+  }
+  t->regs.rip = (long)t->mapping;
+  t->regs.rsp = t->sp;
+  t->regs.rbx = 0; // set by the epilogue
+  if (do_ptrace(PTRACE_SETREGS, t->tid, NULL, &t->regs)) {
+    perror("PTRACE_SETREGS");
+    tracee_unmap(t);
+    return;
+  }
+  tracee_phase(t, REMOTE_PHASE_UPLOAD);
+  if (do_ptrace(PTRACE_CONT, t->tid, NULL, NULL)) {
+    perror("PTRACE_CONT");
+    tracee_unmap(t);
+    return;
+  }
+  t->state = TRACEE_CALL;
+}
+
+// The payload stopped on the trap gadget, after unmapping itself. If its
+// results are in the mapping, it stopped on its int3 before that: read
+// them, and let it carry on into its epilogue.
+static void tracee_called(struct tracee *t, const struct batch_calls *calls) {
+  if (do_ptrace(PTRACE_GETREGS, t->tid, NULL, &t->regs)) {
+    perror("PTRACE_GETREGS");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (t->results && t->state == TRACEE_CALL) {
+    if (t->regs.rip != (uintptr_t)t->mapping + t->pause) {
+      fprintf(stderr, "unexpectedly stopped at %p\n", (void *)t->regs.rip);
+      tracee_unmap(t);
+      return;
+    }
+    tracee_phase(t, REMOTE_PHASE_CALL);
+    t->ret = tracee_results(t, calls) != 0;
+    t->full = t->ret && arena_full;
+    if (do_ptrace(PTRACE_CONT, t->tid, NULL, NULL)) {
+      perror("PTRACE_CONT");
+      tracee_unmap(t);
+      return;
+    }
+    t->state = TRACEE_RELEASE;
+    return;
+  }
+  if (t->regs.rip != t->syms.trap + 1) {
+    fprintf(stderr, "unexpectedly stopped at %p\n", (void *)t->regs.rip);
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (t->state == TRACEE_CALL) {
+    tracee_phase(t, REMOTE_PHASE_CALL);
+  }
+  if (t->regs.rax != 0) {
+    fprintf(stderr, "warning: failed to munmap: %s\n", strerror(-t->regs.rax));
+  }
+  if (t->regs.rbx != 1) {
+    fprintf(stderr, "payload did not run to completion\n");
+    tracee_finish(t, 1, true);
+    return;
+  }
+  if (t->state == TRACEE_RELEASE) {
+    arena_full = t->full;
+    tracee_finish(t, t->ret, true);
+    return;
+  }
+  tracee_finish(t, tracee_results(t, calls) != 0, true);
+}
+
+// Handle a wait status of the process. Signals that arrive while our code
+// runs are not delivered, as they would run the process' signal handlers
+// on top of it. Most are blocked (see block_signals()), and of the others
+// the last one is stored in pending, to be delivered when we detach, like
+// do_wait() does.
+static void tracee_event(struct tracee *t, int status,
+                         const struct batch_calls *calls) {
+  if (!WIFSTOPPED(status)) {
+    fprintf(stderr, "process %d exited while we were attached\n",
+            t->query->pid);
+    tracee_finish(t, t->state == TRACEE_ATTACH ? -1 : 1, false);
+    return;
+  }
+  int sig = WSTOPSIG(status);
+  bool event_stop = status >> 16 == PTRACE_EVENT_STOP;
+  if (t->state == TRACEE_ATTACH) {
+    if (event_stop) {
+      tracee_attached(t, calls);
+    } else if (do_ptrace(PTRACE_CONT, t->tid, NULL, (void *)(long)sig)) {
+      // signals that arrive before it stops for us are delivered as usual
+      perror("PTRACE_CONT");
+      tracee_finish(t, -1, false);
+    }
+    return;
+  }
+
+  bool fault = sig != SIGTRAP && is_fault(t->tid, sig);
+  if (fault) {
+    fprintf(stderr, "process %d: the injected code got %s\n", t->query->pid,
+            strsignal(sig));
+  } else if (sig != SIGTRAP && !event_stop) {
+    #ifdef DEBUG
+    fprintf(stderr, "%d deferring signal %s\n", t->tid, strsignal(sig));
+    #endif
+    t->pending = sig;
+  }
+  if (t->state == TRACEE_HALT || fault) {
+    // the payload is abandoned wherever it faulted or got stuck
+    if (t->mapping != NULL && t->state != TRACEE_UNMAP) {
+      tracee_unmap(t);
+    } else {
+      tracee_finish(t, 1, true);
+    }
+    return;
+  }
+  if (sig != SIGTRAP) {
+    enum __ptrace_request request =
+        t->state == TRACEE_CALL || t->state == TRACEE_RELEASE ||
+                t->state == TRACEE_FAST
+            ? PTRACE_CONT : PTRACE_SINGLESTEP;
+    if (do_ptrace(request, t->tid, NULL, NULL)) {
+      perror(request == PTRACE_CONT ? "PTRACE_CONT" : "PTRACE_SINGLESTEP");
+      tracee_finish(t, 1, true);
+    }
+    return;
+  }
+  switch (t->state) {
+  case TRACEE_MMAP:
+    tracee_mapped(t);
+    break;
+  case TRACEE_CALL:
+  case TRACEE_RELEASE:
+    tracee_called(t, calls);
+    break;
+  case TRACEE_FAST:
+    tracee_fast_called(t, calls);
+    break;
+  default:
+    tracee_finish(t, 1, true);
+    break;
+  }
+}
+
+// The deadline of the process passed. If it never stopped, we give up on
+// it; it stays seized until it stops, when run_batch() detaches it, or
+// until the thread of the query exits, see run_query(), and then carries
+// on. Otherwise it is interrupted, so its
+// registers can be restored.
+static void tracee_timeout(struct tracee *t) {
+  t->deadline = 0;
+  if (t->state == TRACEE_ATTACH) {
+    fprintf(stderr, "process %d did not stop within %ld ms\n", t->query->pid,
+            timeout_ms);
+    tracee_finish(t, -1, false);
+    t->abandoned = true;
+    return;
+  }
+  fprintf(stderr, "%s timed out after %ld ms, interrupting process %d\n",
+          t->state == TRACEE_CALL || t->state == TRACEE_RELEASE ||
+                  t->state == TRACEE_FAST
+              ? "PTRACE_CONT" : "PTRACE_SINGLESTEP",
+          timeout_ms, t->query->pid);
+  if (do_ptrace(PTRACE_INTERRUPT, t->tid, NULL, NULL)) {
+    perror("PTRACE_INTERRUPT");
+    tracee_finish(t, 1, false);
+    return;
+  }
+  t->state = TRACEE_HALT;
+}
+
+// The longest run_batch() sleeps before it polls its tracees again, in
+// case the SIGCHLD that should wake it went to another thread.
+#define BATCH_POLL_NS 1000000
+// the most SIGCHLDs for other children that run_batch() queues again
+#define BATCH_FOREIGN_MAX 8
+
+// Detach a process that we gave up on in tracee_timeout(), which stopped
+// for us only now, with the signal that stopped it if it was one.
+static void tracee_release(struct tracee *t, int status) {
+  t->abandoned = false;
+  if (WIFSTOPPED(status)) {
+    int sig = WSTOPSIG(status);
+    bool keep = status >> 16 != PTRACE_EVENT_STOP && sig != SIGTRAP;
+    do_ptrace(PTRACE_DETACH, t->tid, NULL, (void *)(long)(keep ? sig : 0));
+  }
+}
+
+// Pass a process that is done to done, once.
+static void tracee_report(struct tracee *t, const struct batch_calls *calls,
+                          void (*done)(struct tracee *,
+                                       const struct batch_calls *)) {
+  if (t->state == TRACEE_DONE && !t->reported) {
+    t->reported = true;
+    if (done != NULL) {
+      done(t, calls);
+    }
+  }
+}
+
+// Run the calls in all of the processes at once, from this thread. Every
+// process is seized and interrupted right away, and then the loop moves
+// each of them on to its next state whenever it stops, so their stops
+// overlap instead of following one another. Each one is waited for by its
+// own tid with WNOHANG, never with -1, which would also reap the other
+// children of the caller. In between, we sleep in sigtimedwait() until a
+// SIGCHLD, which is blocked in this thread for the time being, or the
+// next deadline. A SIGCHLD that was not for one of our tracees is queued
+// again at the end with its siginfo, for whoever waits for it; up to
+// BATCH_FOREIGN_MAX of them, as the kernel would merge more anyway. Each
+// process is passed to done, if not NULL, as soon as it is done.
+static void run_batch(struct tracee **tracees, size_t n,
+                      const struct batch_calls *calls,
+                      void (*done)(struct tracee *,
+                                   const struct batch_calls *)) {
+  sigset_t chld, oldmask;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &chld, &oldmask);
+  siginfo_t foreign[BATCH_FOREIGN_MAX];
+  size_t nforeign = 0;
+  for (size_t i = 0; i < n; i++) {
+    arena_full = false;
+    tracee_start(tracees[i], tracees[i]->query);
+    tracee_report(tracees[i], calls, done);
+  }
+  while (true) {
+    bool moved = false;
+    size_t active = 0;
+    for (size_t i = 0; i < n; i++) {
+      struct tracee *t = tracees[i];
+      if (t->state == TRACEE_DONE && !t->abandoned) {
+        continue;
+      }
+      int status;
+      pid_t tid = do_waitpid(t->tid, &status, __WALL | WNOHANG);
+      if (tid == -1 && errno != EINTR) {
+        perror("wait");
+        if (t->state != TRACEE_DONE) {
+          tracee_finish(t, 1, false);
+        }
+        t->abandoned = false;
+      } else if (tid == t->tid) {
+        moved = true;
+        arena_full = false;
+        if (t->state == TRACEE_DONE) {
+          tracee_release(t, status);
+        } else {
+          tracee_event(t, status, calls);
+        }
+      }
+      tracee_report(t, calls, done);
+      active += t->state != TRACEE_DONE;
+    }
+    if (active == 0) {
+      break;
+    }
+    if (moved) {
+      continue;
+    }
+
+    uint64_t now = now_ns(), next = now + BATCH_POLL_NS;
+    for (size_t i = 0; i < n; i++) {
+      struct tracee *t = tracees[i];
+      if (t->state == TRACEE_DONE || t->deadline == 0) {
+        continue;
+      }
+      if (t->deadline <= now) {
+        arena_full = false;
+        tracee_timeout(t);
+        tracee_report(t, calls, done);
+        moved = true;
+      } else if (t->deadline < next) {
+        next = t->deadline;
+      }
+    }
+    if (moved) {
+      continue;
+    }
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = next - now};
+    siginfo_t info;
+    if (sigtimedwait(&chld, &info, &wait) == SIGCHLD) {
+      bool ours = false;
+      for (size_t i = 0; i < n && !ours; i++) {
+        ours = tracees[i]->tid == info.si_pid;
+      }
+      if (!ours && nforeign < BATCH_FOREIGN_MAX) {
+        foreign[nforeign++] = info;
+      }
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  for (size_t i = 0; i < nforeign; i++) {
+    if (syscall(SYS_rt_sigqueueinfo, getpid(), SIGCHLD, &foreign[i])) {
+      perror("rt_sigqueueinfo");
+    }
+  }
+}
+
+// Check that the updates of the batch took in the process of q, by
+// comparing the values read back to the last update of each variable.
+static int check_updates(const struct remote_batch *q,
+                         const struct remote_update *updates, size_t n) {
+  int ret = 0;
+  for (size_t i = 0; i < n; i++) {
+    const char *want = NULL;
+    for (size_t j = 0; j < n; j++) {
+      if (strcmp(updates[j].name, updates[i].name) == 0) {
+        want = updates[j].value;
+      }
+    }
+    const char *got = q->results[i].value;
+    if (want == NULL ? got != NULL : got == NULL || strcmp(got, want) != 0) {
+      fprintf(stderr, "%s did not change in process %d\n", updates[i].name,
+              q->pid);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+// Make the calls in one process through run_batch(), with the stats of
+// this thread. Returns -1 if we could not attach, and 1 if something went
+// wrong after we did.
+static int update_process(pid_t pid, const struct batch_calls *calls,
+                          struct remote_arena *arena,
+                          struct remote_value *results) {
+  struct remote_batch q = {
+    .pid = pid, .arena = arena, .results = results, .stats = stats,
+  };
+  struct tracee t = {.query = &q}, *tracees = &t;
+  run_batch(&tracees, 1, calls, NULL);
+  arena_full = t.full;
+  return q.ret;
+}
+
+// Look up the n names in the remote process by injecting calls to its own
+// getenv, and store the values in results, with the same return values as
+// update_process().
+static int getenv_process(pid_t pid, const char *const *names, size_t n,
+                          struct remote_arena *arena,
+                          struct remote_value *results) {
+  struct batch_calls calls = {.names = names, .n = n};
+  return update_process(pid, &calls, arena, results);
+}
+
+// The resident agent is a thread that we start in the remote process once
+// and that answers later queries over shared memory, so they do not need to
+// stop the process at all. The shared memory is a memfd named AGENT_NAME in
+// the remote process, so any later run can find it in /proc/<pid>/fd and map
+// it too. Requests are posted by bumping request, and the agent answers by
+// setting response to the same value; both are futexes. Only one client may
+// use the agent at a time, which is enforced with flock(2) on the memfd.
+#define AGENT_MAGIC 0x746e6567 // "gent"
+#define AGENT_VERSION 2
+#define AGENT_SHM_SIZE (1024 * 1024)
+#define AGENT_STACK_SIZE (64 * 1024)
+// how long to wait for the agent to answer, in milliseconds
+#define AGENT_TIMEOUT 1000
+
+enum agent_op {
+  AGENT_GET = 1, // look up the count NUL terminated names in data
+  AGENT_DUMP,    // copy the whole environment
+  AGENT_EXIT,    // stop the agent thread
+};
+
+enum agent_status {
+  AGENT_OK,
+  AGENT_E2BIG,  // the answer does not fit in data
+  AGENT_EINVAL, // unknown op
+  AGENT_EAGAIN, // the environment kept changing while it was read
+  AGENT_EPERM,  // the IDs of the process changed, and the agent exited
+};
+
+struct agent_shm {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t request;  // futex, bumped by the client to post a request
+  uint32_t response; // futex, set to request by the agent when it is done
+  uint32_t tid;      // futex, set by clone(2) and cleared when the agent exits
+  uint32_t op;
+  uint32_t status;
+  uint32_t count;    // number of names asked for, or of variables dumped
+  uint64_t len;      // bytes used in data by the request, or the answer
+  uint64_t environ;  // address of the GOT slot of __environ
+  uint64_t pid;      // the process as seen from its own pid namespace
+  uint64_t code, stack, shm; // remote mappings, for --unload
+  // The answer is a sequence of records of a 32 bit length followed by that
+  // many bytes, each aligned to 4 bytes. For AGENT_DUMP these are the count
+  // "VAR=value" strings; for AGENT_GET they are the values of the names in
+  // order, starting after the names, with a length of UINT32_MAX for names
+  // that are not set.
+  char data[];
+};
+
+#define AGENT_DATA_SIZE (AGENT_SHM_SIZE - offsetof(struct agent_shm, data))
+
+// Everything the agent runs is in the getenv_agent section, which is copied
+// into the remote process as is: it cannot call into libc or refer to
+// anything outside of its section, so these functions must not be turned
+// into calls to memcpy and friends or use constants from .rodata.
+#define AGENT_CODE                                                           \
+  __attribute__((section("getenv_agent"), used,                              \
+                 optimize("no-tree-loop-distribute-patterns",               \
+                          "no-tree-vectorize", "no-jump-tables",            \
+                          "no-stack-protector")))
+
+extern const uint8_t __start_getenv_agent[]
+    __attribute__((visibility("hidden")));
+extern const uint8_t __stop_getenv_agent[]
+    __attribute__((visibility("hidden")));
+extern const uint8_t agent_clone[] __attribute__((visibility("hidden")));
+extern const char agent_status[] __attribute__((visibility("hidden")));
+
+AGENT_CODE static long agent_syscall3(long nr, long a, long b, long c) {
+  long ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret)
+                   : "0"(nr), "D"(a), "S"(b), "d"(c)
+                   : "rcx", "r11", "memory");
+  return ret;
+}
+
+AGENT_CODE static long agent_futex(uint32_t *uaddr, long op, uint32_t val) {
+  register long timeout __asm__("r10") = 0;
+  long ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret)
+                   : "0"((long)SYS_futex), "D"(uaddr), "S"(op),
+                     "d"((long)val), "r"(timeout)
+                   : "rcx", "r11", "memory");
+  return ret;
+}
+
+AGENT_CODE static size_t agent_strlen(const char *s) {
+  size_t len = 0;
+  while (s[len] != '\0') {
+    len++;
+  }
+  return len;
+}
+
+AGENT_CODE static void agent_yield(void) {
+  long ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret)
+                   : "0"((long)SYS_sched_yield)
+                   : "rcx", "r11", "memory");
+}
+
+// The agent never dereferences the environment itself: a pointer that
+// unsetenv() in another thread freed, or that a setenv() moved, may point
+// to memory that is gone, and a fault would kill the process. Everything is
+// read with process_vm_readv(2) on our own process instead, which returns a
+// short read or -EFAULT for that, and then the whole answer is tried again,
+// just like peek_environ() does from the outside. This returns the number
+// of bytes that were read.
+AGENT_CODE static long agent_read(const struct agent_shm *shm, void *dst,
+                                  uint64_t src, size_t len) {
+  struct iovec local = {.iov_base = dst, .iov_len = len};
+  struct iovec remote = {.iov_base = (void *)(uintptr_t)src, .iov_len = len};
+  register long remote_iov __asm__("r10") = (long)&remote;
+  register long riovcnt __asm__("r8") = 1;
+  register long flags __asm__("r9") = 0;
+  long ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret)
+                   : "0"((long)SYS_process_vm_readv), "D"((long)shm->pid),
+                     "S"(&local), "d"(1L), "r"(remote_iov), "r"(riovcnt),
+                     "r"(flags)
+                   : "rcx", "r11", "memory");
+  return ret;
+}
+
+// Read the string at src into the room bytes at dst, a page at a time, so
+// that no read runs past its end into a page that is not mapped. Returns
+// its length, -1 if it cannot be read, or -2 if it does not fit, in which
+// case dst holds its first room bytes.
+AGENT_CODE static long agent_read_string(const struct agent_shm *shm,
+                                         char *dst, uint64_t src,
+                                         size_t room) {
+  size_t len = 0;
+  while (true) {
+    size_t chunk = PAGE_SIZE - ((src + len) & (PAGE_SIZE - 1));
+    if (chunk > room - len) {
+      chunk = room - len;
+    }
+    if (chunk == 0) {
+      return -2;
+    }
+    if (agent_read(shm, dst + len, src + len, chunk) != (long)chunk) {
+      return -1;
+    }
+    for (size_t i = 0; i < chunk; i++) {
+      if (dst[len + i] == '\0') {
+        return len + i;
+      }
+    }
+    len += chunk;
+  }
+}
+
+// whether the variable that starts with var is name
+AGENT_CODE static bool agent_match(const char *var, const char *name) {
+  while (*name != '\0' && *var == *name) {
+    var++;
+    name++;
+  }
+  return *name == '\0' && *var == '=';
+}
+
+// Append a record to the answer at *pos, which must stay below limit, with
+// the string at src read into it, or a length of UINT32_MAX if src is 0.
+AGENT_CODE static uint32_t agent_put(struct agent_shm *shm, uint64_t *pos,
+                                     uint64_t limit, uint64_t src) {
+  if (*pos + sizeof(uint32_t) > limit) {
+    return AGENT_E2BIG;
+  }
+  char *out = shm->data + *pos;
+  uint32_t len = UINT32_MAX, size = 0;
+  if (src != 0) {
+    long ret = agent_read_string(shm, out + sizeof(uint32_t), src,
+                                 limit - *pos - sizeof(uint32_t));
+    if (ret < 0) {
+      return ret == -1 ? AGENT_EAGAIN : AGENT_E2BIG;
+    }
+    len = size = ret;
+  }
+  *(uint32_t *)out = len;
+  *pos = (*pos + sizeof(uint32_t) + size + 3) & ~(uint64_t)3;
+  return AGENT_OK;
+}
+
+// Copy the pointer array of the environment env, n entries and the NULL
+// after them, to just below top, and return it or NULL if it moved or
+// cannot be read. n is counted first, a few pointers at a time.
+AGENT_CODE static uint64_t *agent_read_array(const struct agent_shm *shm,
+                                             uint64_t env, char *top,
+                                             size_t *n) {
+  uint64_t chunk[32];
+  *n = 0;
+  for (bool end = env == 0; !end;) {
+    long got = agent_read(shm, chunk, env + *n * sizeof(uint64_t),
+                          sizeof(chunk));
+    if (got < (long)sizeof(uint64_t)) {
+      return NULL;
+    }
+    for (long i = 0; i < got / (long)sizeof(uint64_t); i++) {
+      if (chunk[i] == 0) {
+        end = true;
+        break;
+      }
+      ++*n;
+    }
+  }
+  size_t size = (*n + 1) * sizeof(uint64_t);
+  if ((size_t)(top - shm->data) < size) {
+    return NULL;
+  }
+  uint64_t *array = (uint64_t *)(top - size);
+  array[*n] = 0;
+  if (env != 0 && agent_read(shm, array, env, size) != (long)size) {
+    return NULL;
+  }
+  for (size_t i = 0; i < *n; i++) {
+    if (array[i] == 0) {
+      return NULL;
+    }
+  }
+  return array[*n] == 0 ? array : NULL;
+}
+
+// whether __environ still is env, with the same n pointers as in array
+AGENT_CODE static bool agent_unchanged(const struct agent_shm *shm,
+                                       uint64_t environ, uint64_t env,
+                                       const uint64_t *array, size_t n) {
+  uint64_t again, chunk[32];
+  if (agent_read(shm, &again, environ, sizeof(again)) != sizeof(again) ||
+      again != env) {
+    return false;
+  }
+  for (size_t i = 0; env != 0 && i <= n;) {
+    size_t want = n + 1 - i < 32 ? n + 1 - i : 32;
+    if (agent_read(shm, chunk, env + i * sizeof(uint64_t),
+                   want * sizeof(uint64_t)) != (long)(want * sizeof(uint64_t))) {
+      return false;
+    }
+    for (size_t j = 0; j < want; j++, i++) {
+      if (chunk[j] != array[i]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Answer the request once. The pointer array is copied to the top of data,
+// the strings are read through the copy, and the array is read again at the
+// end, which has to be unchanged, like a seqlock.
+AGENT_CODE static uint32_t agent_answer(struct agent_shm *shm) {
+  uint64_t environ, env;
+  if (agent_read(shm, &environ, shm->environ, sizeof(environ)) !=
+          sizeof(environ) ||
+      agent_read(shm, &env, environ, sizeof(env)) != sizeof(env)) {
+    return AGENT_EAGAIN;
+  }
+  size_t n;
+  uint64_t *array = agent_read_array(shm, env, shm->data + AGENT_DATA_SIZE,
+                                     &n);
+  if (array == NULL) {
+    return AGENT_EAGAIN;
+  }
+  uint32_t status = AGENT_OK;
+  uint64_t pos, count = 0;
+  if (shm->op == AGENT_GET) {
+    // below the array go the index of the variable that matched each name,
+    // and the start of the variable that is being matched
+    pos = (shm->len + 3) & ~(uint64_t)3;
+    size_t longest = 0;
+    const char *name = shm->data;
+    for (uint32_t k = 0; k < shm->count; k++) {
+      size_t len = agent_strlen(name);
+      longest = len > longest ? len : longest;
+      name += len + 1;
+    }
+    uint32_t *matches = (uint32_t *)array - shm->count;
+    char *head = (char *)matches - (longest + 1);
+    if (head < shm->data + pos) {
+      return AGENT_E2BIG;
+    }
+    for (uint32_t k = 0; k < shm->count; k++) {
+      matches[k] = UINT32_MAX;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (agent_read_string(shm, head, array[i], longest + 1) == -1) {
+        return AGENT_EAGAIN;
+      }
+      name = shm->data;
+      for (uint32_t k = 0; k < shm->count; k++) {
+        if (matches[k] == UINT32_MAX && agent_match(head, name)) {
+          matches[k] = i;
+        }
+        name += agent_strlen(name) + 1;
+      }
+    }
+    name = shm->data;
+    for (uint32_t k = 0; k < shm->count && status == AGENT_OK; k++) {
+      size_t len = agent_strlen(name);
+      uint64_t value = matches[k] != UINT32_MAX
+                           ? array[matches[k]] + len + 1 : 0;
+      status = agent_put(shm, &pos, head - shm->data, value);
+      name += len + 1;
+    }
+    count = shm->count;
+  } else if (shm->op == AGENT_DUMP) {
+    pos = 0;
+    for (; count < n && status == AGENT_OK; count++) {
+      status = agent_put(shm, &pos, (char *)array - shm->data, array[count]);
+    }
+  } else {
+    return AGENT_EINVAL;
+  }
+  if (!agent_unchanged(shm, environ, env, array, n)) {
+    return AGENT_EAGAIN;
+  }
+  if (status == AGENT_OK) {
+    shm->count = count;
+    shm->len = pos;
+  }
+  return status;
+}
+
+// Parse the four IDs (real, effective, saved set and filesystem) of the
+// line of /proc/self/status in the len bytes at buf that starts with kind
+// and "id:", into ids. Returns false if there is no such line.
+AGENT_CODE static bool agent_status_ids(const char *buf, long len, char kind,
+                                        uint32_t *ids) {
+  for (long i = 0; i + 4 < len; i++) {
+    if (buf[i] != '\n' || buf[i + 1] != kind || buf[i + 2] != 'i' ||
+        buf[i + 3] != 'd' || buf[i + 4] != ':') {
+      continue;
+    }
+    long pos = i + 5;
+    for (int k = 0; k < 4; k++) {
+      while (pos < len && (buf[pos] == '\t' || buf[pos] == ' ')) {
+        pos++;
+      }
+      if (pos == len || buf[pos] < '0' || buf[pos] > '9') {
+        return false;
+      }
+      uint32_t id = 0;
+      while (pos < len && buf[pos] >= '0' && buf[pos] <= '9') {
+        id = id * 10 + (buf[pos++] - '0');
+      }
+      ids[k] = id;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Whether the agent thread still has the IDs of the main thread. glibc
+// changes them in every thread it knows about for setuid() and friends,
+// which the agent is not, so after a change it would go on with the old
+// ones, maybe more privileged than the process means to be. The main
+// thread's are in /proc/self/status, as self is the thread group; ours we
+// ask the kernel for, the filesystem IDs with an invalid setfsuid().
+AGENT_CODE static bool agent_same_ids(void) {
+  char buf[1024];
+  long fd = agent_syscall3(SYS_open, (long)agent_status, O_RDONLY | O_CLOEXEC,
+                           0);
+  if (fd < 0) {
+    return false;
+  }
+  long len = agent_syscall3(SYS_read, fd, (long)buf, sizeof(buf));
+  agent_syscall3(SYS_close, fd, 0, 0);
+  uint32_t want[4], have[4];
+  for (int g = 0; g < 2; g++) {
+    if (!agent_status_ids(buf, len, g ? 'G' : 'U', want) ||
+        agent_syscall3(g ? SYS_getresgid : SYS_getresuid, (long)&have[0],
+                       (long)&have[1], (long)&have[2])) {
+      return false;
+    }
+    have[3] = agent_syscall3(g ? SYS_setfsgid : SYS_setfsuid, -1, 0, 0);
+    for (int k = 0; k < 4; k++) {
+      if (have[k] != want[k]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+AGENT_CODE static uint32_t agent_serve(struct agent_shm *shm) {
+  uint32_t status = AGENT_EAGAIN;
+  for (int try = 0; try < PEEK_TRIES && status == AGENT_EAGAIN; try++) {
+    if (try > 0) {
+      agent_yield();
+    }
+    status = agent_answer(shm);
+  }
+  return status;
+}
+
+// The main loop of the agent thread, which returns for AGENT_EXIT, or
+// with AGENT_EPERM if the IDs of the process are no longer its own.
+AGENT_CODE __attribute__((noinline, noclone))
+static void agent_main(struct agent_shm *shm) {
+  while (true) {
+    uint32_t request = __atomic_load_n(&shm->request, __ATOMIC_ACQUIRE);
+    if (request == shm->response) {
+      agent_futex(&shm->request, FUTEX_WAIT, request);
+      continue;
+    }
+    bool exiting = shm->op == AGENT_EXIT;
+    bool stale = !exiting && !agent_same_ids();
+    shm->status = exiting ? AGENT_OK : stale ? AGENT_EPERM : agent_serve(shm);
+    __atomic_store_n(&shm->response, request, __ATOMIC_RELEASE);
+    agent_futex(&shm->response, FUTEX_WAKE, INT_MAX);
+    if (exiting || stale) {
+      return;
+    }
+  }
+}
+
+// The installer calls agent_clone with the arguments of clone(2) set up. In
+// the parent it simply returns. The new thread starts on its own stack with
+// the address of the shared memory on top, names itself AGENT_NAME so that
+// pick_thread() leaves it alone, and exits with exit(2) when agent_main()
+// returns, which clears tid and wakes anyone waiting on it.
+// This has to live in the agent section too: the installer's own code is
+// unmapped right after, maybe before the new thread ever gets to run.
+__asm__(".pushsection getenv_agent, \"ax\", @progbits\n"
+        "agent_clone:\n"
+        "  syscall\n"
+        "  test %rax, %rax\n"
+        "  jz 1f\n"
+        "  ret\n"
+        "1:\n"
+        "  mov $157, %eax\n" // prctl(PR_SET_NAME, agent_comm)
+        "  mov $15, %edi\n"
+        "  lea agent_comm(%rip), %rsi\n"
+        "  syscall\n"
+        "  mov (%rsp), %rdi\n"
+        "  and $-16, %rsp\n"
+        "  call agent_main\n"
+        "  mov $60, %eax\n"
+        "  xor %edi, %edi\n"
+        "  syscall\n"
+        "  hlt\n"
+        "agent_comm:\n"
+        "  .asciz \"" AGENT_NAME "\"\n"
+        "agent_status:\n"
+        "  .asciz \"/proc/self/status\"\n"
+        ".popsection\n");
+
+// the size of the remote mapping of the agent code
+static size_t agent_code_size(void) {
+  size_t len = __stop_getenv_agent - __start_getenv_agent;
+  return (len + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+// The pid of the process as seen from its own pid namespace, which is what
+// the agent records. A forked child inherits the memfd, but not the agent
+// thread, so it must not use the agent of its parent.
+static pid_t inner_pid(pid_t pid) {
+  char filename[64], buf[4096];
+  snprintf(filename, sizeof(filename), "/proc/%d/status", pid);
+  if (read_file(filename, buf, sizeof(buf)) < 0) {
+    perror(filename);
+    return -1;
+  }
+  pid_t inner = pid;
+  char *line = strstr(buf, "\nNSpid:");
+  if (line != NULL) {
+    char *end = strchr(line + 1, '\n');
+    if (end != NULL) {
+      *end = '\0';
+    }
+    char *last = strrchr(line, '\t');
+    if (last != NULL) {
+      inner = strtol(last + 1, NULL, 10);
+    }
+  }
+  return inner;
+}
+
+// Whether the real, effective, saved set and filesystem user or group IDs
+// of the process differ, as in a set-user-ID program that dropped its
+// privileges only for now. glibc changes the IDs of every thread it knows
+// about for setuid() and friends, and the agent thread, which it does not
+// know about, would keep the old ones, so the agent is not installed in such
+// a process; for a change after that, it checks them on every request with
+// agent_same_ids(). Returns 1 if they differ, 0 if not, or -1 on error.
+static int mixed_ids(pid_t pid) {
+  char filename[64], buf[4096];
+  snprintf(filename, sizeof(filename), "/proc/%d/status", pid);
+  if (read_file(filename, buf, sizeof(buf)) < 0) {
+    perror(filename);
+    return -1;
+  }
+  static const char *const keys[] = {"\nUid:", "\nGid:"};
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    char *line = strstr(buf, keys[i]);
+    if (line == NULL) {
+      fprintf(stderr, "%s: no %s line\n", filename, keys[i] + 1);
+      return -1;
+    }
+    char *end = line + strlen(keys[i]);
+    long ids[4];
+    for (int j = 0; j < 4; j++) {
+      ids[j] = strtol(end, &end, 10);
+    }
+    if (ids[1] != ids[0] || ids[2] != ids[0] || ids[3] != ids[0]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// a connection to the agent of a process
+struct agent {
+  int fd;               // our own fd for its memfd, locked with flock(2)
+  int remote_fd;        // the number of the memfd in the remote process
+  struct agent_shm *shm;
+};
+
+// map the memfd of the agent at /proc/<pid>/fd/<remote_fd> and lock it
+static int agent_map(pid_t pid, int remote_fd, struct agent *agent) {
+  char filename[64];
+  snprintf(filename, sizeof(filename), "/proc/%d/fd/%d", pid, remote_fd);
+  agent->fd = open(filename, O_RDWR | O_CLOEXEC);
+  if (agent->fd < 0) {
+    perror(filename);
+    return -1;
+  }
+  agent->remote_fd = remote_fd;
+  struct stat st;
+  if (fstat(agent->fd, &st) || st.st_size != AGENT_SHM_SIZE) {
+    fprintf(stderr, "%s is not an agent\n", filename);
+    goto fail;
+  }
+  agent->shm = mmap(NULL, AGENT_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    agent->fd, 0);
+  if (agent->shm == MAP_FAILED) {
+    perror("mmap");
+    goto fail;
+  }
+  if (flock(agent->fd, LOCK_EX)) {
+    perror("flock");
+    munmap(agent->shm, AGENT_SHM_SIZE);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  close(agent->fd);
+  return -1;
+}
+
+static void agent_close(struct agent *agent) {
+  munmap(agent->shm, AGENT_SHM_SIZE);
+  close(agent->fd); // drops the lock
+}
+
+// Connect to the agent of pid. Returns 1 if the process has no agent that
+// is running.
+static int agent_open(pid_t pid, struct agent *agent) {
+  pid_t inner = inner_pid(pid);
+  if (inner < 0) {
+    return -1;
+  }
+  char dirname[32];
+  snprintf(dirname, sizeof(dirname), "/proc/%d/fd", pid);
+  struct dir_reader dir;
+  if (dir_open(&dir, dirname)) {
+    perror(dirname);
+    return -1;
+  }
+  int ret = 1;
+  const char *entry;
+  while (ret == 1 && (entry = dir_next(&dir)) != NULL) {
+    char filename[PATH_MAX], link[64];
+    snprintf(filename, sizeof(filename), "%s/%s", dirname, entry);
+    ssize_t len = readlink(filename, link, sizeof(link) - 1);
+    if (len < 0) {
+      continue;
+    }
+    link[len] = '\0';
+    if (strcmp(link, "/memfd:" AGENT_NAME " (deleted)") != 0 ||
+        agent_map(pid, atoi(entry), agent)) {
+      continue;
+    }
+    struct agent_shm *shm = agent->shm;
+    if (shm->magic != AGENT_MAGIC || shm->pid != (uint64_t)inner ||
+        __atomic_load_n(&shm->tid, __ATOMIC_ACQUIRE) == 0) {
+      agent_close(agent);
+    } else if (shm->version != AGENT_VERSION) {
+      fprintf(stderr, "process %d has an agent of version %u, use --unload "
+              "with that version first\n", pid, shm->version);
+      agent_close(agent);
+      ret = -1;
+    } else {
+      ret = 0;
+    }
+  }
+  dir_close(&dir);
+  return ret;
+}
+
+// Post op to the agent and wait until it answers or exits. Returns the
+// status of the answer, or -1 if there is none.
+static int agent_call(struct agent *agent, uint32_t op) {
+  struct agent_shm *shm = agent->shm;
+  stats_start();
+  shm->op = op;
+  uint32_t request = shm->request + 1;
+  __atomic_store_n(&shm->request, request, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &shm->request, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+  struct timespec slice = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+  for (int waited = 0;; waited += 10) {
+    uint32_t response = __atomic_load_n(&shm->response, __ATOMIC_ACQUIRE);
+    if (response == request) {
+      stats_phase(REMOTE_PHASE_CALL);
+      return shm->status;
+    }
+    if (__atomic_load_n(&shm->tid, __ATOMIC_ACQUIRE) == 0) {
+      fprintf(stderr, "the agent has exited\n");
+      return -1;
+    }
+    if (waited >= (timeout_ms ? timeout_ms : AGENT_TIMEOUT)) {
+      fprintf(stderr, "the agent does not answer\n");
+      return -1;
+    }
+    syscall(SYS_futex, &shm->response, FUTEX_WAIT, response, &slice, NULL, 0);
+  }
+}
+
+// the record at *pos of an answer of the agent, or NULL if it is malformed
+static const char *agent_record(const struct agent_shm *shm, uint64_t *pos,
+                                uint32_t *len) {
+  uint64_t end = shm->len < AGENT_DATA_SIZE ? shm->len : AGENT_DATA_SIZE;
+  if (*pos + sizeof(uint32_t) > end) {
+    return NULL;
+  }
+  memmove(len, shm->data + *pos, sizeof(*len));
+  uint32_t size = *len == UINT32_MAX ? 0 : *len;
+  if (size > end - *pos - sizeof(uint32_t)) {
+    return NULL;
+  }
+  const char *s = shm->data + *pos + sizeof(uint32_t);
+  *pos = (*pos + sizeof(uint32_t) + size + 3) & ~(uint64_t)3;
+  return s;
+}
+
+// Release what an agent left in the remote process, which must be attached
+// and whose agent thread must not be running. Any of the addresses in shm
+// can be zero, and remote_fd can be -1, for parts that do not exist.
+static int agent_release(pid_t pid, int mem_fd, struct remote_arena *arena,
+                         const struct libc_symbols *syms,
+                         const struct user_regs_struct *oldregs,
+                         uint64_t code, uint64_t stack, uint64_t shm,
+                         int remote_fd, int *pending) {
+  struct payload payload = {.arena = arena};
+  emit_prologue(&payload);
+  uint64_t regions[][2] = {
+    {code, agent_code_size()}, {stack, AGENT_STACK_SIZE}, {shm, AGENT_SHM_SIZE},
+  };
+  for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+    if (regions[i][0] != 0) {
+      emit_mov_imm(&payload, RDI, regions[i][0]);
+      emit_mov_imm(&payload, RSI, regions[i][1]);
+      emit_syscall(&payload, 11); // munmap
+    }
+  }
+  if (remote_fd >= 0) {
+    emit_mov_imm(&payload, RDI, remote_fd);
+    emit_syscall(&payload, 3); // close
+  }
+  emit_epilogue(&payload, syms);
+  size_t len;
+  uint8_t *text = payload_finish(&payload, &len);
+  if (text == NULL) {
+    return -1;
+  }
+  struct user_regs_struct regs;
+  uintptr_t sp = (oldregs->rsp - 128) & ~(uintptr_t)15;
+  return run_payload(pid, mem_fd, syms, oldregs, text, len, sp, pending,
+                     &regs);
+}
+
+// Start the agent in pid, and connect to it.
+//
+// The installer creates the memfd and maps it, maps a copy of the agent code
+// and a stack for it, and starts the agent thread with raw clone(2), with
+// all signals blocked so they are never delivered to the agent. Every step
+// stores its result below the red zone, so if one fails we know what to
+// clean up. The new thread is not known to the libc of the process, and does
+// not use it, TLS included, which is why it is refused when the process has
+// mixed IDs, see mixed_ids().
+static int agent_install(pid_t pid, struct remote_arena *arena,
+                         struct agent *agent) {
+  int mixed = mixed_ids(pid);
+  if (mixed) {
+    if (mixed == 1) {
+      fprintf(stderr, "process %d has differing real, effective and saved "
+              "IDs, which the agent thread would not follow\n", pid);
+    }
+    return -1;
+  }
+  struct libc_symbols syms;
+  if (resolve_libc(pid, &syms)) {
+    return -1;
+  }
+  pid_t inner = inner_pid(pid);
+  if (inner < 0) {
+    return -1;
+  }
+
+  pid_t tid = pick_thread(pid);
+  if (attach_process(tid)) {
+    return -1;
+  }
+  struct user_regs_struct oldregs, regs;
+  if (do_ptrace(PTRACE_GETREGS, tid, NULL, &oldregs)) {
+    perror("PTRACE_GETREGS");
+    detach_process(tid, 0);
+    return -1;
+  }
+  int mem_fd = open_mem(tid);
+  int pending = 0;
+  uint64_t mask;
+  bool masked = block_signals(tid, &oldregs, &mask);
+  int ret = -1;
+
+  enum { FD, TRUNCATE, SHM, CODE, PROTECT, STACK, BLOCK, TID, NSTEPS };
+  int64_t out[NSTEPS];
+  uintptr_t sp = (oldregs.rsp - 128 - sizeof(out)) & ~(uintptr_t)15;
+  size_t code_size = agent_code_size();
+  static const uint64_t all_signals = ~(uint64_t)0;
+  static const uint8_t rep_movsb[] = {0xf3, 0xa4};
+
+  struct payload payload = {.arena = arena};
+  emit_prologue(&payload);
+  size_t name = payload_data(&payload, AGENT_NAME, sizeof(AGENT_NAME));
+  size_t blocked = payload_data(&payload, &all_signals, sizeof(all_signals));
+  size_t oldmask = payload_data(&payload, &all_signals, sizeof(all_signals));
+  size_t blob = payload_data(&payload, __start_getenv_agent,
+                             __stop_getenv_agent - __start_getenv_agent);
+  for (size_t i = 0; i < NSTEPS; i++) {
+    emit_mov_imm(&payload, RAX, 0);
+    emit_store_rax(&payload, sp + i * sizeof(out[0]));
+  }
+  // %r12 = memfd_create(AGENT_NAME, MFD_CLOEXEC)
+  emit_lea_data(&payload, RDI, name);
+  emit_mov_imm(&payload, RSI, MFD_CLOEXEC);
+  emit_syscall(&payload, SYS_memfd_create);
+  emit_store_rax(&payload, sp + FD * sizeof(out[0]));
+  emit_check(&payload);
+  emit_mov_reg(&payload, R12, RAX);
+  // ftruncate(%r12, AGENT_SHM_SIZE)
+  emit_mov_reg(&payload, RDI, R12);
+  emit_mov_imm(&payload, RSI, AGENT_SHM_SIZE);
+  emit_syscall(&payload, SYS_ftruncate);
+  emit_store_rax(&payload, sp + TRUNCATE * sizeof(out[0]));
+  emit_check(&payload);
+  // %r13 = mmap(NULL, AGENT_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+  //             %r12, 0)
+  emit_mov_imm(&payload, RDI, 0);
+  emit_mov_imm(&payload, RSI, AGENT_SHM_SIZE);
+  emit_mov_imm(&payload, RDX, PROT_READ | PROT_WRITE);
+  emit_mov_imm(&payload, R10, MAP_SHARED);
+  emit_mov_reg(&payload, R8, R12);
+  emit_mov_imm(&payload, R9, 0);
+  emit_syscall(&payload, SYS_mmap);
+  emit_store_rax(&payload, sp + SHM * sizeof(out[0]));
+  emit_check(&payload);
+  emit_mov_reg(&payload, R13, RAX);
+  // %r14 = mmap(NULL, code_size, PROT_READ | PROT_WRITE,
+  //             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0), copy the agent there
+  //             and make it executable
+  emit_mov_imm(&payload, RDI, 0);
+  emit_mov_imm(&payload, RSI, code_size);
+  emit_mov_imm(&payload, RDX, PROT_READ | PROT_WRITE);
+  emit_mov_imm(&payload, R10, MAP_PRIVATE | MAP_ANONYMOUS);
+  emit_mov_imm(&payload, R8, -1);
+  emit_mov_imm(&payload, R9, 0);
+  emit_syscall(&payload, SYS_mmap);
+  emit_store_rax(&payload, sp + CODE * sizeof(out[0]));
+  emit_check(&payload);
+  emit_mov_reg(&payload, R14, RAX);
+  emit_mov_reg(&payload, RDI, R14);
+  emit_lea_data(&payload, RSI, blob);
+  emit_mov_imm(&payload, RCX, __stop_getenv_agent - __start_getenv_agent);
+  emit(&payload, rep_movsb, sizeof(rep_movsb));
+  emit_mov_reg(&payload, RDI, R14);
+  emit_mov_imm(&payload, RSI, code_size);
+  emit_mov_imm(&payload, RDX, PROT_READ | PROT_EXEC);
+  emit_syscall(&payload, SYS_mprotect);
+  emit_store_rax(&payload, sp + PROTECT * sizeof(out[0]));
+  emit_check(&payload);
+  // %r15 = mmap(NULL, AGENT_STACK_SIZE, PROT_READ | PROT_WRITE,
+  //             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0), with the
+  //             address of the shared memory on top
+  emit_mov_imm(&payload, RDI, 0);
+  emit_mov_imm(&payload, RSI, AGENT_STACK_SIZE);
+  emit_mov_imm(&payload, RDX, PROT_READ | PROT_WRITE);
+  emit_mov_imm(&payload, R10, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK);
+  emit_mov_imm(&payload, R8, -1);
+  emit_mov_imm(&payload, R9, 0);
+  emit_syscall(&payload, SYS_mmap);
+  emit_store_rax(&payload, sp + STACK * sizeof(out[0]));
+  emit_check(&payload);
+  emit_mov_reg(&payload, R15, RAX);
+  emit_store(&payload, R15, AGENT_STACK_SIZE - 16, R13);
+  // rt_sigprocmask(SIG_SETMASK, &all_signals, &oldmask, 8)
+  emit_mov_imm(&payload, RDI, SIG_SETMASK);
+  emit_lea_data(&payload, RSI, blocked);
+  emit_lea_data(&payload, RDX, oldmask);
+  emit_mov_imm(&payload, R10, sizeof(all_signals));
+  emit_syscall(&payload, SYS_rt_sigprocmask);
+  emit_store_rax(&payload, sp + BLOCK * sizeof(out[0]));
+  emit_check(&payload);
+  // clone(CLONE_VM | ..., %r15 + AGENT_STACK_SIZE - 16, &shm->tid,
+  //       &shm->tid, 0) through agent_clone, whose result is not checked,
+  //       so the signal mask is restored either way
+  emit_mov_imm(&payload, RDI,
+               CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+               CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID |
+               CLONE_CHILD_CLEARTID);
+  emit_lea(&payload, RSI, R15, AGENT_STACK_SIZE - 16);
+  emit_lea(&payload, RDX, R13, offsetof(struct agent_shm, tid));
+  emit_lea(&payload, R10, R13, offsetof(struct agent_shm, tid));
+  emit_mov_imm(&payload, R8, 0);
+  emit_lea(&payload, RCX, R14, agent_clone - __start_getenv_agent);
+  emit_mov_imm(&payload, RAX, SYS_clone);
+  static const uint8_t call_rcx[] = {0xff, 0xd1};
+  emit(&payload, call_rcx, sizeof(call_rcx));
+  emit_store_rax(&payload, sp + TID * sizeof(out[0]));
+  // rt_sigprocmask(SIG_SETMASK, &oldmask, NULL, 8)
+  emit_mov_imm(&payload, RDI, SIG_SETMASK);
+  emit_lea_data(&payload, RSI, oldmask);
+  emit_mov_imm(&payload, RDX, 0);
+  emit_mov_imm(&payload, R10, sizeof(all_signals));
+  emit_syscall(&payload, SYS_rt_sigprocmask);
+  emit_epilogue(&payload, &syms);
+
+  size_t len;
+  uint8_t *text = payload_finish(&payload, &len);
+  if (text == NULL) {
+    goto out;
+  }
+  if (run_payload(tid, mem_fd, &syms, &oldregs, text, len, sp, &pending,
+                  &regs)) {
+    goto out;
+  }
+  if (read_remote(tid, (void *)sp, out, sizeof(out)) != sizeof(out)) {
+    fprintf(stderr, "cannot read the results of the installer\n");
+    goto out;
+  }
+  #ifdef DEBUG
+  for (size_t i = 0; i < NSTEPS; i++) {
+    fprintf(stderr, "installer step %zu returned %lld\n", i,
+            (long long)out[i]);
+  }
+  #endif
+  for (size_t i = 0; i < NSTEPS; i++) {
+    if (out[i] < 0 && out[i] >= -4095) {
+      fprintf(stderr, "failed to install the agent: step %zu: %s\n", i,
+              strerror(-out[i]));
+      break;
+    }
+  }
+  if (regs.rbx != 1 || out[TID] <= 0) {
+    // The thread did not start, so take everything down again. The results
+    // of steps that did not run are zero, and so are skipped.
+    agent_release(tid, mem_fd, arena, &syms, &oldregs,
+                  out[CODE] > 0 ? out[CODE] : 0,
+                  out[STACK] > 0 ? out[STACK] : 0,
+                  out[SHM] > 0 ? out[SHM] : 0,
+                  out[FD] > 0 ? out[FD] : -1, &pending);
+    goto out;
+  }
+
+  // The agent is running, and waits for its first request. Fill in the
+  // header, which makes it visible to other clients.
+  if (agent_map(pid, out[FD], agent)) {
+    goto out;
+  }
+  struct agent_shm *shm = agent->shm;
+  shm->environ = syms.environ;
+  shm->pid = inner;
+  shm->code = out[CODE];
+  shm->stack = out[STACK];
+  shm->shm = out[SHM];
+  shm->version = AGENT_VERSION;
+  __atomic_store_n(&shm->magic, AGENT_MAGIC, __ATOMIC_RELEASE);
+  #ifdef DEBUG
+  fprintf(stderr, "started agent thread %lld\n", (long long)out[TID]);
+  #endif
+  ret = 0;
+
+out:
+  if (do_ptrace(PTRACE_SETREGS, tid, NULL, &oldregs) == 0) {
+    set_exitkill(tid, false);
+  } else {
+    perror("PTRACE_SETREGS");
+  }
+  if (masked) {
+    unblock_signals(tid, mask);
+  }
+  stats_phase(REMOTE_PHASE_RESTORE);
+  if (mem_fd >= 0) {
+    close(mem_fd);
+  }
+  detach_process(tid, pending);
+  stats_phase(REMOTE_PHASE_DETACH);
+  return ret;
+}
+
+// connect to the agent of pid, starting it first if there is none
+static int agent_connect(pid_t pid, struct remote_arena *arena,
+                         struct agent *agent) {
+  int ret = agent_open(pid, agent);
+  if (ret == 1) {
+    ret = agent_install(pid, arena, agent);
+  }
+  return ret;
+}
+
+// copy a record of size bytes from the shared memory into a result
+static int agent_copy(struct remote_arena *arena, const char *s,
+                      uint32_t size, struct remote_value *out) {
+  char *copy = arena_alloc(arena, (size_t)size + 1);
+  if (copy == NULL) {
+    return -1;
+  }
+  memmove(copy, s, size);
+  copy[size] = '\0';
+  out->value = copy;
+  out->len = size;
+  return 0;
+}
+
+// getenv_process() through the resident agent
+static int agent_getenv(pid_t pid, const char *const *names, size_t n,
+                        struct remote_arena *arena,
+                        struct remote_value *results) {
+  struct agent agent;
+  if (agent_connect(pid, arena, &agent)) {
+    return -1;
+  }
+  struct agent_shm *shm = agent.shm;
+  int ret = -1;
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t size = strlen(names[i]) + 1;
+    if (len + size > AGENT_DATA_SIZE / 2) {
+      fprintf(stderr, "too many variables for the agent\n");
+      goto out;
+    }
+    memmove(shm->data + len, names[i], size);
+    len += size;
+  }
+  shm->len = len;
+  shm->count = n;
+  int status = agent_call(&agent, AGENT_GET);
+  if (status != AGENT_OK) {
+    if (status == AGENT_EAGAIN) {
+      fprintf(stderr, "the environment kept changing under the agent\n");
+    } else if (status == AGENT_EPERM) {
+      fprintf(stderr, "the IDs of process %d changed, so its agent exited\n",
+              pid);
+    } else if (status > 0) {
+      fprintf(stderr, "the agent failed with status %d\n", status);
+    }
+    goto out;
+  }
+  uint64_t pos = (len + 3) & ~(uint64_t)3;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t size;
+    const char *value = agent_record(shm, &pos, &size);
+    if (value == NULL) {
+      fprintf(stderr, "malformed answer from the agent\n");
+      goto out;
+    }
+    results[i] = (struct remote_value){0};
+    if (size != UINT32_MAX && agent_copy(arena, value, size, &results[i])) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+out:
+  agent_close(&agent);
+  return ret;
+}
+
+// dump_process() through the resident agent
+static int agent_dump(pid_t pid, struct remote_arena *arena,
+                      struct remote_value **vars, size_t *count) {
+  struct agent agent;
+  if (agent_connect(pid, arena, &agent)) {
+    return -1;
+  }
+  struct agent_shm *shm = agent.shm;
+  int ret = -1;
+  int status = agent_call(&agent, AGENT_DUMP);
+  if (status != AGENT_OK) {
+    if (status == AGENT_E2BIG) {
+      fprintf(stderr, "the environment is too large for the agent\n");
+    } else if (status == AGENT_EAGAIN) {
+      fprintf(stderr, "the environment kept changing under the agent\n");
+    } else if (status == AGENT_EPERM) {
+      fprintf(stderr, "the IDs of process %d changed, so its agent exited\n",
+              pid);
+    } else if (status > 0) {
+      fprintf(stderr, "the agent failed with status %d\n", status);
+    }
+    goto out;
+  }
+  *count = shm->count;
+  *vars = arena_alloc(arena, *count * sizeof(struct remote_value));
+  if (*vars == NULL) {
+    goto out;
+  }
+  uint64_t pos = 0;
+  for (size_t i = 0; i < *count; i++) {
+    uint32_t size;
+    const char *var = agent_record(shm, &pos, &size);
+    if (var == NULL || size == UINT32_MAX) {
+      fprintf(stderr, "malformed answer from the agent\n");
+      goto out;
+    }
+    if (agent_copy(arena, var, size, &(*vars)[i])) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+out:
+  agent_close(&agent);
+  return ret;
+}
+
+// Stop the agent of pid, and release everything it uses in the process.
+static int agent_unload(pid_t pid) {
+  struct agent agent;
+  int ret = agent_open(pid, &agent);
+  if (ret == 1) {
+    fprintf(stderr, "process %d has no agent\n", pid);
+  }
+  if (ret) {
+    return -1;
+  }
+  struct agent_shm *shm = agent.shm;
+  ret = -1;
+  if (agent_call(&agent, AGENT_EXIT) != AGENT_OK) {
+    goto out;
+  }
+  // wait for the thread to be gone before its code and stack are unmapped
+  struct timespec slice = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+  uint32_t agent_tid;
+  for (int waited = 0;
+       (agent_tid = __atomic_load_n(&shm->tid, __ATOMIC_ACQUIRE)) != 0;
+       waited += 10) {
+    if (waited >= AGENT_TIMEOUT) {
+      fprintf(stderr, "the agent does not exit\n");
+      goto out;
+    }
+    syscall(SYS_futex, &shm->tid, FUTEX_WAIT, agent_tid, &slice, NULL, 0);
+  }
+
+  struct libc_symbols syms;
+  if (resolve_libc(pid, &syms)) {
+    goto out;
+  }
+  pid_t tid = pick_thread(pid);
+  if (attach_process(tid)) {
+    goto out;
+  }
+  struct user_regs_struct oldregs;
+  if (do_ptrace(PTRACE_GETREGS, tid, NULL, &oldregs)) {
+    perror("PTRACE_GETREGS");
+    detach_process(tid, 0);
+    goto out;
+  }
+  int mem_fd = open_mem(tid);
+  int pending = 0;
+  uint64_t mask;
+  bool masked = block_signals(tid, &oldregs, &mask);
+  // the payload takes a page for its code, and its buffers take the rest
+  char buf[3 * PAGE_SIZE];
+  struct remote_arena arena = {.base = buf, .size = sizeof(buf)};
+  ret = agent_release(tid, mem_fd, &arena, &syms, &oldregs, shm->code,
+                      shm->stack, shm->shm, agent.remote_fd, &pending);
+  if (do_ptrace(PTRACE_SETREGS, tid, NULL, &oldregs) == 0) {
+    set_exitkill(tid, false);
+  } else {
+    perror("PTRACE_SETREGS");
+    ret = -1;
+  }
+  if (masked && unblock_signals(tid, mask)) {
+    ret = -1;
+  }
+  stats_phase(REMOTE_PHASE_RESTORE);
+  if (mem_fd >= 0) {
+    close(mem_fd);
+  }
+  if (detach_process(tid, pending)) {
+    ret = -1;
+  }
+  stats_phase(REMOTE_PHASE_DETACH);
+
+out:
+  agent_close(&agent);
+  return ret;
+}
+
+// The mirror is a copy of the environment of a process that is kept in a
+// BPF hash map, and kept up to date by uprobes on its setenv, unsetenv,
+// putenv and clearenv: each call sends its arguments to a ring buffer, and
+// every query first applies whatever is in the ring to the map, then looks
+// the names up there, so the process is never stopped. The maps and the
+// links of the uprobes are pinned in MIRROR_ROOT/<pid>, where they stay
+// until remote_unmirror(), and where any later run can find them. Only one
+// client may use a mirror at a time, which is enforced with flock(2) on
+// that directory. A value that does not fit in the map, or an event that
+// the ring had no room for, does not get lost: the former is marked as too
+// long, which makes the query fall back to the other ways of reading the
+// environment, and the latter makes the next query seed the map again.
+#define MIRROR_ROOT "/sys/fs/bpf/getenv"
+#define MIRROR_NAME_MAX 256
+#define MIRROR_VALUE_MAX 2048
+#define MIRROR_VARS_MAX 16384
+#define MIRROR_RING_SIZE (4 * 1024 * 1024)
+// the length of a value that was too long for the map
+#define MIRROR_TOO_LONG UINT32_MAX
+#define MIRROR_PROG_MAX 64
+
+enum mirror_call {
+  MIRROR_SETENV,
+  MIRROR_UNSETENV,
+  MIRROR_PUTENV,
+  MIRROR_CLEARENV,
+  MIRROR_CALLS,
+};
+
+// the pins of the links, one for each call
+static const char *const mirror_calls[MIRROR_CALLS] = {
+  "setenv", "unsetenv", "putenv", "clearenv",
+};
+
+// the slots of the info array
+enum mirror_info {
+  MIRROR_DROPS, // events the ring had no room for, counted by the probes
+  MIRROR_SEEN,  // MIRROR_DROPS when the map was last seeded
+  MIRROR_START, // the start time of the process, to tell a reused pid
+  MIRROR_STALE, // set when the map has to be seeded again
+  MIRROR_BASE,  // where libc is mapped, which changes when the process execs
+  MIRROR_INFO,
+};
+
+// What a probe sends: the string lengths are what bpf_probe_read_user_str
+// returned, so they count the NUL, and are negative if the read failed. For
+// putenv, the whole string is in value.
+struct mirror_event {
+  uint32_t call;
+  uint32_t overwrite;
+  int32_t name_len;
+  int32_t value_len;
+  char name[MIRROR_NAME_MAX];
+  char value[MIRROR_VALUE_MAX];
+};
+
+// a value in the map, keyed by the name padded with NULs to MIRROR_NAME_MAX
+struct mirror_value {
+  uint32_t len;
+  char value[MIRROR_VALUE_MAX];
+};
+
+static long sys_bpf(int cmd, union bpf_attr *attr) {
+  return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_lookup(int fd, const void *key, void *value) {
+  union bpf_attr attr = {
+    .map_fd = fd, .key = (uintptr_t)key, .value = (uintptr_t)value,
+  };
+  return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static int map_update(int fd, const void *key, const void *value,
+                      uint64_t flags) {
+  union bpf_attr attr = {
+    .map_fd = fd, .key = (uintptr_t)key, .value = (uintptr_t)value,
+    .flags = flags,
+  };
+  return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_delete(int fd, const void *key) {
+  union bpf_attr attr = {.map_fd = fd, .key = (uintptr_t)key};
+  return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+// the key after key, or the first one if key is NULL
+static int map_next_key(int fd, const void *key, void *next) {
+  union bpf_attr attr = {
+    .map_fd = fd, .key = (uintptr_t)key, .next_key = (uintptr_t)next,
+  };
+  return sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+static uint64_t mirror_info(int info_fd, enum mirror_info slot) {
+  uint32_t key = slot;
+  uint64_t value = 0;
+  map_lookup(info_fd, &key, &value);
+  return value;
+}
+
+static int mirror_set_info(int info_fd, enum mirror_info slot,
+                           uint64_t value) {
+  uint32_t key = slot;
+  if (map_update(info_fd, &key, &value, BPF_ANY)) {
+    perror("BPF_MAP_UPDATE_ELEM");
+    return -1;
+  }
+  return 0;
+}
+
+// the start time of pid, in clock ticks after boot
+static int process_start(pid_t pid, uint64_t *start) {
+  char filename[64], buf[1024];
+  snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+  if (read_file(filename, buf, sizeof(buf)) < 0) {
+    perror(filename);
+    return -1;
+  }
+  // the fields after the name, which may contain anything, start at 3
+  char *field = strrchr(buf, ')');
+  for (int k = 2; field != NULL && k < 22; k++) {
+    field = strchr(field + 1, ' ');
+  }
+  if (field == NULL) {
+    fprintf(stderr, "malformed %s\n", filename);
+    return -1;
+  }
+  *start = strtoull(field + 1, NULL, 10);
+  return 0;
+}
+
+// a BPF program under construction
+struct bpf_code {
+  struct bpf_insn insns[MIRROR_PROG_MAX];
+  size_t n;
+};
+
+static void bpf_emit(struct bpf_code *c, uint8_t code, uint8_t dst,
+                     uint8_t src, int16_t off, int32_t imm) {
+  assert(c->n < MIRROR_PROG_MAX);
+  c->insns[c->n++] = (struct bpf_insn){
+    .code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm,
+  };
+}
+
+// load the address of the map fd into reg
+static void bpf_emit_map(struct bpf_code *c, uint8_t reg, int fd) {
+  bpf_emit(c, BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, fd);
+  bpf_emit(c, 0, 0, 0, 0, 0);
+}
+
+// read the string that the argument at arg of the registers (in r6) points
+// to into the event (in r7), and store the length of what was read
+static void bpf_emit_read(struct bpf_code *c, size_t arg, size_t buf,
+                          size_t size, size_t len) {
+  bpf_emit(c, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+  bpf_emit(c, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, buf);
+  bpf_emit(c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, size);
+  bpf_emit(c, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_3, BPF_REG_6, arg, 0);
+  bpf_emit(c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_probe_read_user_str);
+  bpf_emit(c, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_0, len, 0);
+}
+
+// Load the probe for call, which sends its arguments to the ring, or counts
+// a drop in the info array if the ring is full. The registers at the entry
+// of the function are in the pt_regs that the program gets, which has the
+// same layout as user_regs_struct.
+static int mirror_prog(enum mirror_call call, int ring_fd, int info_fd) {
+  struct bpf_code c = {.n = 0};
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  bpf_emit_map(&c, BPF_REG_1, ring_fd);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0,
+           sizeof(struct mirror_event));
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0);
+  bpf_emit(&c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_reserve);
+  size_t reserved = c.n; // jumps to the drop, patched below
+  bpf_emit(&c, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0);
+  bpf_emit(&c, BPF_ST | BPF_MEM | BPF_W, BPF_REG_7, 0,
+           offsetof(struct mirror_event, call), call);
+  bpf_emit(&c, BPF_ST | BPF_MEM | BPF_W, BPF_REG_7, 0,
+           offsetof(struct mirror_event, name_len), 0);
+  bpf_emit(&c, BPF_ST | BPF_MEM | BPF_W, BPF_REG_7, 0,
+           offsetof(struct mirror_event, value_len), 0);
+  if (call == MIRROR_SETENV) {
+    bpf_emit(&c, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_6,
+             offsetof(struct user_regs_struct, rdx), 0);
+    bpf_emit(&c, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_1,
+             offsetof(struct mirror_event, overwrite), 0);
+  }
+  if (call == MIRROR_SETENV || call == MIRROR_UNSETENV) {
+    bpf_emit_read(&c, offsetof(struct user_regs_struct, rdi),
+                  offsetof(struct mirror_event, name), MIRROR_NAME_MAX,
+                  offsetof(struct mirror_event, name_len));
+  }
+  if (call == MIRROR_SETENV || call == MIRROR_PUTENV) {
+    bpf_emit_read(&c, call == MIRROR_SETENV
+                          ? offsetof(struct user_regs_struct, rsi)
+                          : offsetof(struct user_regs_struct, rdi),
+                  offsetof(struct mirror_event, value), MIRROR_VALUE_MAX,
+                  offsetof(struct mirror_event, value_len));
+  }
+  // nobody waits on the ring, so there is no one to wake up
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0,
+           BPF_RB_NO_WAKEUP);
+  bpf_emit(&c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_submit);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+  bpf_emit(&c, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  c.insns[reserved].off = c.n - reserved - 1;
+  bpf_emit(&c, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, MIRROR_DROPS);
+  bpf_emit_map(&c, BPF_REG_1, info_fd);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  bpf_emit(&c, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+  bpf_emit(&c, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  bpf_emit(&c, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1);
+  bpf_emit(&c, BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_1, 0,
+           BPF_ADD);
+  bpf_emit(&c, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+  bpf_emit(&c, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  union bpf_attr attr = {
+    .prog_type = BPF_PROG_TYPE_KPROBE,
+    .insns = (uintptr_t)c.insns,
+    .insn_cnt = c.n,
+    // bpf_probe_read_user_str() is only there for GPL compatible programs
+    .license = (uintptr_t)"Dual BSD/GPL",
+  };
+  strncpy(attr.prog_name, mirror_calls[call], sizeof(attr.prog_name) - 1);
+  #ifdef DEBUG
+  static char log[65536];
+  attr.log_buf = (uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+  #endif
+  int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (fd < 0) {
+    perror("BPF_PROG_LOAD");
+    #ifdef DEBUG
+    fprintf(stderr, "%s", log);
+    #endif
+  }
+  return fd;
+}
+
+// the type of the uprobe PMU, for perf_event_open(2)
+static int uprobe_type(void) {
+  static const char *filename = "/sys/bus/event_source/devices/uprobe/type";
+  char buf[32];
+  if (read_file(filename, buf, sizeof(buf)) <= 0) {
+    perror(filename);
+    return -1;
+  }
+  return atoi(buf);
+}
+
+// Attach prog to a uprobe at offset in the file at path, for pid only, and
+// pin the link at pin. The perf event goes away with the link.
+static int mirror_attach(pid_t pid, int type, const char *path,
+                         uint64_t offset, int prog_fd, const char *pin) {
+  struct perf_event_attr pattr = {
+    .size = sizeof(pattr),
+    .type = type,
+    .config1 = (uintptr_t)path,
+    .config2 = offset,
+  };
+  int event_fd = syscall(SYS_perf_event_open, &pattr, pid, -1, -1,
+                         PERF_FLAG_FD_CLOEXEC);
+  if (event_fd < 0) {
+    perror("perf_event_open");
+    return -1;
+  }
+  union bpf_attr attr = {
+    .link_create = {
+      .prog_fd = prog_fd,
+      .target_fd = event_fd,
+      .attach_type = BPF_PERF_EVENT,
+    },
+  };
+  int link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+  close(event_fd);
+  if (link_fd < 0) {
+    perror("BPF_LINK_CREATE");
+    return -1;
+  }
+  attr = (union bpf_attr){.pathname = (uintptr_t)pin, .bpf_fd = link_fd};
+  int ret = sys_bpf(BPF_OBJ_PIN, &attr);
+  if (ret) {
+    perror(pin);
+  }
+  close(link_fd);
+  return ret;
+}
+
+// create a map and pin it at dir/name
+static int mirror_map(const char *dir, const char *name, uint32_t type,
+                      uint32_t key_size, uint32_t value_size,
+                      uint32_t max_entries, uint32_t flags) {
+  union bpf_attr attr = {
+    .map_type = type,
+    .key_size = key_size,
+    .value_size = value_size,
+    .max_entries = max_entries,
+    .map_flags = flags,
+  };
+  int fd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (fd < 0) {
+    perror("BPF_MAP_CREATE");
+    return -1;
+  }
+  char pin[PATH_MAX];
+  snprintf(pin, sizeof(pin), "%s/%s", dir, name);
+  attr = (union bpf_attr){.pathname = (uintptr_t)pin, .bpf_fd = fd};
+  if (sys_bpf(BPF_OBJ_PIN, &attr)) {
+    perror(pin);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// open the object pinned at dir/name
+static int mirror_get(const char *dir, const char *name) {
+  char pin[PATH_MAX];
+  snprintf(pin, sizeof(pin), "%s/%s", dir, name);
+  union bpf_attr attr = {.pathname = (uintptr_t)pin};
+  return sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+// unpin everything in dir, which detaches the probes, and remove it
+static int mirror_remove(const char *dir) {
+  static const char *const maps[] = {"ring", "vars", "info"};
+  char pin[PATH_MAX];
+  for (size_t k = 0; k < MIRROR_CALLS; k++) {
+    snprintf(pin, sizeof(pin), "%s/%s", dir, mirror_calls[k]);
+    unlink(pin);
+  }
+  for (size_t k = 0; k < sizeof(maps) / sizeof(maps[0]); k++) {
+    snprintf(pin, sizeof(pin), "%s/%s", dir, maps[k]);
+    unlink(pin);
+  }
+  if (rmdir(dir)) {
+    perror(dir);
+    return -1;
+  }
+  return 0;
+}
+
+// a connection to the mirror of a process
+struct mirror {
+  int dir_fd; // locked with flock(2)
+  int ring_fd, vars_fd, info_fd;
+  uint64_t *consumer;       // the consumer position of the ring
+  const uint64_t *producer; // and its producer position, followed by
+  const uint8_t *data;      // the data, mapped twice in a row
+};
+
+static void mirror_close(struct mirror *m) {
+  long page = sysconf(_SC_PAGESIZE);
+  munmap(m->consumer, page);
+  munmap((void *)m->producer, page + 2 * MIRROR_RING_SIZE);
+  close(m->ring_fd);
+  close(m->vars_fd);
+  close(m->info_fd);
+  close(m->dir_fd); // drops the lock
+}
+
+// Connect to the mirror of pid. Returns 1 if it has none, which is also the
+// case if its pins are left over from an earlier process with the same pid,
+// or from before the process ran execve(2), which replaces the environment
+// and maybe libc; those are removed. The start time stays the same over an
+// exec, so that is told by the base address of libc, which is randomized;
+// a process that runs without ASLR can exec unnoticed.
+static int mirror_open(pid_t pid, struct mirror *m) {
+  long page = sysconf(_SC_PAGESIZE);
+  char dir[64];
+  snprintf(dir, sizeof(dir), MIRROR_ROOT "/%d", pid);
+  m->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (m->dir_fd < 0) {
+    if (errno == ENOENT) {
+      return 1;
+    }
+    perror(dir);
+    return -1;
+  }
+  if (flock(m->dir_fd, LOCK_EX)) {
+    perror("flock");
+    close(m->dir_fd);
+    return -1;
+  }
+  // a mirror that was removed while we waited for the lock is gone
+  m->ring_fd = mirror_get(dir, "ring");
+  m->vars_fd = mirror_get(dir, "vars");
+  m->info_fd = mirror_get(dir, "info");
+  m->consumer = MAP_FAILED;
+  m->producer = MAP_FAILED;
+  int ret = 1;
+  if (m->ring_fd < 0 || m->vars_fd < 0 || m->info_fd < 0) {
+    goto fail;
+  }
+  uint64_t start;
+  struct library lib;
+  if (process_start(pid, &start) || find_library(pid, libc_string, &lib)) {
+    ret = -1;
+    goto fail;
+  }
+  if (mirror_info(m->info_fd, MIRROR_START) != start ||
+      mirror_info(m->info_fd, MIRROR_BASE) != lib.base) {
+    mirror_remove(dir);
+    goto fail;
+  }
+  m->consumer = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     m->ring_fd, 0);
+  m->producer = mmap(NULL, page + 2 * MIRROR_RING_SIZE, PROT_READ,
+                     MAP_SHARED, m->ring_fd, page);
+  if (m->consumer == MAP_FAILED || m->producer == MAP_FAILED) {
+    perror("mmap");
+    ret = -1;
+    goto fail;
+  }
+  m->data = (const uint8_t *)m->producer + page;
+  return 0;
+
+fail:
+  if (m->consumer != MAP_FAILED) {
+    munmap(m->consumer, page);
+  }
+  if (m->producer != MAP_FAILED) {
+    munmap((void *)m->producer, page + 2 * MIRROR_RING_SIZE);
+  }
+  close(m->ring_fd);
+  close(m->vars_fd);
+  close(m->info_fd);
+  close(m->dir_fd);
+  return ret;
+}
+
+// Set up the mirror of pid: create the maps, attach the probes and pin it
+// all, marked as stale so that the first query seeds the map. Everything is
+// made in a directory of our own first and then renamed into place, so that
+// nobody sees a half made mirror; if another run was faster, theirs is used.
+static int mirror_install(pid_t pid) {
+  struct library lib;
+  struct libc_symbols syms;
+  uint64_t start;
+  int type = uprobe_type();
+  if (type < 0 || process_start(pid, &start) ||
+      resolve_libc_library(pid, &lib, &syms)) {
+    return -1;
+  }
+  if (mkdir(MIRROR_ROOT, 0700) && errno != EEXIST) {
+    perror(MIRROR_ROOT);
+    fprintf(stderr, "is a bpf filesystem mounted on /sys/fs/bpf?\n");
+    return -1;
+  }
+  char tmp[64], dir[64];
+  snprintf(tmp, sizeof(tmp), MIRROR_ROOT "/new-%d-%d", pid, getpid());
+  snprintf(dir, sizeof(dir), MIRROR_ROOT "/%d", pid);
+  if (mkdir(tmp, 0700)) {
+    perror(tmp);
+    return -1;
+  }
+  int ret = -1;
+  int ring_fd = mirror_map(tmp, "ring", BPF_MAP_TYPE_RINGBUF, 0, 0,
+                           MIRROR_RING_SIZE, 0);
+  int vars_fd = mirror_map(tmp, "vars", BPF_MAP_TYPE_HASH, MIRROR_NAME_MAX,
+                           sizeof(struct mirror_value), MIRROR_VARS_MAX,
+                           BPF_F_NO_PREALLOC);
+  int info_fd = mirror_map(tmp, "info", BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                           sizeof(uint64_t), MIRROR_INFO, 0);
+  if (ring_fd < 0 || vars_fd < 0 || info_fd < 0 ||
+      mirror_set_info(info_fd, MIRROR_START, start) ||
+      mirror_set_info(info_fd, MIRROR_BASE, lib.base) ||
+      mirror_set_info(info_fd, MIRROR_STALE, 1)) {
+    goto out;
+  }
+
+  // the probes go on the file that the process has mapped, through its
+  // map_files entry, or its root if that is not there
+  char path[PATH_MAX + 32];
+  snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx", pid,
+           (unsigned long)lib.text, (unsigned long)lib.text_end);
+  if (access(path, F_OK)) {
+    snprintf(path, sizeof(path), "/proc/%d/root%s", pid, lib.path);
+  }
+  const uintptr_t addrs[MIRROR_CALLS] = {
+    syms.setenv, syms.unsetenv, syms.putenv, syms.clearenv,
+  };
+  for (size_t k = 0; k < MIRROR_CALLS; k++) {
+    char pin[PATH_MAX];
+    snprintf(pin, sizeof(pin), "%s/%s", tmp, mirror_calls[k]);
+    int prog_fd = mirror_prog(k, ring_fd, info_fd);
+    if (prog_fd < 0) {
+      goto out;
+    }
+    int err = mirror_attach(pid, type, path,
+                            addrs[k] - lib.text + lib.text_offset, prog_fd,
+                            pin);
+    close(prog_fd);
+    if (err) {
+      goto out;
+    }
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "mirror probes on     %s\n", path);
+  #endif
+
+  if (rename(tmp, dir) == 0) {
+    ret = 0;
+  } else if (errno == EEXIST || errno == ENOTEMPTY) {
+    ret = 0; // theirs stays, ours goes
+  } else {
+    perror(dir);
+  }
+
+out:
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+  if (vars_fd >= 0) {
+    close(vars_fd);
+  }
+  if (info_fd >= 0) {
+    close(info_fd);
+  }
+  if (access(tmp, F_OK) == 0) {
+    mirror_remove(tmp);
+  }
+  return ret;
+}
+
+// delete every variable in the map
+static void mirror_clear(struct mirror *m) {
+  char key[MIRROR_NAME_MAX];
+  while (map_next_key(m->vars_fd, NULL, key) == 0) {
+    map_delete(m->vars_fd, key);
+  }
+}
+
+// Apply one event to the map, like the call it is from does to the
+// environment. Calls that fail, like a setenv of a name with a '=', change
+// nothing, and names that are too long to be asked for are not kept.
+static void mirror_apply(struct mirror *m, const struct mirror_event *e) {
+  const char *name = e->name, *value = NULL;
+  int32_t name_len = e->name_len - 1, value_len = e->value_len - 1;
+  bool overwrite = true;
+  if (e->call == MIRROR_CLEARENV) {
+    mirror_clear(m);
+    return;
+  }
+  if (name_len < 0 || (e->call != MIRROR_UNSETENV && value_len < 0)) {
+    goto stale; // the probe could not read the strings
+  }
+  if (e->call == MIRROR_SETENV) {
+    value = e->value;
+    overwrite = e->overwrite != 0;
+  } else if (e->call == MIRROR_PUTENV) {
+    // putenv("VAR") unsets VAR
+    name = e->value;
+    const char *eq = memchr(name, '=', value_len);
+    if (eq == NULL && e->value_len == MIRROR_VALUE_MAX) {
+      goto stale; // truncated before we know what it is
+    }
+    name_len = eq == NULL ? value_len : eq - name;
+    if (eq != NULL) {
+      value = eq + 1;
+      value_len -= name_len + 1;
+    }
+  }
+  if (name_len == 0 || name_len >= MIRROR_NAME_MAX - 1 ||
+      memchr(name, '=', name_len) != NULL) {
+    return;
+  }
+  char key[MIRROR_NAME_MAX] = {0};
+  memmove(key, name, name_len);
+  if (value == NULL) {
+    map_delete(m->vars_fd, key);
+    return;
+  }
+  struct mirror_value v;
+  // a value read into its whole buffer may have been cut off
+  v.len = e->value_len == MIRROR_VALUE_MAX ? MIRROR_TOO_LONG : value_len;
+  memmove(v.value, value, value_len);
+  if (map_update(m->vars_fd, key, &v, overwrite ? BPF_ANY : BPF_NOEXIST) ==
+      0 || errno == EEXIST) {
+    return;
+  }
+
+stale:
+  mirror_set_info(m->info_fd, MIRROR_STALE, 1);
+}
+
+// Apply the events in the ring to the map, or throw them away if apply is
+// false. The data is mapped twice in a row, so a record is never split.
+static void mirror_drain(struct mirror *m, bool apply) {
+  uint64_t consumer = __atomic_load_n(m->consumer, __ATOMIC_ACQUIRE);
+  uint64_t producer = __atomic_load_n(m->producer, __ATOMIC_ACQUIRE);
+  while (consumer < producer) {
+    const uint8_t *record = m->data + (consumer & (MIRROR_RING_SIZE - 1));
+    uint32_t len = __atomic_load_n((const uint32_t *)record,
+                                   __ATOMIC_ACQUIRE);
+    if (len & BPF_RINGBUF_BUSY_BIT) {
+      break; // not submitted yet, and neither is anything after it
+    }
+    bool discarded = len & BPF_RINGBUF_DISCARD_BIT;
+    len &= ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+    if (apply && !discarded && len == sizeof(struct mirror_event)) {
+      mirror_apply(m, (const struct mirror_event *)(record +
+                                                    BPF_RINGBUF_HDR_SZ));
+    }
+    consumer += (BPF_RINGBUF_HDR_SZ + len + 7) & ~7;
+    __atomic_store_n(m->consumer, consumer, __ATOMIC_RELEASE);
+  }
+}
+
+// Seed the map from the environment of pid. The probes were attached
+// before, and the events that came in until now are thrown away first, so
+// any call that the copy misses is still in the ring, and applying it again
+// later to a copy that already has it changes nothing.
+static int mirror_seed(pid_t pid, struct remote_arena *arena,
+                       struct mirror *m) {
+  uint64_t drops = mirror_info(m->info_fd, MIRROR_DROPS);
+  mirror_drain(m, false);
+  size_t used = arena->used;
+  struct remote_value *vars;
+  size_t count;
+  int ret = peek_environ(pid, arena, &vars, &count);
+  if (ret == 1) {
+    ret = dump_process(pid, arena, &vars, &count);
+  }
+  if (ret) {
+    return -1;
+  }
+  mirror_clear(m);
+  ret = -1;
+  for (size_t i = 0; i < count; i++) {
+    const char *var = vars[i].value;
+    const char *eq = memchr(var, '=', vars[i].len);
+    size_t name_len = eq == NULL ? 0 : eq - var;
+    if (name_len == 0 || name_len >= MIRROR_NAME_MAX - 1) {
+      continue;
+    }
+    char key[MIRROR_NAME_MAX] = {0};
+    memmove(key, var, name_len);
+    struct mirror_value v;
+    size_t value_len = vars[i].len - name_len - 1;
+    v.len = value_len >= MIRROR_VALUE_MAX ? MIRROR_TOO_LONG : value_len;
+    memmove(v.value, eq + 1, v.len == MIRROR_TOO_LONG ? 0 : value_len);
+    // the first definition is the one getenv(3) finds
+    if (map_update(m->vars_fd, key, &v, BPF_NOEXIST) && errno != EEXIST) {
+      perror("BPF_MAP_UPDATE_ELEM");
+      goto out;
+    }
+  }
+  if (mirror_set_info(m->info_fd, MIRROR_SEEN, drops) == 0 &&
+      mirror_set_info(m->info_fd, MIRROR_STALE, 0) == 0) {
+    ret = 0;
+  }
+  #ifdef DEBUG
+  fprintf(stderr, "mirror seeded with   %zu variables\n", count);
+  #endif
+
+out:
+  arena->used = used;
+  return ret;
+}
+
+// Connect to the mirror of pid, setting it up first if there is none, and
+// bring its map up to date.
+static int mirror_connect(pid_t pid, struct remote_arena *arena,
+                          struct mirror *m) {
+  int ret = mirror_open(pid, m);
+  if (ret == 1 && mirror_install(pid) == 0) {
+    ret = mirror_open(pid, m);
+    if (ret == 1) {
+      fprintf(stderr, "the mirror of process %d went away\n", pid);
+      ret = -1;
+    }
+  }
+  if (ret) {
+    return -1;
+  }
+  mirror_drain(m, true);
+  if (mirror_info(m->info_fd, MIRROR_STALE) ||
+      mirror_info(m->info_fd, MIRROR_DROPS) !=
+          mirror_info(m->info_fd, MIRROR_SEEN)) {
+    if (mirror_seed(pid, arena, m)) {
+      mirror_close(m);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// getenv_process() from the mirror. Returns 1 if one of the names cannot
+// be answered from there, because it is not one that is kept, or its value
+// is too long.
+static int mirror_getenv(pid_t pid, const char *const *names, size_t n,
+                         struct remote_arena *arena,
+                         struct remote_value *results) {
+  for (size_t i = 0; i < n; i++) {
+    size_t len = strlen(names[i]);
+    if (len == 0 || len >= MIRROR_NAME_MAX - 1 ||
+        strchr(names[i], '=') != NULL) {
+      return 1;
+    }
+  }
+  struct mirror m;
+  if (mirror_connect(pid, arena, &m)) {
+    return -1;
+  }
+  int ret = -1;
+  for (size_t i = 0; i < n; i++) {
+    char key[MIRROR_NAME_MAX] = {0};
+    strcpy(key, names[i]);
+    struct mirror_value v;
+    results[i] = (struct remote_value){0};
+    if (map_lookup(m.vars_fd, key, &v)) {
+      continue;
+    }
+    if (v.len == MIRROR_TOO_LONG) {
+      ret = 1;
+      goto out;
+    }
+    if (agent_copy(arena, v.value, v.len, &results[i])) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+out:
+  mirror_close(&m);
+  return ret;
+}
+
+// dump_process() from the mirror, in the order of the map rather than that
+// of the environment. Returns 1 if a value is too long to be in the map.
+static int mirror_dump(pid_t pid, struct remote_arena *arena,
+                       struct remote_value **vars, size_t *count) {
+  struct mirror m;
+  if (mirror_connect(pid, arena, &m)) {
+    return -1;
+  }
+  int ret = -1;
+  char key[MIRROR_NAME_MAX], next[MIRROR_NAME_MAX];
+  *count = 0;
+  for (const char *prev = NULL; map_next_key(m.vars_fd, prev, next) == 0;
+       prev = key) {
+    memmove(key, next, sizeof(key));
+    (*count)++;
+  }
+  *vars = arena_alloc(arena, *count * sizeof(struct remote_value));
+  if (*vars == NULL) {
+    goto out;
+  }
+  size_t i = 0;
+  for (const char *prev = NULL;
+       i < *count && map_next_key(m.vars_fd, prev, next) == 0; prev = key) {
+    memmove(key, next, sizeof(key));
+    struct mirror_value v;
+    if (map_lookup(m.vars_fd, key, &v)) {
+      continue;
+    }
+    if (v.len == MIRROR_TOO_LONG) {
+      ret = 1;
+      goto out;
+    }
+    size_t name_len = strlen(key);
+    char *var = arena_alloc(arena, name_len + 1 + v.len + 1);
+    if (var == NULL) {
+      goto out;
+    }
+    memmove(var, key, name_len);
+    var[name_len] = '=';
+    memmove(var + name_len + 1, v.value, v.len);
+    var[name_len + 1 + v.len] = '\0';
+    (*vars)[i++] = (struct remote_value){var, name_len + 1 + v.len};
+  }
+  *count = i;
+  ret = 0;
+
+out:
+  mirror_close(&m);
+  return ret;
+}
+
+// Detach the probes of the mirror of pid and remove its maps.
+static int mirror_unload(pid_t pid) {
+  char dir[64];
+  snprintf(dir, sizeof(dir), MIRROR_ROOT "/%d", pid);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      fprintf(stderr, "process %d has no mirror\n", pid);
+    } else {
+      perror(dir);
+    }
+    return -1;
+  }
+  int ret = -1;
+  if (flock(fd, LOCK_EX)) {
+    perror("flock");
+  } else {
+    ret = mirror_remove(dir);
+  }
+  close(fd);
+  return ret;
+}
+
+// Run a query with fresh scratch space, and turn a full arena into ENOBUFS.
+static int finish_query(struct remote_arena *arena, size_t used, int ret) {
+  arena->scratch = 0;
+  if (ret && arena_full) {
+    arena->used = used;
+    errno = ENOBUFS;
+  }
+  return ret ? -1 : 0;
+}
+
+// The arguments of a public query, which run() makes with run_query().
+struct query {
+  int (*run)(const struct query *q);
+  pid_t pid;
+  int flags;
+  const char *const *names;
+  const struct remote_update *updates;
+  size_t n;
+  struct remote_arena *arena;
+  struct remote_value *results;
+  struct remote_value **vars;
+  size_t *count;
+  struct remote_batch *batch;
+  size_t nbatch;
+  // for the thread of the query
+  struct remote_stats *stats;
+  int ret, err;
+};
+
+static void *query_thread(void *arg) {
+  struct query *q = arg;
+  stats = q->stats;
+  q->ret = q->run(q);
+  q->err = errno;
+  return NULL;
+}
+
+// With a timeout, a thread that was seized but did not stop in time is
+// given up on while it is still seized, and the interrupt that is pending
+// would stop it for good whenever it next wakes up, with nobody there to
+// let it go again. The interrupt cannot be taken back, and the thread
+// cannot be detached before it stops, but all tracees of a thread are
+// detached when that thread exits. So with a timeout, each query runs on a
+// thread of its own, which exits at the end of the query and releases
+// whatever it gave up on.
+static int run_query(struct query *q) {
+  if (timeout_ms == 0) {
+    return q->run(q);
+  }
+  q->stats = stats;
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, query_thread, q);
+  if (err) {
+    errno = err;
+    perror("pthread_create");
+    return -1;
+  }
+  pthread_join(thread, NULL);
+  errno = q->err;
+  return q->ret;
+}
+
+static int getenv_query(const struct query *q) {
+  pid_t pid = q->pid;
+  const char *const *names = q->names;
+  size_t n = q->n;
+  int flags = q->flags;
+  struct remote_arena *arena = q->arena;
+  struct remote_value *results = q->results;
+  size_t used = arena->used;
+  arena_full = false;
+  int ret = flags & REMOTE_MIRROR
+                ? mirror_getenv(pid, names, n, arena, results) : 1;
+  if (ret == 1 && flags & REMOTE_NO_STOP) {
+    ret = peek_getenv(pid, names, n, arena, results);
+  }
+  if (ret == 1 && flags & REMOTE_CONSISTENT) {
+    ret = consistent_getenv(pid, names, n, arena, results);
+  } else if (ret == 1) {
+    ret = flags & REMOTE_AGENT ? agent_getenv(pid, names, n, arena, results)
+                               : getenv_process(pid, names, n, arena, results);
+  }
+  return finish_query(arena, used, ret);
+}
+
+int remote_getenv(pid_t pid, const char *const *names, size_t n, int flags,
+                  struct remote_arena *arena, struct remote_value *results) {
+  struct query q = {
+    .run = getenv_query, .pid = pid, .flags = flags, .names = names,
+    .n = n, .arena = arena, .results = results,
+  };
+  return run_query(&q);
+}
+
+static int environ_query(const struct query *q) {
+  pid_t pid = q->pid;
+  int flags = q->flags;
+  struct remote_arena *arena = q->arena;
+  struct remote_value **vars = q->vars;
+  size_t *count = q->count;
+  size_t used = arena->used;
+  arena_full = false;
+  int ret = flags & REMOTE_MIRROR ? mirror_dump(pid, arena, vars, count) : 1;
+  if (ret == 1 && flags & REMOTE_NO_STOP) {
+    ret = peek_environ(pid, arena, vars, count);
+  }
+  if (ret == 1 && flags & REMOTE_CONSISTENT) {
+    ret = consistent_environ(pid, arena, vars, count);
+  } else if (ret == 1) {
+    ret = flags & REMOTE_AGENT ? agent_dump(pid, arena, vars, count)
+                               : dump_process(pid, arena, vars, count);
+  }
+  return finish_query(arena, used, ret);
+}
+
+int remote_environ(pid_t pid, int flags, struct remote_arena *arena,
+                   struct remote_value **vars, size_t *count) {
+  struct query q = {
+    .run = environ_query, .pid = pid, .flags = flags, .arena = arena,
+    .vars = vars, .count = count,
+  };
+  return run_query(&q);
+}
+
+int remote_environ_filter(const char *const *names, size_t n,
+                          struct remote_arena *arena,
+                          struct remote_value *vars, size_t *count) {
+  size_t used = arena->used;
+  arena_full = false;
+  struct name_table table;
+  size_t *first = arena_scratch(arena, n * sizeof(size_t));
+  int ret = first == NULL || name_table_init(&table, names, n, arena, first);
+  if (ret == 0) {
+    size_t kept = 0;
+    for (size_t j = 0; j < *count; j++) {
+      size_t len = split_var(vars[j].value, vars[j].len);
+      if (name_table_find(&table, vars[j].value, len) != 0) {
+        vars[kept++] = vars[j];
+      }
+    }
+    *count = kept;
+  }
+  return finish_query(arena, used, ret);
+}
+
+static int check_names(const struct remote_update *updates, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (updates[i].name[0] == '\0' || strchr(updates[i].name, '=') != NULL) {
+      fprintf(stderr, "invalid variable name: %s\n", updates[i].name);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Updates always stop the process: the agent makes no libc calls, and
+// setenv has to take the lock of the environment and may have to allocate.
+// The variables are read back in the same stop, and checked against the
+// last update of each.
+static int update_query(const struct query *q) {
+  pid_t pid = q->pid;
+  const struct remote_update *updates = q->updates;
+  size_t n = q->n;
+  struct remote_arena *arena = q->arena;
+  struct remote_value *results = q->results;
+  if (check_names(updates, n)) {
+    return -1;
+  }
+  size_t used = arena->used;
+  arena_full = false;
+  struct batch_calls calls = {.updates = updates, .nupdates = n, .n = n};
+  int ret = update_process(pid, &calls, arena, results);
+  if (ret == 0) {
+    struct remote_batch q = {.pid = pid, .results = results};
+    ret = check_updates(&q, updates, n);
+  }
+  return finish_query(arena, used, ret);
+}
+
+int remote_update(pid_t pid, const struct remote_update *updates, size_t n,
+                  struct remote_arena *arena, struct remote_value *results) {
+  struct query q = {
+    .run = update_query, .pid = pid, .updates = updates, .n = n,
+    .arena = arena, .results = results,
+  };
+  return run_query(&q);
+}
+
+// Finish the query of a process of a batch like finish_query() does, as
+// soon as it is done, and pass it on to its own done.
+static void batch_done(struct tracee *t, const struct batch_calls *calls) {
+  struct remote_batch *q = t->query;
+  if (q->ret == 0 && calls->updates != NULL) {
+    q->ret = check_updates(q, calls->updates, calls->nupdates);
+  }
+  q->arena->scratch = t->scratch;
+  q->err = 0;
+  if (q->ret) {
+    if (t->full) {
+      q->arena->used = t->used;
+      q->err = ENOBUFS;
+    }
+    q->ret = -1;
+  }
+  if (q->done != NULL) {
+    q->done(q);
+  }
+}
+
+// Run a batch, finishing the query of every process in it with
+// batch_done(). Returns 0 if all of them succeeded. Nothing is allocated:
+// the state of each process is kept in scratch space of its own arena, and
+// the list of them in that of the first one, below which every query
+// takes its own. A process whose arena has no room for it fails with
+// ENOBUFS right away, like one whose results do not fit.
+static int batch_query(struct remote_batch *batch, size_t nbatch,
+                       const struct batch_calls *calls) {
+  if (nbatch == 0) {
+    return 0;
+  }
+  arena_full = false;
+  struct tracee **tracees =
+      arena_scratch(batch[0].arena, nbatch * sizeof(struct tracee *));
+  size_t n = 0;
+  for (size_t i = 0; i < nbatch; i++) {
+    struct remote_arena *arena = batch[i].arena;
+    struct tracee *t =
+        tracees != NULL ? arena_scratch(arena, sizeof(struct tracee)) : NULL;
+    if (t == NULL) {
+      batch[i].ret = -1;
+      batch[i].err = ENOBUFS;
+      if (batch[i].done != NULL) {
+        batch[i].done(&batch[i]);
+      }
+      continue;
+    }
+    memset(t, 0, sizeof(*t));
+    t->query = &batch[i];
+    t->used = arena->used;
+    t->scratch = arena->scratch;
+    tracees[n++] = t;
+  }
+  run_batch(tracees, n, calls, batch_done);
+  int ret = 0;
+  for (size_t i = 0; i < nbatch; i++) {
+    batch[i].arena->scratch = 0;
+    if (batch[i].ret) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+static int getenv_batch_query(const struct query *q) {
+  struct batch_calls calls = {.names = q->names, .n = q->n};
+  return batch_query(q->batch, q->nbatch, &calls);
+}
+
+int remote_getenv_batch(struct remote_batch *batch, size_t nbatch,
+                        const char *const *names, size_t n) {
+  struct query q = {
+    .run = getenv_batch_query, .names = names, .n = n, .batch = batch,
+    .nbatch = nbatch,
+  };
+  return run_query(&q);
+}
+
+static int update_batch_query(const struct query *q) {
+  struct batch_calls calls = {
+    .updates = q->updates, .nupdates = q->n, .n = q->n,
+  };
+  return batch_query(q->batch, q->nbatch, &calls);
+}
+
+int remote_update_batch(struct remote_batch *batch, size_t nbatch,
+                        const struct remote_update *updates, size_t n) {
+  if (check_names(updates, n)) {
+    for (size_t i = 0; i < nbatch; i++) {
+      batch[i].ret = -1;
+      batch[i].err = EINVAL;
+    }
+    return -1;
+  }
+  struct query q = {
+    .run = update_batch_query, .updates = updates, .n = n, .batch = batch,
+    .nbatch = nbatch,
+  };
+  return run_query(&q);
+}
+
+// The strings have to be hashed as well as the address of the array and
+// the pointers in it: those change whenever glibc changes the environment,
+// but a putenv string can be rewritten by the program in place. They are
+// read with process_vm_readv into the arena, which bounds them like every
+// other copy, and given back afterwards.
+int remote_environ_version(pid_t pid, struct remote_arena *arena,
+                           uint64_t *version) {
+  struct libc_symbols syms;
+  if (resolve_libc(pid, &syms)) {
+    return -1;
+  }
+  if (no_vm_readv) {
+    return 1;
+  }
+  void *slot = (void *)syms.environ, *probe;
+  struct iovec local = {.iov_base = &probe, .iov_len = sizeof(probe)};
+  struct iovec remote = {.iov_base = slot, .iov_len = sizeof(probe)};
+  if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != sizeof(probe)) {
+    vm_readv_unavailable();
+    return 1;
+  }
+  size_t used = arena->used;
+  arena_full = false;
+  void *base;
+  void **array;
+  size_t len;
+  int ret = read_environ_array(pid, slot, arena, &base, &array, &len);
+  struct remote_value *vars = NULL;
+  if (ret == 0 &&
+      (vars = arena_alloc(arena, len * sizeof(struct remote_value))) == NULL) {
+    ret = -1;
+  }
+  if (ret == 0 && read_strings(pid, array, len, arena, vars)) {
+    // a string went away under us, so the environment is changing
+    if (!arena_full) {
+      arena->used = used;
+      arena->scratch = 0;
+      return 1;
+    }
+    ret = -1;
+  }
+  if (ret == 0) {
+    *version = hash_bytes(0xcbf29ce484222325, &base, sizeof(base));
+    *version = hash_bytes(*version, array, len * sizeof(void *));
+    for (size_t i = 0; i < len; i++) {
+      // with the NUL, so that the strings cannot run into each other
+      *version = hash_bytes(*version, vars[i].value, vars[i].len + 1);
+    }
+    arena->used = used;
+  }
+  return finish_query(arena, used, ret);
+}
+
+static int unload_query(const struct query *q) {
+  return agent_unload(q->pid);
+}
+
+int remote_unload(pid_t pid) {
+  struct query q = {.run = unload_query, .pid = pid};
+  return run_query(&q);
+}
+
+int remote_unmirror(pid_t pid) {
+  return mirror_unload(pid);
+}
@@ -0,0 +1,171 @@
+// libgetenv: read the live environment of other processes.
+//
+// The environment of a running process lives in its own memory, so
+// /proc/<pid>/environ only shows what it started with. These functions
+// attach to the process (or talk to an agent thread running in it, or read
+// its memory without stopping it at all) and return the current one.
+//
+// Errors are reported on stderr, and by returning -1. Results are never
+// allocated on the heap: they are carved out of a buffer that the caller
+// provides, so a polling loop can run without any allocations at all. If a
+// query does not fit in its arena, it fails with errno set to ENOBUFS and
+// without a message, and can be retried with a larger arena.
+#ifndef LIBGETENV_H
+#define LIBGETENV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The memory that results are stored in. Results are allocated upwards from
+// base + used, and the functions below take their scratch space downwards
+// from the end, giving it back before they return; scratch must be 0
+// between calls. Everything returned points into base, and stays valid
+// until the caller sets used back (usually to 0) to reuse the arena.
+struct remote_arena {
+  char *base;
+  size_t size;
+  size_t used;
+  size_t scratch;
+};
+
+// A string returned by a query, NUL terminated, or NULL if the variable is
+// not set. len does not count the NUL.
+struct remote_value {
+  const char *value;
+  size_t len;
+};
+
+enum remote_flags {
+  // Try to read the environment without stopping the process, and only
+  // stop it if it keeps changing under us, or if that is not allowed.
+  REMOTE_NO_STOP = 1,
+  // Go through the resident agent thread of the process, and start one in
+  // it if there is none yet. See remote_unload().
+  REMOTE_AGENT = 2,
+  // Answer from a mirror of the environment that uprobes on setenv(3) and
+  // friends keep up to date, and set one up if there is none yet. Needs
+  // CAP_BPF and CAP_PERFMON (or root). See remote_unmirror().
+  REMOTE_MIRROR = 4,
+  // Freeze every thread of the process rather than just one, so that no
+  // other thread can change the environment while it is copied. The names
+  // are then looked up in that copy instead of by calling getenv(3) there.
+  REMOTE_CONSISTENT = 8,
+};
+
+// Look up the n variables in names in the environment of pid, like
+// getenv(3) would in that process, and store their values in results.
+int remote_getenv(pid_t pid, const char *const *names, size_t n, int flags,
+                  struct remote_arena *arena, struct remote_value *results);
+
+// A change to make to an environment: set name to value, or unset it if
+// value is NULL.
+struct remote_update {
+  const char *name;
+  const char *value;
+};
+
+// Apply the n updates to the environment of pid in order, like setenv(3)
+// and unsetenv(3) would in that process, while it is stopped once. The
+// values of the names afterwards are read back into results, and the call
+// fails if they are not what the updates set them to.
+int remote_update(pid_t pid, const struct remote_update *updates, size_t n,
+                  struct remote_arena *arena, struct remote_value *results);
+
+// Copy the whole environment of pid, as *count "VAR=value" strings in
+// *vars, which is allocated from the arena as well.
+int remote_environ(pid_t pid, int flags, struct remote_arena *arena,
+                   struct remote_value **vars, size_t *count);
+
+// Keep only those of the *count vars returned by remote_environ() whose
+// names are one of the n in names, in place and in order, so the first
+// definition of each is still the one getenv(3) would find. An entry
+// without a '=' counts as a name.
+int remote_environ_filter(const char *const *names, size_t n,
+                          struct remote_arena *arena,
+                          struct remote_value *vars, size_t *count);
+
+// One process of a batch, with its own arena and results.
+struct remote_batch {
+  pid_t pid;
+  struct remote_arena *arena;
+  struct remote_value *results; // one for each name, or each update
+  struct remote_stats *stats;   // if not NULL, the timings are added here
+  int ret;                      // the result of its query, 0 or -1
+  int err;                      // and the errno for a -1, like ENOBUFS
+  // If not NULL, called with this entry as soon as its query is done and
+  // ret and err are set, while the rest of the batch goes on. It runs on
+  // the thread of the query, see remote_set_timeout().
+  void (*done)(struct remote_batch *q);
+  void *data;                   // for done
+};
+
+// Like remote_getenv() without any flags, for all of the nbatch processes
+// in batch at once: they are all attached to and injected into from the
+// calling thread, one stop at a time, so their stops overlap instead of
+// following one another. Returns 0 if all of the queries succeeded, and -1
+// if any failed.
+int remote_getenv_batch(struct remote_batch *batch, size_t nbatch,
+                        const char *const *names, size_t n);
+
+// Like remote_update(), for all of the processes in batch at once.
+int remote_update_batch(struct remote_batch *batch, size_t nbatch,
+                        const struct remote_update *updates, size_t n);
+
+// Without stopping pid, compute a value that changes whenever its
+// environment changes, from the address of its environ array, the pointers
+// in it and the strings they point to. The strings are copied into arena
+// for that, which is left as it was. Returns 1 if that cannot be done
+// without stopping it.
+int remote_environ_version(pid_t pid, struct remote_arena *arena,
+                           uint64_t *version);
+
+// Stop the resident agent of pid, and release everything it uses there.
+int remote_unload(pid_t pid);
+
+// Detach the probes of the mirror of pid, and remove its maps.
+int remote_unmirror(pid_t pid);
+
+// Bound how long a process is kept stopped by the queries on any thread,
+// in milliseconds, or 0 for no limit. This installs a handler for SIGALRM,
+// which is sent to the thread that runs the query when the time is up.
+// With a limit, each query runs on a short-lived thread of its own, and
+// updates only limit how long it takes to attach.
+int remote_set_timeout(long ms);
+
+// The phases of a query, as timed by remote_set_stats().
+enum remote_phase {
+  REMOTE_PHASE_ATTACH,   // attaching and waiting for the stop
+  REMOTE_PHASE_MMAP,     // the mmap(2) of the payload
+  REMOTE_PHASE_UPLOAD,   // copying the payload over
+  REMOTE_PHASE_CALL,     // running it, or waiting for the agent
+  REMOTE_PHASE_READBACK, // copying the results back
+  REMOTE_PHASE_RESTORE,  // restoring the registers
+  REMOTE_PHASE_DETACH,
+  REMOTE_NPHASES,
+};
+
+extern const char *const remote_phase_names[REMOTE_NPHASES];
+
+struct remote_stats {
+  uint64_t ns[REMOTE_NPHASES]; // time spent in each phase
+  uint64_t pause;              // how long the process was stopped
+};
+
+// Add the timings of the following queries on this thread to stats, until
+// this is called with NULL.
+void remote_set_stats(struct remote_stats *stats);
+
+// If on is not 0, log every ptrace(2) request and wait of the queries on
+// any thread to stderr, with when it started and how long it took.
+void remote_set_trace(int on);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif